@@ -25,11 +25,43 @@
 
 #include <glib.h>
 
+typedef enum _KeyModifier KpKeyModifier;
 typedef struct _Key KpKey;
 
+/**
+ * Modifier a key belongs to. Each modifier is one bit, so the held modifiers fit in one mask.
+ */
+enum _KeyModifier {
+    KP_KEY_MODIFIER_NONE  = 0,
+    KP_KEY_MODIFIER_CTRL  = 1 << 0,
+    KP_KEY_MODIFIER_SHIFT = 1 << 1,
+    KP_KEY_MODIFIER_ALT   = 1 << 2,
+    KP_KEY_MODIFIER_SUPER = 1 << 3,
+};
+
+#define KP_KEY_MODIFIER_COUNT 4
+
+/**
+ * Keyboards never use keycodes below 8, mouse buttons use them instead:
+ * 1-3 are the left, middle and right button, 4-7 are wheel ticks up, down, left and right.
+ */
+#define KP_KEY_BUTTON_COUNT 8
+#define KP_KEY_BUTTON_WHEEL_FIRST 4
+
+static inline gboolean
+kp_key_is_button(guint code) {
+    return code > 0 && code < KP_KEY_BUTTON_COUNT;
+}
+
+static inline gboolean
+kp_key_is_wheel(guint code) {
+    return code >= KP_KEY_BUTTON_WHEEL_FIRST && code < KP_KEY_BUTTON_COUNT;
+}
+
 struct _Key {
     guint16 code;
     gchar *label;
+    KpKeyModifier modifier;
 };
 
 #endif //KEYPRESENTER_KEY_H
@@ -26,28 +26,78 @@
 #include <glib.h>
 
 #include "key.h"
+#include "keymodel.h"
 #include "poll.h"
 
+typedef enum _KeyboardFeatures KpKeyboardFeatures;
+
+/**
+ * Optional input the keyboard implementation listens for besides the keys
+ */
+enum _KeyboardFeatures {
+    KP_KEYBOARD_FEATURE_NONE = 0,
+
+    /**
+     * Mouse buttons and wheel ticks, reported as keys with the codes described at KP_KEY_BUTTON_COUNT
+     */
+    KP_KEYBOARD_FEATURE_BUTTONS = 1 << 0,
+};
+
 /**
  * Called when the keyboard needs to be initialized.
  *
+ * @param features KpKeyboardFeatures mask, implementations ignore the features they do not support
  * @return (Optional) ptr to an internal data structure used by the keyboard implementation
  */
 gpointer
-kp_keyboard_init(GtkWindow *window);
+kp_keyboard_init(GtkWindow *window, KpKeyboardFeatures features);
 
 /**
- * Retrieve all available keys on the keyboard.
+ * Retrieve all available keys on the keyboard, and the mouse buttons if they were enabled. The keys are not placed on the grid yet.
  *
- * @return Ptr to a GArray with elements of KpKey pointer
+ * @return Ptr to a new KpKeyModel, to be freed with kp_key_model_free
  */
-GArray *
+KpKeyModel *
 kp_keyboard_get_keys(GtkWindow *window, gpointer internal_keyboard_data);
 
 /**
- * GTask which listens for libXi keyboard presses
+ * Retrieve the name of the active keyboard layout as XKB knows it, e.g. "us" or "de".
+ * When several layouts are configured only the first one is returned.
+ *
+ * @return (Optional) New string to be freed with g_free, or NULL if the layout is unknown
+ */
+gchar *
+kp_keyboard_get_layout_name(gpointer internal_keyboard_data);
+
+/**
+ * Retrieve the amount of X displays the keyboard implementation listens on.
+ * Safe to call while kp_keyboard_poll_task runs, displays which it attaches later are announced with POLL_DISPLAY_ADDED.
+ *
+ * @return Amount of displays, 0 if the implementation does not use a display server
+ */
+guint
+kp_keyboard_get_display_count(gpointer internal_keyboard_data);
+
+/**
+ * @param index Less than the amount returned by kp_keyboard_get_display_count
+ * @return Name of the display as passed to XOpenDisplay, e.g. ":1", owned by the keyboard implementation
+ *         and valid until kp_keyboard_free
+ */
+const gchar *
+kp_keyboard_get_display_name(gpointer internal_keyboard_data, guint index);
+
+/**
+ * GTask which listens for libXi keyboard presses.
+ * When the task is cancelled it wakes up immediately, closes its connections and returns G_IO_ERROR_CANCELLED.
  */
 void
 kp_keyboard_poll_task(GTask *task, gpointer source_obj, gpointer poll_task_result, GCancellable *cancellable);
 
+/**
+ * Free the internal data structure returned by kp_keyboard_init.
+ * Must not be called before kp_keyboard_poll_task has returned.
+ */
+void
+kp_keyboard_free(gpointer internal_keyboard_data);
+
 #endif //KEYPRESENTER_KEYBOARD_H
@@ -0,0 +1,129 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keymodel.h
+ * @brief Definition of the flat KpKeyModel structure, which holds every shown key indexed by keycode
+ */
+
+#ifndef KEYPRESENTER_KEYMODEL_H
+#define KEYPRESENTER_KEYMODEL_H
+
+#include <glib.h>
+
+/**
+ * Amount of keycodes in the model, keycodes are 8 bits wide.
+ */
+#define KP_KEY_MODEL_SIZE 256
+
+/**
+ * Grid units per key, so keys can be placed and sized in quarters of a key
+ */
+#define KP_KEY_MODEL_UNIT 4
+
+typedef struct _KeyModel KpKeyModel;
+
+struct _KeyModel {
+    /**
+     * Amount of keys in the model
+     */
+    guint count;
+
+    /**
+     * Keycodes of the keys in the order they were added, only the first count elements are valid
+     */
+    guint16 codes[KP_KEY_MODEL_SIZE];
+
+    /**
+     * TRUE if the keycode is in the model
+     */
+    gboolean present[KP_KEY_MODEL_SIZE];
+
+    /**
+     * Labels of the keys, not owned by the model
+     */
+    gchar *labels[KP_KEY_MODEL_SIZE];
+
+    /**
+     * Grid position of the keys in KP_KEY_MODEL_UNIT per key, a span of 0 means the key has not been placed and is not drawn
+     */
+    guint8 columns[KP_KEY_MODEL_SIZE];
+    guint8 rows[KP_KEY_MODEL_SIZE];
+    guint8 spans[KP_KEY_MODEL_SIZE];
+
+    /**
+     * Highlight of the keys, 0.0 when released and 1.0 when just pressed
+     */
+    gdouble intensities[KP_KEY_MODEL_SIZE];
+
+    /**
+     * Keyboard slot (KpKeyboardPoll.device) of the last press of each key, it selects the color of the key
+     */
+    guint8 devices[KP_KEY_MODEL_SIZE];
+};
+
+KpKeyModel *
+kp_key_model_new(void);
+
+void
+kp_key_model_free(KpKeyModel *model);
+
+/**
+ * Add a key to the model.
+ *
+ * @return FALSE if the keycode is out of range or already in the model
+ */
+gboolean
+kp_key_model_add(KpKeyModel *model, guint16 code, gchar *label);
+
+/**
+ * @return TRUE if the keycode is in the model
+ */
+static inline gboolean
+kp_key_model_contains(const KpKeyModel *model, guint16 code) {
+    return code < KP_KEY_MODEL_SIZE && model->present[code];
+}
+
+/**
+ * Place a key on the keyboard grid, all positions are in KP_KEY_MODEL_UNIT per key.
+ *
+ * @param column Column of the left edge of the key
+ * @param row Row of the top edge of the key
+ * @param span Amount of columns the key spans
+ */
+void
+kp_key_model_place(KpKeyModel *model, guint16 code, guint8 column, guint8 row, guint8 span);
+
+/**
+ * @return FALSE if the key is not in the model or the label is unchanged
+ */
+gboolean
+kp_key_model_set_label(KpKeyModel *model, guint16 code, gchar *label);
+
+/**
+ * @return FALSE if the key is not in the model or the intensity is unchanged
+ */
+gboolean
+kp_key_model_set_intensity(KpKeyModel *model, guint16 code, gdouble intensity);
+
+/**
+ * @return FALSE if the key is not in the model or the device is unchanged
+ */
+gboolean
+kp_key_model_set_device(KpKeyModel *model, guint16 code, guint8 device);
+
+#endif //KEYPRESENTER_KEYMODEL_H
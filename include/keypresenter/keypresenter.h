@@ -25,6 +25,7 @@
 
 #include "key.h"
 #include "keyboard.h"
+#include "keymodel.h"
 #include "poll.h"
 #include "pollresult.h"
 
@@ -28,12 +28,32 @@
 #include "key.h"
 #include "pollresult.h"
 
+/**
+ * Amount of physical keyboards which are told apart. Device 0 stands for every keyboard which has no slot of its own.
+ */
+#define KP_POLL_DEVICE_COUNT 8
+
 typedef struct _KeyboardPoll KpKeyboardPoll;
 
 struct _KeyboardPoll {
     KpKeyboardPollResult result;
     KpKey key;
     gboolean pressed;
+
+    /**
+     * Timestamp of the event in milliseconds as given by the input source, or 0 if unknown
+     */
+    guint32 time;
+
+    /**
+     * Index of the display (or device) the event came from
+     */
+    guint16 display;
+
+    /**
+     * Slot of the physical keyboard the event came from, below KP_POLL_DEVICE_COUNT
+     */
+    guint8 device;
 };
 
 #endif //KEYPRESENTER_POLL_H
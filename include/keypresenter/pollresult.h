@@ -29,6 +29,22 @@ enum _KeyboardPollResult {
     POLL_EMPTY = 0,
     POLL_OK    = 1,
     POLL_ERROR = 2,
+
+    /**
+     * The label of the key has changed because the keyboard mapping was changed.
+     */
+    POLL_KEYMAP_CHANGED = 3,
+
+    /**
+     * A key has appeared after kp_keyboard_get_keys, e.g. on a display which answered late.
+     * It is to be added to the key model with the label of the poll.
+     */
+    POLL_KEY_ADDED = 4,
+
+    /**
+     * A display has been attached after kp_keyboard_init, the display of the poll is its index.
+     */
+    POLL_DISPLAY_ADDED = 5,
 };
 
 #endif //KEYPRESENTER_POLLRESULT_H
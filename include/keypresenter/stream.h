@@ -0,0 +1,215 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file stream.h
+ * @brief Layout of the shared-memory event stream, for programs which read keystrokes from a running keypresenter
+ *
+ * With --stream=NAME keypresenter creates the POSIX shared memory object /NAME and publishes every event the poll
+ * thread sees into it. The object is a KpStream: a KpStreamHeader followed by a ring of KpStreamRecord.
+ *
+ * There is a single writer and any amount of readers. Readers never take a lock and the writer never waits for them,
+ * a reader which falls more than the capacity behind loses the oldest records and is told how many it lost.
+ * A reader attaches by mapping the object read-write (only KpStreamHeader.waiters is written to), checking the magic
+ * and version (the version is 0 while the writer is still setting up) and starting with kp_stream_get_written as its
+ * cursor. It detaches by unmapping the object.
+ *
+ * All fields are stored in host byte order. Fields may only be appended, a change to the meaning of an existing field
+ * increments KP_STREAM_VERSION.
+ */
+
+#ifndef KEYPRESENTER_STREAM_H
+#define KEYPRESENTER_STREAM_H
+
+#include <glib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define KP_STREAM_MAGIC "KPST"
+#define KP_STREAM_VERSION 1
+
+/**
+ * Longest label of a record, including the terminator. Longer labels are truncated.
+ */
+#define KP_STREAM_LABEL_SIZE 16
+
+typedef struct _StreamHeader KpStreamHeader;
+typedef struct _StreamRecord KpStreamRecord;
+typedef struct _Stream KpStream;
+
+/**
+ * Start of the shared memory object. Each group of fields has a cache line of its own,
+ * so readers which wait do not slow down the writer.
+ */
+struct _StreamHeader {
+    gchar magic[4];
+    guint16 version;
+
+    /**
+     * sizeof(KpStreamRecord), so readers can skip fields they do not know
+     */
+    guint16 record_size;
+
+    /**
+     * Amount of records in the ring, a power of two
+     */
+    guint32 capacity;
+
+    /**
+     * Offset in bytes of the first record from the start of the object
+     */
+    guint32 records_offset;
+
+    /**
+     * Wall clock time in microseconds at which the stream was created, it changes when keypresenter is restarted
+     */
+    gint64 started_at;
+
+    /**
+     * Set to 1 when keypresenter quits, readers should detach. The object is unlinked at the same time.
+     */
+    guint32 closed;
+
+    guint8 reserved0[36];
+
+    /**
+     * Amount of records which have been published. Record n (counting from 0) is at index n % capacity.
+     * The count wraps around at 2^32, compare counts by unsigned subtraction.
+     */
+    guint32 written;
+
+    /**
+     * Futex word which is incremented after every batch of records, see kp_stream_wait
+     */
+    guint32 notify;
+
+    guint8 reserved1[56];
+
+    /**
+     * Amount of readers in kp_stream_wait, the writer only wakes the futex when it is not 0
+     */
+    gint32 waiters;
+
+    guint8 reserved2[60];
+};
+
+/**
+ * One KpKeyboardPoll, flattened so it can be read by another process.
+ */
+struct _StreamRecord {
+    /**
+     * Number of the record plus 1 once the record is complete, 0 while the writer is changing it
+     */
+    guint32 sequence;
+
+    /**
+     * Timestamp of the event in milliseconds as given by the input source, or 0 if unknown
+     */
+    guint32 time;
+
+    guint16 code;
+    guint16 display;
+
+    /**
+     * KpKeyboardPollResult, KpKeyModifier of the key, 1 for presses and the slot of the physical keyboard
+     */
+    guint8 result;
+    guint8 modifier;
+    guint8 pressed;
+    guint8 device;
+
+    gchar label[KP_STREAM_LABEL_SIZE];
+};
+
+struct _Stream {
+    KpStreamHeader header;
+    KpStreamRecord records[];
+};
+
+G_STATIC_ASSERT(sizeof(KpStreamHeader) == 192);
+G_STATIC_ASSERT(sizeof(KpStreamRecord) == 32);
+
+/**
+ * @return Amount of records which have been published, a new reader starts reading there
+ */
+static inline guint32
+kp_stream_get_written(const KpStream *stream) {
+    return (guint32) g_atomic_int_get(&stream->header.written);
+}
+
+/**
+ * Copy the record at the cursor of a reader.
+ *
+ * @param cursor Number of the next record to read, advanced past the record that has been read
+ * @param lost (Optional) increased by the amount of records which were overwritten before they could be read
+ * @return FALSE if there is no new record
+ */
+static inline gboolean
+kp_stream_read(const KpStream *stream, guint32 *cursor, KpStreamRecord *record, guint32 *lost) {
+    guint32 capacity = stream->header.capacity;
+
+    for (;;) {
+        guint32 written = kp_stream_get_written(stream);
+
+        if (written == *cursor) {
+            return FALSE;
+        }
+
+        // The writer has lapped the reader, skip to the oldest record which is still there
+        if (written - *cursor > capacity) {
+            if (lost != NULL) {
+                *lost += written - capacity - *cursor;
+            }
+            *cursor = written - capacity;
+        }
+
+        const KpStreamRecord *slot = &stream->records[*cursor & (capacity - 1)];
+        guint32 sequence = (guint32) g_atomic_int_get(&slot->sequence);
+
+        if (sequence == *cursor + 1) {
+            *record = *slot;
+
+            // The copy only counts if the writer has not started to overwrite the record in the meantime
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if ((guint32) g_atomic_int_get(&slot->sequence) == sequence) {
+                (*cursor)++;
+                return TRUE;
+            }
+        }
+
+        // The record is being overwritten, written moves past it as soon as the writer is done
+    }
+}
+
+/**
+ * Sleep until the writer publishes a batch of records after notify was read.
+ * Read header.notify before draining the ring with kp_stream_read, and pass that value, so no batch is missed.
+ *
+ * @param timeout_ms Longest time to sleep, or -1 to sleep until the next batch
+ */
+static inline void
+kp_stream_wait(KpStream *stream, guint32 notify, gint timeout_ms) {
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+
+    g_atomic_int_inc(&stream->header.waiters);
+    syscall(SYS_futex, &stream->header.notify, FUTEX_WAIT, notify, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    (void) g_atomic_int_dec_and_test(&stream->header.waiters);
+}
+
+#endif //KEYPRESENTER_STREAM_H
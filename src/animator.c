@@ -0,0 +1,110 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file animator.c
+ * @brief Frame clock driven decay animation of pressed keys
+ */
+
+#include "animator.h"
+#include "macro.h"
+
+gboolean
+kp_animator_advance(KpAnimator *animator, gint64 now) {
+    guint i = 0;
+
+    while (i < animator->active_count) {
+        guint16 keycode = animator->active_keys[i];
+        gint64 elapsed = MAX(now - animator->last_pressed[keycode], 0);
+
+        if (elapsed >= animator->duration) {
+            animator->func(keycode, 0.0, animator->user_data);
+
+            // Swap the last active key into this slot, order does not matter.
+            animator->is_active[keycode] = FALSE;
+            animator->active_keys[i] = animator->active_keys[--animator->active_count];
+            continue;
+        }
+
+        animator->func(keycode, 1.0 - (gdouble) elapsed / (gdouble) animator->duration, animator->user_data);
+        i++;
+    }
+
+    return animator->active_count > 0;
+}
+
+static gboolean
+on_tick(GtkWidget *UNUSED(widget), GdkFrameClock *frame_clock, gpointer animator_p) {
+    KpAnimator *animator = animator_p;
+
+    if (!kp_animator_advance(animator, gdk_frame_clock_get_frame_time(frame_clock))) {
+        // Stop the frame clock, so an idle window does not wake up at all.
+        animator->tick_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+KpAnimator *
+kp_animator_new(GtkWidget *widget, guint duration, KpAnimatorFunc func, gpointer user_data) {
+    KpAnimator *animator = g_new0(KpAnimator, 1);
+
+    animator->widget = widget;
+    animator->duration = (gint64) duration * G_TIME_SPAN_MILLISECOND;
+    animator->func = func;
+    animator->user_data = user_data;
+
+    return animator;
+}
+
+void
+kp_animator_free(KpAnimator *animator) {
+    if (animator == NULL) {
+        return;
+    }
+
+    if (animator->tick_id != 0) {
+        gtk_widget_remove_tick_callback(animator->widget, animator->tick_id);
+    }
+
+    g_free(animator);
+}
+
+void
+kp_animator_press(KpAnimator *animator, guint16 keycode) {
+    kp_animator_press_at(animator, keycode, g_get_monotonic_time());
+}
+
+void
+kp_animator_press_at(KpAnimator *animator, guint16 keycode, gint64 time) {
+    if (keycode >= KP_ANIMATOR_KEY_COUNT) {
+        return;
+    }
+
+    animator->last_pressed[keycode] = time;
+
+    if (!animator->is_active[keycode]) {
+        animator->is_active[keycode] = TRUE;
+        animator->active_keys[animator->active_count++] = keycode;
+        animator->func(keycode, 1.0, animator->user_data);
+    }
+
+    if (animator->widget != NULL && animator->tick_id == 0) {
+        animator->tick_id = gtk_widget_add_tick_callback(animator->widget, on_tick, animator, NULL);
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file animator.h
+ * @brief Frame clock driven decay animation of pressed keys
+ */
+
+#ifndef KEYPRESENTER_ANIMATOR_H
+#define KEYPRESENTER_ANIMATOR_H
+
+#include <gtk/gtk.h>
+
+/**
+ * Amount of keycodes which can be animated, keycodes are 8 bits wide.
+ */
+#define KP_ANIMATOR_KEY_COUNT 256
+
+/**
+ * Time in milliseconds a pressed key takes to decay, shared by the user interface and the benchmark
+ */
+#ifndef DEFAULT_KEY_ANIMATION_TIMEOUT
+#define DEFAULT_KEY_ANIMATION_TIMEOUT 300
+#endif
+
+typedef struct _Animator KpAnimator;
+
+/**
+ * Called once per frame for every animated key.
+ *
+ * @param intensity 1.0 right after the key has been pressed, decaying to 0.0 when the animation has finished
+ */
+typedef void (*KpAnimatorFunc)(guint16 keycode, gdouble intensity, gpointer user_data);
+
+struct _Animator {
+    /**
+     * Widget whose frame clock drives the animation, or NULL if kp_animator_advance is called by the owner
+     */
+    GtkWidget *widget;
+
+    /**
+     * ID of the tick callback, or 0 if the frame clock is not being used.
+     */
+    guint tick_id;
+
+    /**
+     * Duration of the decay in microseconds
+     */
+    gint64 duration;
+
+    /**
+     * Monotonic time in microseconds at which each key was last pressed
+     */
+    gint64 last_pressed[KP_ANIMATOR_KEY_COUNT];
+
+    /**
+     * TRUE for keys which are in active_keys
+     */
+    gboolean is_active[KP_ANIMATOR_KEY_COUNT];
+
+    /**
+     * Keycodes of the keys which are animating, so a frame only visits those
+     */
+    guint16 active_keys[KP_ANIMATOR_KEY_COUNT];
+    guint active_count;
+
+    KpAnimatorFunc func;
+    gpointer user_data;
+};
+
+/**
+ * @param widget (Optional) NULL to drive the animation with kp_animator_advance instead of a frame clock
+ * @param duration Time in milliseconds it takes for a key to decay
+ */
+KpAnimator *
+kp_animator_new(GtkWidget *widget, guint duration, KpAnimatorFunc func, gpointer user_data);
+
+void
+kp_animator_free(KpAnimator *animator);
+
+/**
+ * (Re)start the animation of a key. Repeated presses only refresh the timestamp of the key.
+ */
+void
+kp_animator_press(KpAnimator *animator, guint16 keycode);
+
+/**
+ * Like kp_animator_press, at a time on the clock which is passed to kp_animator_advance.
+ */
+void
+kp_animator_press_at(KpAnimator *animator, guint16 keycode, gint64 time);
+
+/**
+ * Call the KpAnimatorFunc for every animating key, as the frame clock does for animators with a widget.
+ *
+ * @param now Time of the frame in microseconds
+ * @return TRUE while keys are still animating
+ */
+gboolean
+kp_animator_advance(KpAnimator *animator, gint64 now);
+
+#endif //KEYPRESENTER_ANIMATOR_H
@@ -23,6 +23,7 @@
 #ifndef KEYPRESENTER_APPSTATE_H
 #define KEYPRESENTER_APPSTATE_H
 
+#include <cairo.h>
 #include <glib.h>
 
 #define APP_STATE(app_state) (((AppState*) app_state))
@@ -32,6 +33,12 @@ typedef struct _AppState AppState;
 struct _AppState {
     gboolean screen_supports_alpha_channel;
     gboolean is_transparent;
+
+    /**
+     * Source used to paint the window background.
+     * Only rebuilt when is_transparent or the visual changes, NULL until the next draw.
+     */
+    cairo_pattern_t *background;
 };
 
 #endif //KEYPRESENTER_APPSTATE_H
@@ -0,0 +1,390 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file bench.c
+ * @brief Latency benchmark which injects keys into an Xvfb display with XTest
+ *
+ * Measures the time from injecting a press to its dispatch in the main loop, and to the first frame painted after it.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include <keypresenter/keypresenter.h>
+#include "bench.h"
+#include "keyboardview.h"
+#include "macro.h"
+
+#ifndef DEFAULT_BENCH_DISPLAY
+#define DEFAULT_BENCH_DISPLAY ":99"
+#endif
+
+/**
+ * Time in milliseconds the benchmark waits for the last presses to arrive after injecting
+ */
+#ifndef DEFAULT_BENCH_SETTLE_TIME
+#define DEFAULT_BENCH_SETTLE_TIME 500
+#endif
+
+/**
+ * Time in milliseconds Xvfb gets to create its socket
+ */
+#ifndef DEFAULT_BENCH_XVFB_TIMEOUT
+#define DEFAULT_BENCH_XVFB_TIMEOUT 5000
+#endif
+
+static gchar *option_display = NULL;
+static gchar *option_mode = "steady";
+static gint option_rate = 1000;
+static gint option_count = 10000;
+static gint option_burst = 64;
+
+static GOptionEntry OPTION_ENTRIES[] = {
+        {"display", 'd', 0, G_OPTION_ARG_STRING, &option_display, "Use a running X server instead of starting Xvfb", "NAME"},
+        {"mode", 'm', 0, G_OPTION_ARG_STRING, &option_mode, "Injection pattern: steady, burst or repeat", "MODE"},
+        {"rate", 'r', 0, G_OPTION_ARG_INT, &option_rate, "Presses (or bursts) per second", "N"},
+        {"count", 'n', 0, G_OPTION_ARG_INT, &option_count, "Amount of presses", "N"},
+        {"burst", 'b', 0, G_OPTION_ARG_INT, &option_burst, "Presses per burst", "N"},
+        {NULL}
+};
+
+/**
+ * Start Xvfb and wait until it accepts connections.
+ *
+ * @return The pid of Xvfb, or 0 if it could not be started
+ */
+static GPid
+start_xvfb(const gchar *display_name) {
+    gchar *argv[] = {"Xvfb", (gchar *) display_name, "-nolisten", "tcp", NULL};
+    gchar *socket_path = g_strconcat("/tmp/.X11-unix/X", display_name + 1, NULL);
+    GError *error = NULL;
+    GPid pid = 0;
+
+    // Another server, or a stale socket of one, would be benchmarked instead of the new Xvfb
+    if (g_file_test(socket_path, G_FILE_TEST_EXISTS)) {
+        fprintf(stderr, "%s already exists, stop the server on %s or use --display.\n", socket_path, display_name);
+        g_free(socket_path);
+        return 0;
+    }
+
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &pid, &error)) {
+        fprintf(stderr, "Could not start Xvfb: %s\n", error->message);
+        g_error_free(error);
+        g_free(socket_path);
+        return 0;
+    }
+
+    for (gint waited = 0; waited < DEFAULT_BENCH_XVFB_TIMEOUT && !g_file_test(socket_path, G_FILE_TEST_EXISTS); waited += 50) {
+        g_usleep(50 * G_TIME_SPAN_MILLISECOND);
+    }
+
+    if (!g_file_test(socket_path, G_FILE_TEST_EXISTS)) {
+        fprintf(stderr, "Xvfb did not create %s within %d ms.\n", socket_path, DEFAULT_BENCH_XVFB_TIMEOUT);
+        kill(pid, SIGTERM);
+        g_spawn_close_pid(pid);
+        pid = 0;
+    }
+
+    g_free(socket_path);
+
+    return pid;
+}
+
+static gboolean
+on_injection_done(gpointer bench_state) {
+    g_cancellable_cancel(BENCH_STATE(bench_state)->cancellable);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+sleep_until(gint64 deadline) {
+    gint64 remaining = deadline - g_get_monotonic_time();
+
+    if (remaining > 0) {
+        g_usleep(remaining);
+    }
+}
+
+/**
+ * Thread which injects the presses over its own connection, so the main loop is never blocked by it.
+ */
+static gpointer
+inject_keys(gpointer bench_state) {
+    KpBenchState *state = BENCH_STATE(bench_state);
+    Display *display = XOpenDisplay(state->display_name);
+    gint64 interval = G_USEC_PER_SEC / MAX(state->rate, 1);
+    gint64 next = g_get_monotonic_time();
+
+    if (display == NULL) {
+        fprintf(stderr, "Could not connect to %s for injecting keys.\n", state->display_name);
+        g_idle_add(on_injection_done, state);
+        return NULL;
+    }
+
+    for (gint i = 0; i < state->count; ++i) {
+        if (state->mode == BENCH_MODE_STEADY || (state->mode == BENCH_MODE_BURST && i % state->burst_size == 0)) {
+            sleep_until(next);
+            next += interval;
+        }
+
+        guint16 keycode = state->keycodes[i % DEFAULT_BENCH_KEYS];
+
+        state->injected_at[i] = g_get_monotonic_time();
+        g_atomic_int_set(&state->injected, i + 1);
+
+        XTestFakeKeyEvent(display, keycode, True, CurrentTime);
+        if (state->mode != BENCH_MODE_REPEAT) {
+            XTestFakeKeyEvent(display, keycode, False, CurrentTime);
+        }
+        XFlush(display);
+    }
+
+    if (state->mode == BENCH_MODE_REPEAT) {
+        for (guint key = 0; key < DEFAULT_BENCH_KEYS; ++key) {
+            XTestFakeKeyEvent(display, state->keycodes[key], False, CurrentTime);
+        }
+    }
+
+    XSync(display, False);
+    XCloseDisplay(display);
+
+    g_usleep(DEFAULT_BENCH_SETTLE_TIME * G_TIME_SPAN_MILLISECOND);
+    g_idle_add(on_injection_done, state);
+
+    return NULL;
+}
+
+/**
+ * @return Index of the keycode in the injected keycodes, or -1 if it is not injected
+ */
+static gint
+find_bench_key(const KpBenchState *state, guint16 keycode) {
+    for (gint key = 0; key < DEFAULT_BENCH_KEYS; ++key) {
+        if (state->keycodes[key] == keycode) {
+            return key;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Match a dispatched press to the first injection of its key which has not been passed yet.
+ * Presses arrive in order, so a lost press is skipped instead of shifting every later sample.
+ */
+static void
+on_bench_poll(KpKeyboardPoll *poll, gpointer bench_state) {
+    KpBenchState *state = BENCH_STATE(bench_state);
+    gint64 now = g_get_monotonic_time();
+    gint key;
+
+    if (poll->result != POLL_OK || !poll->pressed || (key = find_bench_key(state, poll->key.code)) < 0) {
+        return;
+    }
+
+    guint press = state->next_press + (key + DEFAULT_BENCH_KEYS - state->next_press % DEFAULT_BENCH_KEYS) % DEFAULT_BENCH_KEYS;
+
+    if (press >= (guint) g_atomic_int_get(&state->injected)) {
+        state->unmatched++;
+        return;
+    }
+
+    state->next_press = press + 1;
+    state->matched[state->dispatched] = press;
+    state->dispatched_at[state->dispatched++] = now;
+    kp_animator_press(state->task_result->animator, poll->key.code);
+}
+
+static void
+on_after_paint(GdkFrameClock *UNUSED(frame_clock), gpointer bench_state) {
+    KpBenchState *state = BENCH_STATE(bench_state);
+    gint64 now = g_get_monotonic_time();
+
+    while (state->painted < state->dispatched) {
+        state->painted_at[state->painted++] = now;
+    }
+}
+
+static void
+on_key_animation_frame(guint16 keycode, gdouble intensity, gpointer bench_state) {
+    KpBenchState *state = BENCH_STATE(bench_state);
+
+    kp_keyboard_view_set_key_intensity(KP_KEYBOARD_VIEW(state->keyboard_view), keycode, intensity);
+}
+
+static void
+on_poll_task_done(GObject *UNUSED(source_obj), GAsyncResult *UNUSED(res), gpointer UNUSED(user_data)) {
+    gtk_main_quit();
+}
+
+static gint
+compare_latency(gconstpointer a, gconstpointer b) {
+    gint64 left = *(const gint64 *) a, right = *(const gint64 *) b;
+
+    return (left > right) - (left < right);
+}
+
+/**
+ * @param matched Press number of every sample, to look up its injection
+ */
+static void
+print_latencies(const gchar *name, const gint64 *injected_at, const guint *matched, const gint64 *to, guint count) {
+    if (count == 0) {
+        fprintf(stdout, "%-10s no samples\n", name);
+        return;
+    }
+
+    gint64 *latencies = g_new(gint64, count);
+    for (guint i = 0; i < count; ++i) {
+        latencies[i] = to[i] - injected_at[matched[i]];
+    }
+
+    qsort(latencies, count, sizeof(gint64), compare_latency);
+
+    fprintf(stdout, "%-10s n=%-8u p50=%6" G_GINT64_FORMAT " us  p99=%6" G_GINT64_FORMAT " us  max=%6" G_GINT64_FORMAT " us\n",
+            name, count, latencies[count / 2], latencies[(count - 1) * 99 / 100], latencies[count - 1]);
+
+    g_free(latencies);
+}
+
+gint
+main(gint argc, gchar **argv) {
+    GOptionContext *context = g_option_context_new("- measure keypresenter input latency");
+    GError *error = NULL;
+    GPid xvfb_pid = 0;
+    KpBenchState state = {0};
+
+    g_option_context_add_main_entries(context, OPTION_ENTRIES, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (g_strcmp0(option_mode, "steady") == 0) {
+        state.mode = BENCH_MODE_STEADY;
+    } else if (g_strcmp0(option_mode, "burst") == 0) {
+        state.mode = BENCH_MODE_BURST;
+    } else if (g_strcmp0(option_mode, "repeat") == 0) {
+        state.mode = BENCH_MODE_REPEAT;
+    } else {
+        fprintf(stderr, "Unknown mode %s.\n", option_mode);
+        return EXIT_FAILURE;
+    }
+
+    state.display_name = option_display != NULL ? option_display : DEFAULT_BENCH_DISPLAY;
+    state.rate = option_rate;
+    state.count = MAX(option_count, 1);
+    state.burst_size = MAX(option_burst, 1);
+    state.injected_at = g_new0(gint64, state.count);
+    state.matched = g_new0(guint, state.count);
+    state.dispatched_at = g_new0(gint64, state.count);
+    state.painted_at = g_new0(gint64, state.count);
+
+    if (option_display == NULL && (xvfb_pid = start_xvfb(state.display_name)) == 0) {
+        return EXIT_FAILURE;
+    }
+
+    // The window, the keyboard backend and the injection thread all use the benchmark display.
+    g_setenv("DISPLAY", state.display_name, TRUE);
+    XInitThreads();
+    gtk_init(&argc, &argv);
+
+    // The keysyms of the lowercase letters are consecutive
+    for (guint key = 0; key < DEFAULT_BENCH_KEYS; ++key) {
+        state.keycodes[key] = XKeysymToKeycode(GDK_DISPLAY_XDISPLAY(gdk_display_get_default()), XK_a + key);
+    }
+    state.cancellable = g_cancellable_new();
+
+    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gpointer keyboard_data = kp_keyboard_init(GTK_WINDOW(window), KP_KEYBOARD_FEATURE_NONE);
+    KpKeyModel *key_model = kp_keyboard_get_keys(GTK_WINDOW(window), keyboard_data);
+
+    for (guint i = 0; i < key_model->count; ++i) {
+        kp_key_model_place(key_model, key_model->codes[i], (i % 10) * KP_KEY_MODEL_UNIT, (i / 10) * KP_KEY_MODEL_UNIT,
+                           KP_KEY_MODEL_UNIT);
+    }
+
+    GtkWidget *keyboard_view = kp_keyboard_view_new(key_model);
+    gtk_container_add(GTK_CONTAINER(window), keyboard_view);
+    state.keyboard_view = keyboard_view;
+
+    KpPollTaskResult *task_result = g_new0(KpPollTaskResult, 1);
+    task_result->keyboard_data = keyboard_data;
+    task_result->key_model = key_model;
+    task_result->event_ring = kp_event_ring_new();
+    task_result->animator = kp_animator_new(window, DEFAULT_KEY_ANIMATION_TIMEOUT, on_key_animation_frame, &state);
+    task_result->stats = kp_stats_new();
+    task_result->cancellable = state.cancellable;
+    state.task_result = task_result;
+
+    GSource *event_source = kp_event_ring_source_new(task_result->event_ring);
+    g_source_set_callback(event_source, (GSourceFunc) on_bench_poll, &state, NULL);
+    guint event_source_id = g_source_attach(event_source, NULL);
+    g_source_unref(event_source);
+
+    gtk_widget_show_all(window);
+    g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint", G_CALLBACK(on_after_paint), &state);
+
+    GTask *task = g_task_new(window, state.cancellable, on_poll_task_done, NULL);
+    g_task_set_task_data(task, task_result, NULL);
+    g_task_run_in_thread(task, kp_keyboard_poll_task);
+    g_object_unref(task);
+
+    GThread *injector = g_thread_new("bench-inject", inject_keys, &state);
+
+    gtk_main();
+
+    g_thread_join(injector);
+
+    guint injected = g_atomic_int_get(&state.injected);
+    fprintf(stdout, "mode=%s rate=%d count=%d burst=%d\n", option_mode, state.rate, state.count, state.burst_size);
+    print_latencies("dispatch", state.injected_at, state.matched, state.dispatched_at, state.dispatched);
+    print_latencies("paint", state.injected_at, state.matched, state.painted_at, state.painted);
+    fprintf(stdout, "injected=%u dispatched=%u lost=%u ring_stalls=%u unmatched=%u\n",
+            injected, state.dispatched, injected - state.dispatched, task_result->event_ring->stalls, state.unmatched);
+
+    g_source_remove(event_source_id);
+    kp_animator_free(task_result->animator);
+    gtk_widget_destroy(window);
+    kp_event_ring_free(task_result->event_ring);
+    kp_keyboard_free(keyboard_data);
+    kp_key_model_free(key_model);
+    kp_stats_free(task_result->stats);
+    g_object_unref(state.cancellable);
+    g_free(task_result);
+    g_free(state.injected_at);
+    g_free(state.matched);
+    g_free(state.dispatched_at);
+    g_free(state.painted_at);
+
+    if (xvfb_pid != 0) {
+        kill(xvfb_pid, SIGTERM);
+        g_spawn_close_pid(xvfb_pid);
+    }
+
+    return EXIT_SUCCESS;
+}
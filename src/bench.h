@@ -0,0 +1,115 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file bench.h
+ * @brief State of the keypresenter_bench latency benchmark
+ */
+
+#ifndef KEYPRESENTER_BENCH_H
+#define KEYPRESENTER_BENCH_H
+
+#include <gtk/gtk.h>
+
+#include "polltaskresult.h"
+
+#define BENCH_STATE(bench_state) (((KpBenchState*) bench_state))
+
+/**
+ * Amount of keys the presses cycle through, so a dispatched press can be matched to its injection
+ * even if up to this many minus one presses in a row are lost
+ */
+#ifndef DEFAULT_BENCH_KEYS
+#define DEFAULT_BENCH_KEYS 8
+#endif
+
+typedef enum _BenchMode KpBenchMode;
+typedef struct _BenchState KpBenchState;
+
+enum _BenchMode {
+    /**
+     * Press and release at a fixed rate
+     */
+    BENCH_MODE_STEADY = 0,
+
+    /**
+     * Groups of back-to-back presses, the groups are sent at the fixed rate
+     */
+    BENCH_MODE_BURST = 1,
+
+    /**
+     * Presses of a held key as fast as the server takes them, like an autorepeat storm
+     */
+    BENCH_MODE_REPEAT = 2,
+};
+
+struct _BenchState {
+    KpPollTaskResult *task_result;
+    GCancellable *cancellable;
+
+    /**
+     * The benchmark has a single window, so it keeps its view itself instead of an overlay
+     */
+    GtkWidget *keyboard_view;
+
+    gchar *display_name;
+    KpBenchMode mode;
+
+    /**
+     * Presses (or bursts) per second, amount of presses and presses per burst
+     */
+    gint rate;
+    gint count;
+    gint burst_size;
+
+    /**
+     * Keycodes which are injected, press n uses keycodes[n % DEFAULT_BENCH_KEYS]. Presses of other keys are not measured
+     */
+    guint16 keycodes[DEFAULT_BENCH_KEYS];
+
+    /**
+     * Monotonic timestamp in microseconds of every injection, indexed by press number
+     */
+    gint64 *injected_at;
+
+    /**
+     * Press number of every dispatched press and its monotonic timestamps, indexed by dispatch number
+     */
+    guint *matched;
+    gint64 *dispatched_at;
+    gint64 *painted_at;
+
+    /**
+     * Press number after the last matched one, presses before it were dispatched or are lost
+     */
+    guint next_press;
+
+    /**
+     * Amount of presses which have been injected, written by the injection thread
+     */
+    gint injected;
+
+    guint dispatched;
+    guint painted;
+
+    /**
+     * Presses which were dispatched before their injection had been recorded, e.g. typed by a real user
+     */
+    guint unmatched;
+};
+
+#endif //KEYPRESENTER_BENCH_H
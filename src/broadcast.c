@@ -0,0 +1,587 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file broadcast.c
+ * @brief WebSocket server on the loopback interface which sends batches of key events to overlays in a browser
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "broadcast.h"
+
+#define BROADCAST_WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/**
+ * Longest header of a WebSocket frame which is sent by the server
+ */
+#define BROADCAST_FRAME_HEADER_SIZE 10
+
+#define BROADCAST_OPCODE_BINARY 0x2
+#define BROADCAST_OPCODE_CLOSE 0x8
+#define BROADCAST_FLAG_FIN 0x80
+#define BROADCAST_FLAG_MASK 0x80
+#define BROADCAST_LENGTH_MASK 0x7f
+
+#ifndef DEFAULT_BROADCAST_MAX_EVENTS
+#define DEFAULT_BROADCAST_MAX_EVENTS 16
+#endif
+
+/**
+ * epoll data of the server's own fds, client fds carry a pointer to their KpBroadcastClient
+ */
+static gchar LISTEN_TAG;
+static gchar TIMER_TAG;
+static gchar CANCEL_TAG;
+
+/**
+ * Send batches every flush interval while there are upgraded clients, stay asleep otherwise.
+ */
+static void
+set_timer(KpBroadcaster *broadcaster, gboolean armed) {
+    struct itimerspec spec = {0};
+
+    if (armed) {
+        spec.it_interval.tv_nsec = DEFAULT_BROADCAST_INTERVAL * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+
+    timerfd_settime(broadcaster->timer_fd, 0, &spec, NULL);
+}
+
+static void
+watch_client(KpBroadcaster *broadcaster, KpBroadcastClient *client, int operation, guint32 events) {
+    struct epoll_event event = {.events = events, .data.ptr = client};
+
+    epoll_ctl(broadcaster->epoll_fd, operation, client->fd, &event);
+}
+
+static void
+client_free(KpBroadcaster *broadcaster, KpBroadcastClient *client) {
+    for (guint i = 0; i < DEFAULT_BROADCAST_MAX_CLIENTS; ++i) {
+        if (broadcaster->clients[i] == client) {
+            broadcaster->clients[i] = NULL;
+        }
+    }
+
+    if (client->upgraded && --broadcaster->upgraded_count == 0) {
+        set_timer(broadcaster, FALSE);
+    }
+
+    // Closing the fd also removes it from the epoll set
+    close(client->fd);
+    g_free(client->backlog);
+    g_free(client);
+}
+
+/**
+ * Send bytes to a client without blocking. What the socket does not take is kept in the backlog of the client.
+ *
+ * @return FALSE if the client has to be disconnected, because the connection failed or the client is too slow
+ */
+static gboolean
+client_send(KpBroadcaster *broadcaster, KpBroadcastClient *client, const guint8 *data, gsize length) {
+    // Nothing may overtake the backlog, the stream of frames would be corrupted
+    if (client->backlog_length == 0) {
+        ssize_t sent = send(client->fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return FALSE;
+            }
+            sent = 0;
+        }
+
+        data += sent;
+        length -= sent;
+
+        if (length == 0) {
+            return TRUE;
+        }
+    }
+
+    if (client->backlog_length + length > DEFAULT_BROADCAST_BACKLOG) {
+        fprintf(stderr, "Broadcast client is too slow, disconnecting it\n");
+        return FALSE;
+    }
+
+    if (client->backlog == NULL) {
+        client->backlog = g_malloc(DEFAULT_BROADCAST_BACKLOG);
+    }
+
+    memcpy(client->backlog + client->backlog_length, data, length);
+    client->backlog_length += length;
+
+    watch_client(broadcaster, client, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+
+    return TRUE;
+}
+
+/**
+ * Send as much of the backlog as the socket takes, called when the socket has become writable.
+ */
+static gboolean
+client_flush(KpBroadcaster *broadcaster, KpBroadcastClient *client) {
+    ssize_t sent = send(client->fd, client->backlog, client->backlog_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    client->backlog_length -= sent;
+    memmove(client->backlog, client->backlog + sent, client->backlog_length);
+
+    if (client->backlog_length == 0) {
+        watch_client(broadcaster, client, EPOLL_CTL_MOD, EPOLLIN);
+    }
+
+    return TRUE;
+}
+
+/**
+ * Answer the HTTP upgrade request of a client once it is complete.
+ *
+ * @return FALSE if the request is not a WebSocket handshake
+ */
+static gboolean
+client_handshake(KpBroadcaster *broadcaster, KpBroadcastClient *client) {
+    if (strstr(client->request, "\r\n\r\n") == NULL) {
+        // Wait for the rest of the request, unless it does not fit
+        return client->request_length < KP_BROADCAST_REQUEST_SIZE - 1;
+    }
+
+    const gchar *key = NULL, *upgrade = NULL;
+    gsize key_length = 0, upgrade_length = 0;
+
+    for (const gchar *line = client->request, *end; (end = strstr(line, "\r\n")) != line; line = end + 2) {
+        if (g_ascii_strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+            for (key = line + 18; *key == ' '; ++key);
+            for (key_length = end - key; key_length > 0 && key[key_length - 1] == ' '; --key_length);
+        } else if (g_ascii_strncasecmp(line, "Upgrade:", 8) == 0) {
+            for (upgrade = line + 8; *upgrade == ' '; ++upgrade);
+            for (upgrade_length = end - upgrade; upgrade_length > 0 && upgrade[upgrade_length - 1] == ' '; --upgrade_length);
+        }
+    }
+
+    if (!g_str_has_prefix(client->request, "GET ") || key == NULL || key_length == 0
+        || upgrade_length != 9 || g_ascii_strncasecmp(upgrade, "websocket", 9) != 0) {
+        static const gchar BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+
+        client_send(broadcaster, client, (const guint8 *) BAD_REQUEST, sizeof(BAD_REQUEST) - 1);
+        return FALSE;
+    }
+
+    guint8 digest[20];
+    gsize digest_length = sizeof(digest);
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+
+    g_checksum_update(checksum, (const guchar *) key, key_length);
+    g_checksum_update(checksum, (const guchar *) BROADCAST_WEBSOCKET_GUID, strlen(BROADCAST_WEBSOCKET_GUID));
+    g_checksum_get_digest(checksum, digest, &digest_length);
+    g_checksum_free(checksum);
+
+    gchar *accept = g_base64_encode(digest, digest_length);
+    gchar *response = g_strdup_printf("HTTP/1.1 101 Switching Protocols\r\n"
+                                      "Upgrade: websocket\r\n"
+                                      "Connection: Upgrade\r\n"
+                                      "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    gboolean sent = client_send(broadcaster, client, (const guint8 *) response, strlen(response));
+
+    g_free(response);
+    g_free(accept);
+
+    client->upgraded = TRUE;
+
+    // The first client starts the batches at the current end of the stream, the others join in
+    if (broadcaster->upgraded_count++ == 0) {
+        broadcaster->cursor = kp_stream_get_written(broadcaster->stream);
+        broadcaster->lost = 0;
+        set_timer(broadcaster, TRUE);
+    }
+
+    return sent;
+}
+
+/**
+ * @return Size of a client frame header, as far as the bytes collected so far tell
+ */
+static gsize
+frame_header_size(const guint8 *header, gsize length) {
+    if (length < 2) {
+        return 2;
+    }
+
+    guint8 payload_length = header[1] & BROADCAST_LENGTH_MASK;
+
+    return 2 + (payload_length == 126 ? 2 : payload_length == 127 ? 8 : 0) + (header[1] & BROADCAST_FLAG_MASK ? 4 : 0);
+}
+
+/**
+ * Follow the frames a client sends, frames may be split or coalesced in any way by the socket.
+ * Payloads are skipped, only a close frame is acted on.
+ *
+ * @return FALSE if the client has sent a close frame or a frame which is not masked, and has to be disconnected
+ */
+static gboolean
+client_parse(KpBroadcaster *broadcaster, KpBroadcastClient *client, const guint8 *data, gsize length) {
+    while (length > 0) {
+        if (client->payload_remaining > 0) {
+            gsize skipped = MIN(length, client->payload_remaining);
+
+            client->payload_remaining -= skipped;
+            data += skipped;
+            length -= skipped;
+            continue;
+        }
+
+        guint8 *header = client->frame_header;
+        header[client->frame_header_length++] = *data++;
+        length--;
+
+        if (client->frame_header_length < frame_header_size(header, client->frame_header_length)) continue;
+
+        guint64 payload_length = header[1] & BROADCAST_LENGTH_MASK;
+        client->frame_header_length = 0;
+
+        // Extended lengths are in network byte order
+        if (payload_length == 126) {
+            payload_length = (guint64) header[2] << 8 | header[3];
+        } else if (payload_length == 127) {
+            payload_length = 0;
+            for (gint i = 0; i < 8; ++i) {
+                payload_length = payload_length << 8 | header[2 + i];
+            }
+        }
+
+        // Clients have to mask every frame, the connection is failed otherwise
+        if (!(header[1] & BROADCAST_FLAG_MASK)) {
+            return FALSE;
+        }
+
+        // The close frame is answered before the connection is closed
+        if ((header[0] & 0x0f) == BROADCAST_OPCODE_CLOSE) {
+            static const guint8 CLOSE_FRAME[] = {BROADCAST_FLAG_FIN | BROADCAST_OPCODE_CLOSE, 0};
+
+            client_send(broadcaster, client, CLOSE_FRAME, sizeof(CLOSE_FRAME));
+            return FALSE;
+        }
+
+        client->payload_remaining = payload_length;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Read what a client sent, which is either its handshake or frames that are ignored.
+ *
+ * @return FALSE if the client has disconnected or has to be disconnected
+ */
+static gboolean
+client_read(KpBroadcaster *broadcaster, KpBroadcastClient *client) {
+    for (;;) {
+        guint8 discard[256];
+        guint8 *buffer = client->upgraded ? discard : (guint8 *) client->request + client->request_length;
+        gsize size = client->upgraded ? sizeof(discard) : KP_BROADCAST_REQUEST_SIZE - 1 - client->request_length;
+        ssize_t length = recv(client->fd, buffer, size, MSG_DONTWAIT);
+
+        if (length < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+
+        if (length == 0) {
+            return FALSE;
+        }
+
+        if (client->upgraded) {
+            if (!client_parse(broadcaster, client, discard, length)) {
+                return FALSE;
+            }
+            continue;
+        }
+
+        client->request_length += length;
+        client->request[client->request_length] = '\0';
+
+        if (!client_handshake(broadcaster, client)) {
+            return FALSE;
+        }
+
+        // Frames which arrived together with the end of the handshake
+        const gchar *request_end = strstr(client->request, "\r\n\r\n");
+        if (client->upgraded && request_end != NULL) {
+            const guint8 *frames = (const guint8 *) request_end + 4;
+
+            if (!client_parse(broadcaster, client, frames,
+                              client->request_length - (frames - (const guint8 *) client->request))) {
+                return FALSE;
+            }
+        }
+    }
+}
+
+static void
+accept_clients(KpBroadcaster *broadcaster) {
+    int fd;
+
+    while ((fd = accept4(broadcaster->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        guint slot = 0;
+
+        while (slot < DEFAULT_BROADCAST_MAX_CLIENTS && broadcaster->clients[slot] != NULL) {
+            slot++;
+        }
+
+        if (slot == DEFAULT_BROADCAST_MAX_CLIENTS) {
+            fprintf(stderr, "Too many broadcast clients, refusing a connection\n");
+            close(fd);
+            continue;
+        }
+
+        // Batches are small and latency matters more than packet count
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        KpBroadcastClient *client = g_new0(KpBroadcastClient, 1);
+        client->fd = fd;
+        broadcaster->clients[slot] = client;
+
+        watch_client(broadcaster, client, EPOLL_CTL_ADD, EPOLLIN);
+    }
+}
+
+/**
+ * Take every record the stream got since the last batch and send them to all upgraded clients as one frame.
+ */
+static void
+send_batch(KpBroadcaster *broadcaster) {
+    GByteArray *frame = broadcaster->frame;
+    KpStreamRecord record;
+    guint64 expirations;
+
+    while (read(broadcaster->timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+
+    // Room for the longest frame header, the actual header is written right in front of the payload
+    g_byte_array_set_size(frame, BROADCAST_FRAME_HEADER_SIZE + sizeof(KpBroadcastBatch));
+
+    // A writer which is faster than this loop would keep it going forever, so a batch takes at most one lap
+    KpBroadcastBatch batch = {0};
+    while (batch.count < broadcaster->stream->header.capacity
+           && kp_stream_read(broadcaster->stream, &broadcaster->cursor, &record, &broadcaster->lost)) {
+        g_byte_array_append(frame, (const guint8 *) &record, sizeof(record));
+        batch.count++;
+    }
+
+    if (batch.count == 0 && broadcaster->lost == 0) {
+        return;
+    }
+
+    batch.lost = broadcaster->lost;
+    broadcaster->lost = 0;
+    memcpy(frame->data + BROADCAST_FRAME_HEADER_SIZE, &batch, sizeof(batch));
+
+    guint64 payload_length = frame->len - BROADCAST_FRAME_HEADER_SIZE;
+    guint8 header[BROADCAST_FRAME_HEADER_SIZE] = {BROADCAST_FLAG_FIN | BROADCAST_OPCODE_BINARY};
+    gsize header_length;
+
+    // Payload lengths are sent in network byte order, in 7, 16 or 64 bits
+    if (payload_length < 126) {
+        header[1] = payload_length;
+        header_length = 2;
+    } else if (payload_length <= G_MAXUINT16) {
+        header[1] = 126;
+        header[2] = payload_length >> 8;
+        header[3] = payload_length & 0xff;
+        header_length = 4;
+    } else {
+        header[1] = 127;
+        for (gint i = 0; i < 8; ++i) {
+            header[2 + i] = (payload_length >> (56 - 8 * i)) & 0xff;
+        }
+        header_length = 10;
+    }
+
+    guint8 *start = frame->data + BROADCAST_FRAME_HEADER_SIZE - header_length;
+    memcpy(start, header, header_length);
+
+    for (guint i = 0; i < DEFAULT_BROADCAST_MAX_CLIENTS; ++i) {
+        KpBroadcastClient *client = broadcaster->clients[i];
+
+        if (client != NULL && client->upgraded && !client->dead
+            && !client_send(broadcaster, client, start, header_length + payload_length)) {
+            client->dead = TRUE;
+        }
+    }
+}
+
+/**
+ * Free the clients which were disconnected while handling a batch of epoll events.
+ */
+static void
+free_dead_clients(KpBroadcaster *broadcaster) {
+    for (guint i = 0; i < DEFAULT_BROADCAST_MAX_CLIENTS; ++i) {
+        KpBroadcastClient *client = broadcaster->clients[i];
+
+        if (client != NULL && client->dead) {
+            client_free(broadcaster, client);
+        }
+    }
+}
+
+static gpointer
+broadcast_thread(gpointer broadcaster_p) {
+    KpBroadcaster *broadcaster = broadcaster_p;
+    struct epoll_event events[DEFAULT_BROADCAST_MAX_EVENTS];
+
+    for (;;) {
+        int count = epoll_wait(broadcaster->epoll_fd, events, DEFAULT_BROADCAST_MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Broadcast server stopped: %s\n", g_strerror(errno));
+            return NULL;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            gpointer tag = events[i].data.ptr;
+
+            if (tag == &CANCEL_TAG) {
+                return NULL;
+            } else if (tag == &LISTEN_TAG) {
+                accept_clients(broadcaster);
+            } else if (tag == &TIMER_TAG) {
+                send_batch(broadcaster);
+            } else {
+                KpBroadcastClient *client = tag;
+                gboolean alive = TRUE;
+
+                // Later events of the batch can still point to a client which was disconnected by an earlier one
+                if (client->dead) continue;
+
+                if (events[i].events & EPOLLOUT) {
+                    alive = client_flush(broadcaster, client);
+                }
+                if (alive && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    alive = client_read(broadcaster, client);
+                }
+                if (!alive) {
+                    client->dead = TRUE;
+                }
+            }
+        }
+
+        free_dead_clients(broadcaster);
+    }
+}
+
+static gboolean
+watch_fd(KpBroadcaster *broadcaster, int fd, gpointer tag) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = tag};
+
+    return epoll_ctl(broadcaster->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static void
+close_fds(KpBroadcaster *broadcaster) {
+    int *fds[] = {&broadcaster->listen_fd, &broadcaster->timer_fd, &broadcaster->cancel_fd, &broadcaster->epoll_fd};
+
+    for (guint i = 0; i < G_N_ELEMENTS(fds); ++i) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+KpBroadcaster *
+kp_broadcaster_new(KpStream *stream, guint16 port, GError **error) {
+    KpBroadcaster *broadcaster = g_new0(KpBroadcaster, 1);
+    struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int reuse_address = 1;
+
+    broadcaster->stream = stream;
+    broadcaster->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    broadcaster->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    broadcaster->cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    broadcaster->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (broadcaster->listen_fd < 0 || broadcaster->timer_fd < 0 || broadcaster->cancel_fd < 0
+        || broadcaster->epoll_fd < 0
+        || setsockopt(broadcaster->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address)) < 0
+        || bind(broadcaster->listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0
+        || listen(broadcaster->listen_fd, DEFAULT_BROADCAST_MAX_CLIENTS) < 0
+        || !watch_fd(broadcaster, broadcaster->listen_fd, &LISTEN_TAG)
+        || !watch_fd(broadcaster, broadcaster->timer_fd, &TIMER_TAG)
+        || !watch_fd(broadcaster, broadcaster->cancel_fd, &CANCEL_TAG)) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not start broadcast server on port %u: %s", port, g_strerror(errno));
+        close_fds(broadcaster);
+        g_free(broadcaster);
+        return NULL;
+    }
+
+    broadcaster->frame = g_byte_array_new();
+    broadcaster->thread = g_thread_new("kp-broadcast", broadcast_thread, broadcaster);
+
+    return broadcaster;
+}
+
+void
+kp_broadcaster_free(KpBroadcaster *broadcaster) {
+    guint64 value = 1;
+
+    if (broadcaster == NULL) {
+        return;
+    }
+
+    if (write(broadcaster->cancel_fd, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Could not stop broadcast server: %s\n", g_strerror(errno));
+    }
+    g_thread_join(broadcaster->thread);
+
+    for (guint i = 0; i < DEFAULT_BROADCAST_MAX_CLIENTS; ++i) {
+        if (broadcaster->clients[i] != NULL) {
+            client_free(broadcaster, broadcaster->clients[i]);
+        }
+    }
+
+    close_fds(broadcaster);
+    g_byte_array_unref(broadcaster->frame);
+    g_free(broadcaster);
+}
+
+#undef BROADCAST_WEBSOCKET_GUID
+#undef BROADCAST_FRAME_HEADER_SIZE
+#undef BROADCAST_OPCODE_BINARY
+#undef BROADCAST_OPCODE_CLOSE
+#undef BROADCAST_FLAG_FIN
+#undef BROADCAST_FLAG_MASK
+#undef BROADCAST_LENGTH_MASK
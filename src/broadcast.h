@@ -0,0 +1,153 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file broadcast.h
+ * @brief WebSocket server on the loopback interface which sends batches of key events to overlays in a browser
+ *
+ * Clients connect to ws://127.0.0.1:PORT/ and receive one binary message per flush interval in which keys were used.
+ * A message is a KpBroadcastBatch followed by count KpStreamRecord, see keypresenter/stream.h, in host byte order.
+ * Messages from the clients are ignored.
+ */
+
+#ifndef KEYPRESENTER_BROADCAST_H
+#define KEYPRESENTER_BROADCAST_H
+
+#include <gio/gio.h>
+
+#include <keypresenter/stream.h>
+
+/**
+ * Time in milliseconds between two batches
+ */
+#ifndef DEFAULT_BROADCAST_INTERVAL
+#define DEFAULT_BROADCAST_INTERVAL 16
+#endif
+
+#ifndef DEFAULT_BROADCAST_MAX_CLIENTS
+#define DEFAULT_BROADCAST_MAX_CLIENTS 16
+#endif
+
+/**
+ * Bytes which may be waiting to be sent to a client, a client which falls further behind is disconnected
+ */
+#ifndef DEFAULT_BROADCAST_BACKLOG
+#define DEFAULT_BROADCAST_BACKLOG (256 * 1024)
+#endif
+
+/**
+ * Longest HTTP upgrade request a client may send
+ */
+#define KP_BROADCAST_REQUEST_SIZE 2048
+
+/**
+ * Longest header of a WebSocket frame which is sent by a client: 2 bytes, a 64-bit length and the mask
+ */
+#define KP_BROADCAST_CLIENT_HEADER_SIZE 14
+
+typedef struct _BroadcastBatch KpBroadcastBatch;
+typedef struct _BroadcastClient KpBroadcastClient;
+typedef struct _Broadcaster KpBroadcaster;
+
+struct _BroadcastBatch {
+    /**
+     * Amount of records which were overwritten in the stream before the server could send them
+     */
+    guint32 lost;
+    guint32 count;
+};
+
+G_STATIC_ASSERT(sizeof(KpBroadcastBatch) == 8);
+
+struct _BroadcastClient {
+    int fd;
+
+    /**
+     * TRUE once the WebSocket handshake has been answered, batches are only sent to upgraded clients
+     */
+    gboolean upgraded;
+
+    /**
+     * TRUE once the client has to be disconnected. It is freed after the epoll events it is in have been handled.
+     */
+    gboolean dead;
+
+    gchar request[KP_BROADCAST_REQUEST_SIZE];
+    gsize request_length;
+
+    /**
+     * Header of the frame the client is sending, collected until it is complete
+     */
+    guint8 frame_header[KP_BROADCAST_CLIENT_HEADER_SIZE];
+    gsize frame_header_length;
+
+    /**
+     * Payload bytes of the last complete frame header which have not been read yet, they are skipped
+     */
+    guint64 payload_remaining;
+
+    /**
+     * Bytes which the socket did not take yet
+     */
+    guint8 *backlog;
+    gsize backlog_length;
+};
+
+/**
+ * Reads the event stream on a thread of its own, the poll thread which writes the stream never waits for it.
+ */
+struct _Broadcaster {
+    KpStream *stream;
+
+    /**
+     * Number of the next record to send, and the records lost since the last batch
+     */
+    guint32 cursor;
+    guint32 lost;
+
+    int listen_fd;
+    int timer_fd;
+    int cancel_fd;
+    int epoll_fd;
+
+    KpBroadcastClient *clients[DEFAULT_BROADCAST_MAX_CLIENTS];
+    guint upgraded_count;
+
+    /**
+     * Batch which is being built, as a complete WebSocket frame
+     */
+    GByteArray *frame;
+
+    GThread *thread;
+};
+
+/**
+ * Listen on 127.0.0.1 and start the server thread.
+ *
+ * @param stream Stream to send the records of, must outlive the broadcaster
+ * @return Ptr to the broadcaster, or NULL with error set
+ */
+KpBroadcaster *
+kp_broadcaster_new(KpStream *stream, guint16 port, GError **error);
+
+/**
+ * Stop the server thread and disconnect all clients.
+ */
+void
+kp_broadcaster_free(KpBroadcaster *broadcaster);
+
+#endif //KEYPRESENTER_BROADCAST_H
@@ -0,0 +1,560 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file evdev.c
+ * @brief Evdev implementation for keyboard-related methods, reads /dev/input/event* without a display server
+ *
+ * The kernel only knows key positions, so the labels come from a built-in US QWERTY table.
+ * They are named like the X11 keysyms, so both backends show the same labels.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <gtk/gtk.h>
+
+#include "keypresenter/key.h"
+#include "keypresenter/keyboard.h"
+#include "evdev.h"
+#include "macro.h"
+#include "polltaskresult.h"
+
+#ifndef DEFAULT_POLL_MAX_EVENTS
+#define DEFAULT_POLL_MAX_EVENTS 16
+#endif
+
+/**
+ * Amount of input events which are read from a device with one read call
+ */
+#ifndef DEFAULT_EVDEV_READ_BATCH
+#define DEFAULT_EVDEV_READ_BATCH 64
+#endif
+
+/**
+ * Console keyboard configuration, its XKBLAYOUT line names the layout without a display server
+ */
+#ifndef DEFAULT_KEYBOARD_CONFIG
+#define DEFAULT_KEYBOARD_CONFIG "/etc/default/keyboard"
+#endif
+
+/**
+ * epoll data of the cancellation and inotify fds, device fds carry a pointer to their KpEvdevDevice
+ */
+static gchar POLL_CANCEL_TAG;
+static gchar POLL_HOTPLUG_TAG;
+
+/**
+ * Labels of the keys which are shown, indexed by evdev key code
+ */
+static gchar *const DEFAULT_KEY_LABELS[EVDEV_KEYMAP_SIZE] = {
+        [KEY_1] = "1", [KEY_2] = "2", [KEY_3] = "3", [KEY_4] = "4", [KEY_5] = "5",
+        [KEY_6] = "6", [KEY_7] = "7", [KEY_8] = "8", [KEY_9] = "9", [KEY_0] = "0",
+        [KEY_Q] = "q", [KEY_W] = "w", [KEY_E] = "e", [KEY_R] = "r", [KEY_T] = "t",
+        [KEY_Y] = "y", [KEY_U] = "u", [KEY_I] = "i", [KEY_O] = "o", [KEY_P] = "p",
+        [KEY_A] = "a", [KEY_S] = "s", [KEY_D] = "d", [KEY_F] = "f", [KEY_G] = "g",
+        [KEY_H] = "h", [KEY_J] = "j", [KEY_K] = "k", [KEY_L] = "l",
+        [KEY_Z] = "z", [KEY_X] = "x", [KEY_C] = "c", [KEY_V] = "v", [KEY_B] = "b",
+        [KEY_N] = "n", [KEY_M] = "m",
+        [KEY_SPACE] = "space",
+        [KEY_LEFTCTRL] = "Control_L", [KEY_RIGHTCTRL] = "Control_R",
+        [KEY_LEFTSHIFT] = "Shift_L", [KEY_RIGHTSHIFT] = "Shift_R",
+        [KEY_LEFTALT] = "Alt_L", [KEY_RIGHTALT] = "Alt_R",
+        [KEY_LEFTMETA] = "Super_L", [KEY_RIGHTMETA] = "Super_R",
+};
+
+/**
+ * Modifiers of the modifier keys, indexed by evdev key code. Modifiers are sent to the user interface but not shown as keys.
+ */
+static const KpKeyModifier DEFAULT_KEY_MODIFIERS[EVDEV_KEYMAP_SIZE] = {
+        [KEY_LEFTCTRL] = KP_KEY_MODIFIER_CTRL, [KEY_RIGHTCTRL] = KP_KEY_MODIFIER_CTRL,
+        [KEY_LEFTSHIFT] = KP_KEY_MODIFIER_SHIFT, [KEY_RIGHTSHIFT] = KP_KEY_MODIFIER_SHIFT,
+        [KEY_LEFTALT] = KP_KEY_MODIFIER_ALT, [KEY_RIGHTALT] = KP_KEY_MODIFIER_ALT,
+        [KEY_LEFTMETA] = KP_KEY_MODIFIER_SUPER, [KEY_RIGHTMETA] = KP_KEY_MODIFIER_SUPER,
+};
+
+static inline gboolean
+bitmap_test(const guint64 *bitmap, guint bit) {
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void
+bitmap_set(guint64 *bitmap, guint bit, gboolean value) {
+    if (value) {
+        bitmap[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+    } else {
+        bitmap[bit / 64] &= ~(G_GUINT64_CONSTANT(1) << (bit % 64));
+    }
+}
+
+/**
+ * @return TRUE if the key is shown on the keyboard, modifiers are only part of key combinations
+ */
+static inline gboolean
+is_shown_key(const KpEvdevDevice *device, guint code) {
+    return DEFAULT_KEY_LABELS[code] != NULL && DEFAULT_KEY_MODIFIERS[code] == KP_KEY_MODIFIER_NONE
+           && bitmap_test(device->capabilities, code);
+}
+
+static void
+device_free(KpEvdevDevice *device) {
+    if (device == NULL) {
+        return;
+    }
+
+    close(device->fd);
+    g_free(device->node_name);
+    g_free(device);
+}
+
+/**
+ * Open an event device node.
+ *
+ * @return The device, or NULL if it can not be read or does not look like a keyboard
+ */
+static KpEvdevDevice *
+open_device(const gchar *node_name) {
+    gchar *path = g_build_filename(EVDEV_INPUT_DIR, node_name, NULL);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+        // Devices which are not keyboards are often not readable by the user either, only report real failures.
+        if (errno != EACCES && errno != ENOENT) {
+            fprintf(stderr, "Could not open %s: %s\n", path, g_strerror(errno));
+        }
+        g_free(path);
+        return NULL;
+    }
+
+    g_free(path);
+
+    KpEvdevDevice *device = g_new0(KpEvdevDevice, 1);
+    device->fd = fd;
+    device->node_name = g_strdup(node_name);
+
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(device->capabilities)), device->capabilities) < 0
+        || !bitmap_test(device->capabilities, KEY_A) || !bitmap_test(device->capabilities, KEY_SPACE)) {
+        device_free(device);
+        return NULL;
+    }
+
+    // Stamp events with the clock X servers use, so latencies are comparable between the backends.
+    int clock_id = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock_id);
+
+    // Keys which are already held down will be released later, they must not be reported as a press.
+    ioctl(fd, EVIOCGKEY(sizeof(device->pressed)), device->pressed);
+
+#ifndef NDEBUG
+    fprintf(stdout, "Using keyboard %s\n", node_name);
+#endif
+
+    return device;
+}
+
+static gboolean
+has_device(KpEvdevKeyboardData *data, const gchar *node_name) {
+    for (guint i = 0; i < data->devices->len; ++i) {
+        KpEvdevDevice *device = g_ptr_array_index(data->devices, i);
+
+        if (g_strcmp0(device->node_name, node_name) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Open a device node unless it is already open.
+ *
+ * @return The newly added device, or NULL
+ */
+static KpEvdevDevice *
+add_device(KpEvdevKeyboardData *data, const gchar *node_name) {
+    if (!g_str_has_prefix(node_name, "event") || has_device(data, node_name)) {
+        return NULL;
+    }
+
+    KpEvdevDevice *device = open_device(node_name);
+    if (device != NULL) {
+        device->index = data->next_index++;
+        device->slot = device->index % (KP_POLL_DEVICE_COUNT - 1) + 1;
+        g_ptr_array_add(data->devices, device);
+    }
+
+    return device;
+}
+
+gpointer
+kp_keyboard_init(GtkWindow *UNUSED(window), KpKeyboardFeatures UNUSED(features)) {
+    KpEvdevKeyboardData *data = g_new0(KpEvdevKeyboardData, 1);
+    data->devices = g_ptr_array_new_with_free_func((GDestroyNotify) device_free);
+
+    // Start watching before scanning, so a device which appears in between is not missed.
+    // Device nodes are created by udev before their permissions are set, so IN_ATTRIB is watched as well.
+    data->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (data->inotify_fd >= 0 && inotify_add_watch(data->inotify_fd, EVDEV_INPUT_DIR, IN_CREATE | IN_ATTRIB) < 0) {
+        fprintf(stderr, "Could not watch %s for new keyboards: %s\n", EVDEV_INPUT_DIR, g_strerror(errno));
+        close(data->inotify_fd);
+        data->inotify_fd = -1;
+    }
+
+    DIR* d = opendir(EVDEV_INPUT_DIR);
+
+    if (d != NULL) {
+        struct dirent *dr;
+        while ((dr = readdir(d)) != NULL) {
+            add_device(data, dr->d_name);
+        }
+
+        closedir(d);
+    }
+
+    if (data->devices->len == 0) {
+        fprintf(stderr, "No readable keyboard in %s, is the user in the input group?\n", EVDEV_INPUT_DIR);
+    }
+
+    return data;
+}
+
+gchar *
+kp_keyboard_get_layout_name(gpointer UNUSED(internal_keyboard_data)) {
+    gchar *contents, *layout = NULL;
+
+    if (!g_file_get_contents(DEFAULT_KEYBOARD_CONFIG, &contents, NULL, NULL)) {
+        return NULL;
+    }
+
+    // The file is sourced by the shell, e.g. XKBLAYOUT="de,us"
+    for (gchar *line = strtok(contents, "\n"); line != NULL && layout == NULL; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "XKBLAYOUT=", 10) != 0) continue;
+
+        gchar *value = line + 10 + (line[10] == '"');
+        gsize length = strcspn(value, "\",");
+
+        if (length > 0) {
+            layout = g_strndup(value, length);
+        }
+    }
+
+    g_free(contents);
+
+    return layout;
+}
+
+guint
+kp_keyboard_get_display_count(gpointer UNUSED(internal_keyboard_data)) {
+    // Devices are read directly, there is no display server involved
+    return 0;
+}
+
+const gchar *
+kp_keyboard_get_display_name(gpointer UNUSED(internal_keyboard_data), guint UNUSED(index)) {
+    return NULL;
+}
+
+KpKeyModel *
+kp_keyboard_get_keys(GtkWindow *UNUSED(window), gpointer internal_keyboard_data) {
+    KpKeyModel *result = kp_key_model_new();
+    KpEvdevKeyboardData *data = EVDEV_KEYBOARD_DATA(internal_keyboard_data);
+
+    for (guint i = 0; i < data->devices->len; ++i) {
+        KpEvdevDevice *device = g_ptr_array_index(data->devices, i);
+
+        for (guint code = 0; code < EVDEV_KEYMAP_SIZE; ++code) {
+            if (!is_shown_key(device, code)) continue;
+
+            kp_key_model_add(result, code + EVDEV_KEYCODE_OFFSET, DEFAULT_KEY_LABELS[code]);
+        }
+    }
+
+    return result;
+}
+
+static void
+push_key(KpPollTaskResult *result, KpEvdevDevice *device, guint code, gboolean pressed, guint32 time) {
+    if (code >= EVDEV_KEYMAP_SIZE || DEFAULT_KEY_LABELS[code] == NULL) {
+        return;
+    }
+
+    KpKeyboardPoll poll = {
+            .result = POLL_OK,
+            .key = {.code = code + EVDEV_KEYCODE_OFFSET, .label = DEFAULT_KEY_LABELS[code], .modifier = DEFAULT_KEY_MODIFIERS[code]},
+            .pressed = pressed,
+            .time = time,
+            .display = device->index,
+            .device = device->slot,
+    };
+
+    kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+}
+
+/**
+ * Release every key which is held according to the device but not according to state, and take over state.
+ */
+static void
+release_keys(KpPollTaskResult *result, KpEvdevDevice *device, const guint64 *state) {
+    for (guint word = 0; word < EVDEV_BITMAP_WORDS(KEY_CNT); ++word) {
+        guint64 released = device->pressed[word] & ~state[word];
+
+        while (released != 0) {
+            guint bit = __builtin_ctzll(released);
+            released &= released - 1;
+
+            push_key(result, device, word * 64 + bit, FALSE, 0);
+        }
+
+        device->pressed[word] = state[word];
+    }
+}
+
+/**
+ * Bring the pressed keys up to date after the kernel has dropped events, by releasing every key which is no longer down.
+ */
+static void
+resync_device(KpPollTaskResult *result, KpEvdevDevice *device) {
+    guint64 state[EVDEV_BITMAP_WORDS(KEY_CNT)] = {0};
+
+    if (ioctl(device->fd, EVIOCGKEY(sizeof(state)), state) < 0) {
+        return;
+    }
+
+    release_keys(result, device, state);
+}
+
+/**
+ * Release the keys which were held when the device was unplugged, so they do not stay down in the user interface.
+ */
+static void
+unplug_device(KpPollTaskResult *result, KpEvdevDevice *device) {
+    static const guint64 released[EVDEV_BITMAP_WORDS(KEY_CNT)] = {0};
+
+    release_keys(result, device, released);
+    kp_event_ring_notify(result->event_ring);
+}
+
+static void
+dispatch_event(KpPollTaskResult *result, KpEvdevDevice *device, const struct input_event *event) {
+    device->events_received++;
+    kp_stats_count_event(result->stats, device->index);
+
+    if (event->type == EV_SYN) {
+        if (event->code == SYN_DROPPED) {
+            device->dropped = TRUE;
+        } else if (event->code == SYN_REPORT && device->dropped) {
+            device->dropped = FALSE;
+            resync_device(result, device);
+        }
+        return;
+    }
+
+    // Autorepeat (value 2) is not a new press
+    if (device->dropped || event->type != EV_KEY || event->code >= KEY_CNT || event->value > 1) {
+        return;
+    }
+
+    bitmap_set(device->pressed, event->code, event->value);
+    device->key_events++;
+    push_key(result, device, event->code, event->value,
+             (guint32) (event->input_event_sec * 1000 + event->input_event_usec / 1000));
+}
+
+/**
+ * Read every event which is queued on the device.
+ *
+ * @return FALSE if the device has been removed
+ */
+static gboolean
+dispatch_pending_events(KpPollTaskResult *result, KpEvdevDevice *device) {
+    struct input_event events[DEFAULT_EVDEV_READ_BATCH];
+    gboolean available = TRUE;
+
+    for (;;) {
+        ssize_t length = read(device->fd, events, sizeof(events));
+
+        if (length < 0) {
+            if (errno == EINTR) continue;
+
+            available = errno == EAGAIN;
+            break;
+        }
+
+        for (gsize i = 0; i < length / sizeof(struct input_event); ++i) {
+            dispatch_event(result, device, &events[i]);
+        }
+
+        if (length < (ssize_t) sizeof(events)) break;
+    }
+
+    kp_event_ring_notify(result->event_ring);
+
+    return available;
+}
+
+static void
+watch_device(KpPollTaskResult *result, int epoll_fd, KpEvdevDevice *device) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = device};
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device->fd, &event) < 0) {
+        fprintf(stderr, "Could not watch keyboard %s: %s\n", device->node_name, g_strerror(errno));
+    }
+
+    dispatch_pending_events(result, device);
+}
+
+/**
+ * Tell the user interface about the keys of a keyboard which has been plugged in after kp_keyboard_get_keys.
+ * The key model ignores the keys it has already.
+ */
+static void
+announce_device(KpPollTaskResult *result, KpEvdevDevice *device) {
+    for (guint code = 0; code < EVDEV_KEYMAP_SIZE; ++code) {
+        if (!is_shown_key(device, code)) continue;
+
+        KpKeyboardPoll poll = {
+                .result = POLL_KEY_ADDED,
+                .key = {.code = code + EVDEV_KEYCODE_OFFSET, .label = DEFAULT_KEY_LABELS[code]},
+                .display = device->index,
+        };
+
+        kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+    }
+}
+
+/**
+ * Open the keyboards which have appeared since the last call.
+ */
+static void
+attach_new_devices(KpPollTaskResult *result, int epoll_fd) {
+    KpEvdevKeyboardData *keyboard_data = EVDEV_KEYBOARD_DATA(result->keyboard_data);
+    gchar buffer[4096] __attribute__((__aligned__(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(keyboard_data->inotify_fd, buffer, sizeof(buffer))) > 0 || (length < 0 && errno == EINTR)) {
+        for (gchar *position = buffer; position < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *) position;
+            position += sizeof(struct inotify_event) + event->len;
+
+            if (event->len == 0) continue;
+
+            KpEvdevDevice *device = add_device(keyboard_data, event->name);
+            if (device != NULL) {
+                // Announced first, so the key model has the keys before their first events arrive
+                announce_device(result, device);
+                watch_device(result, epoll_fd, device);
+            }
+        }
+    }
+}
+
+void
+kp_keyboard_poll_task(GTask *task, gpointer UNUSED(source_obj), gpointer poll_task_result, GCancellable *cancellable) {
+    KpPollTaskResult *result = poll_task_result;
+    KpEvdevKeyboardData *keyboard_data = EVDEV_KEYBOARD_DATA(result->keyboard_data);
+    struct epoll_event ready_events[DEFAULT_POLL_MAX_EVENTS];
+    GError *error = NULL;
+    int cancel_fd = -1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(errno),
+                                "Could not create epoll instance: %s", g_strerror(errno));
+        return;
+    }
+
+    cancel_fd = g_cancellable_get_fd(cancellable);
+    if (cancel_fd >= 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &POLL_CANCEL_TAG};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cancel_fd, &event) < 0) {
+            fprintf(stderr, "Could not watch cancellation fd: %s\n", g_strerror(errno));
+        }
+    }
+
+    if (keyboard_data->inotify_fd >= 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &POLL_HOTPLUG_TAG};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, keyboard_data->inotify_fd, &event) < 0) {
+            fprintf(stderr, "Could not watch for new keyboards: %s\n", g_strerror(errno));
+        }
+    }
+
+    for (guint i = 0; i < keyboard_data->devices->len; ++i) {
+        watch_device(result, epoll_fd, g_ptr_array_index(keyboard_data->devices, i));
+    }
+
+    while (!g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        int ready_count = epoll_wait(epoll_fd, ready_events, DEFAULT_POLL_MAX_EVENTS, -1);
+
+        if (ready_count < 0) {
+            if (errno == EINTR) continue;
+
+            g_set_error(&error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Could not wait for keyboard events: %s", g_strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready_count; ++i) {
+            gpointer tag = ready_events[i].data.ptr;
+
+            if (tag == &POLL_CANCEL_TAG) continue;
+
+            if (tag == &POLL_HOTPLUG_TAG) {
+                attach_new_devices(result, epoll_fd);
+                continue;
+            }
+
+            if (!dispatch_pending_events(result, tag)) {
+                // Unplugged, closing the fd also removes it from the epoll instance.
+                unplug_device(result, tag);
+                g_ptr_array_remove_fast(keyboard_data->devices, tag);
+            }
+        }
+    }
+
+    if (cancel_fd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+
+    close(epoll_fd);
+
+    g_task_return_error(task, error);
+}
+
+void
+kp_keyboard_free(gpointer internal_keyboard_data) {
+    KpEvdevKeyboardData *data = EVDEV_KEYBOARD_DATA(internal_keyboard_data);
+
+    if (data == NULL) {
+        return;
+    }
+
+    if (data->inotify_fd >= 0) {
+        close(data->inotify_fd);
+    }
+
+    g_ptr_array_unref(data->devices);
+    g_free(data);
+}
@@ -0,0 +1,106 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file evdev.h
+ * @brief Internal data structures for the evdev keyboard backend
+ */
+
+#ifndef KEYPRESENTER_EVDEV_H
+#define KEYPRESENTER_EVDEV_H
+
+#include <glib.h>
+#include <linux/input.h>
+
+#include <keypresenter/poll.h>
+
+#define EVDEV_KEYBOARD_DATA(keyboard_data) (((KpEvdevKeyboardData*) keyboard_data))
+
+/**
+ * Directory which holds the event device nodes
+ */
+#define EVDEV_INPUT_DIR "/dev/input"
+
+/**
+ * Evdev key codes are X11 keycodes minus 8, the key model uses the X11 numbering
+ */
+#define EVDEV_KEYCODE_OFFSET 8
+
+/**
+ * Amount of evdev key codes which fit in the key model
+ */
+#define EVDEV_KEYMAP_SIZE (256 - EVDEV_KEYCODE_OFFSET)
+
+#define EVDEV_BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
+typedef struct _EvdevDevice KpEvdevDevice;
+typedef struct _EvdevKeyboardData KpEvdevKeyboardData;
+
+struct _EvdevDevice {
+    int fd;
+
+    /**
+     * Name of the device node in EVDEV_INPUT_DIR, e.g. "event3"
+     */
+    gchar *node_name;
+
+    /**
+     * Number of the device in the order the devices were opened, used as display number in the stats
+     */
+    guint index;
+
+    /**
+     * Slot which tells the keyboard apart in the user interface, slots are reused round robin
+     */
+    guint8 slot;
+
+    /**
+     * Keys the device has, and keys which are currently held down
+     */
+    guint64 capabilities[EVDEV_BITMAP_WORDS(KEY_CNT)];
+    guint64 pressed[EVDEV_BITMAP_WORDS(KEY_CNT)];
+
+    /**
+     * TRUE after SYN_DROPPED until the next SYN_REPORT, the events in between are incomplete
+     */
+    gboolean dropped;
+
+    /**
+     * Event counters, only written by the poll task
+     */
+    guint64 events_received;
+    guint64 key_events;
+};
+
+struct _EvdevKeyboardData {
+    /**
+     * An array with KpEvdevDevice pointer element type
+     */
+    GPtrArray *devices;
+
+    /**
+     * Index of the next device which is opened
+     */
+    guint next_index;
+
+    /**
+     * inotify instance watching EVDEV_INPUT_DIR for new devices, or -1
+     */
+    int inotify_fd;
+};
+
+#endif //KEYPRESENTER_EVDEV_H
@@ -0,0 +1,238 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file eventring.c
+ * @brief Lock-free SPSC ring buffer with an eventfd-backed GSource
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "eventring.h"
+
+#define KP_EVENT_RING_MASK (KP_EVENT_RING_CAPACITY - 1)
+
+typedef struct _EventRingSource KpEventRingSource;
+
+struct _EventRingSource {
+    GSource source;
+    KpEventRing *ring;
+};
+
+KpEventRing *
+kp_event_ring_new(void) {
+    KpEventRing *ring;
+
+    if (posix_memalign((void **) &ring, KEYPRESENTER_CACHELINE_SIZE, sizeof(KpEventRing)) != 0) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(KpEventRing));
+
+    ring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->event_fd < 0 || ring->space_fd < 0) {
+        fprintf(stderr, "Could not create event ring eventfd: %s\n", g_strerror(errno));
+        if (ring->event_fd >= 0) close(ring->event_fd);
+        if (ring->space_fd >= 0) close(ring->space_fd);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void
+kp_event_ring_free(KpEventRing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+
+    close(ring->event_fd);
+    close(ring->space_fd);
+    free(ring);
+}
+
+gboolean
+kp_event_ring_push(KpEventRing *ring, const KpKeyboardPoll *poll) {
+    guint tail = ring->tail;
+
+    if (ring->stream != NULL) {
+        kp_stream_writer_push(ring->stream, poll);
+    }
+
+    if (tail - ring->cached_head == KP_EVENT_RING_CAPACITY) {
+        ring->cached_head = g_atomic_int_get(&ring->head);
+
+        if (tail - ring->cached_head == KP_EVENT_RING_CAPACITY) {
+            ring->dropped++;
+            return FALSE;
+        }
+    }
+
+    ring->records[tail & KP_EVENT_RING_MASK] = *poll;
+    g_atomic_int_set(&ring->tail, tail + 1);
+
+    return TRUE;
+}
+
+/**
+ * Block until the consumer has drained the ring or the cancellable is cancelled.
+ */
+static void
+wait_for_space(KpEventRing *ring, GCancellable *cancellable) {
+    struct pollfd fds[2] = {
+            {.fd = ring->space_fd, .events = POLLIN},
+            {.fd = g_cancellable_get_fd(cancellable), .events = POLLIN},
+    };
+    uint64_t value;
+    gint64 started = g_get_monotonic_time();
+
+    while (!kp_event_ring_has_space(ring) && !g_cancellable_is_cancelled(cancellable)) {
+        g_atomic_int_set(&ring->waiting, TRUE);
+
+        // Look again after raising the flag, the consumer may have drained the ring before it could see it.
+        if (kp_event_ring_has_space(ring)) break;
+
+        // The consumer only drains the ring after it has been woken up.
+        kp_event_ring_notify(ring);
+
+        if (poll(fds, G_N_ELEMENTS(fds), -1) > 0 && fds[0].revents & POLLIN) {
+            while (read(ring->space_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+        }
+    }
+
+    g_atomic_int_set(&ring->waiting, FALSE);
+
+    // Single writer, the stores only have to be atomic for the stats of the consumer
+    g_atomic_int_set(&ring->stalls, ring->stalls + 1);
+    __atomic_store_n(&ring->stalled_time, ring->stalled_time + (g_get_monotonic_time() - started), __ATOMIC_RELAXED);
+
+    if (fds[1].fd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+}
+
+gboolean
+kp_event_ring_push_wait(KpEventRing *ring, const KpKeyboardPoll *poll, GCancellable *cancellable) {
+    if (!kp_event_ring_has_space(ring)) {
+        wait_for_space(ring, cancellable);
+    }
+
+    return kp_event_ring_push(ring, poll);
+}
+
+gboolean
+kp_event_ring_has_space(KpEventRing *ring) {
+    if (ring->tail - ring->cached_head < KP_EVENT_RING_CAPACITY) {
+        return TRUE;
+    }
+
+    ring->cached_head = g_atomic_int_get(&ring->head);
+
+    return ring->tail - ring->cached_head < KP_EVENT_RING_CAPACITY;
+}
+
+void
+kp_event_ring_notify(KpEventRing *ring) {
+    if (ring->stream != NULL) {
+        kp_stream_writer_notify(ring->stream);
+    }
+
+    if (g_atomic_int_get(&ring->tail) == g_atomic_int_get(&ring->head)) {
+        return;
+    }
+
+    if (g_atomic_int_compare_and_exchange(&ring->signalled, FALSE, TRUE)) {
+        uint64_t value = 1;
+
+        if (write(ring->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "Could not wake up event ring consumer: %s\n", g_strerror(errno));
+        }
+    }
+}
+
+gboolean
+kp_event_ring_pop(KpEventRing *ring, KpKeyboardPoll *poll) {
+    guint head = ring->head;
+
+    if (head == g_atomic_int_get(&ring->tail)) {
+        return FALSE;
+    }
+
+    *poll = ring->records[head & KP_EVENT_RING_MASK];
+    g_atomic_int_set(&ring->head, head + 1);
+
+    return TRUE;
+}
+
+guint
+kp_event_ring_depth(KpEventRing *ring) {
+    return g_atomic_int_get(&ring->tail) - ring->head;
+}
+
+static gboolean
+event_ring_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+    KpEventRing *ring = ((KpEventRingSource *) source)->ring;
+    KpEventRingFunc func = (KpEventRingFunc) callback;
+    KpKeyboardPoll poll;
+    uint64_t value;
+
+    // Consume the wakeup before draining, so a push racing with the drain always causes another dispatch.
+    while (read(ring->event_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+    g_atomic_int_set(&ring->signalled, FALSE);
+
+    while (kp_event_ring_pop(ring, &poll)) {
+        if (func != NULL) {
+            func(&poll, user_data);
+        }
+    }
+
+    if (g_atomic_int_compare_and_exchange(&ring->waiting, TRUE, FALSE)) {
+        value = 1;
+
+        if (write(ring->space_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "Could not wake up event ring producer: %s\n", g_strerror(errno));
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs event_ring_source_funcs = {
+        .dispatch = event_ring_source_dispatch,
+};
+
+GSource *
+kp_event_ring_source_new(KpEventRing *ring) {
+    GSource *source = g_source_new(&event_ring_source_funcs, sizeof(KpEventRingSource));
+    ((KpEventRingSource *) source)->ring = ring;
+
+    g_source_set_name(source, "KpEventRing");
+    g_source_add_unix_fd(source, ring->event_fd, G_IO_IN);
+
+    return source;
+}
+
+#undef KP_EVENT_RING_MASK
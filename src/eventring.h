@@ -0,0 +1,169 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file eventring.h
+ * @brief Single-producer/single-consumer ring which carries keyboard polls from the poll thread to the main loop
+ */
+
+#ifndef KEYPRESENTER_EVENTRING_H
+#define KEYPRESENTER_EVENTRING_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <keypresenter/poll.h>
+#include "macro.h"
+#include "streamwriter.h"
+
+#ifndef KP_EVENT_RING_CAPACITY
+#define KP_EVENT_RING_CAPACITY 1024
+#endif
+
+#if (KP_EVENT_RING_CAPACITY & (KP_EVENT_RING_CAPACITY - 1)) != 0
+#error "KP_EVENT_RING_CAPACITY must be a power of two"
+#endif
+
+typedef struct _EventRing KpEventRing;
+
+/**
+ * Called by the ring's GSource for every record which has been taken out of the ring.
+ */
+typedef void (*KpEventRingFunc)(KpKeyboardPoll *poll, gpointer user_data);
+
+struct _EventRing {
+    /**
+     * Index of the next record to read. Only written by the consumer.
+     */
+    guint head CACHELINE_ALIGNED;
+
+    /**
+     * Index of the next record to write. Only written by the producer.
+     */
+    guint tail CACHELINE_ALIGNED;
+
+    /**
+     * Producer-local copy of head, so a push only touches the consumer's cache line when the ring looks full.
+     */
+    guint cached_head;
+
+    /**
+     * Amount of records which were discarded because the ring was full. Every producer waits for space with
+     * kp_event_ring_push_wait, so this only grows when a producer is cancelled while it waits.
+     */
+    guint dropped;
+
+    /**
+     * Amount of times kp_event_ring_push_wait found the ring full, and the microseconds it spent waiting for space.
+     * Only written by the producer.
+     */
+    guint stalls;
+    guint64 stalled_time;
+
+    /**
+     * (Optional) stream every pushed record is published to as well, even when the ring is full
+     */
+    KpStreamWriter *stream;
+
+    /**
+     * TRUE while a wakeup has been written to event_fd and the consumer has not picked it up yet.
+     */
+    gint signalled CACHELINE_ALIGNED;
+
+    /**
+     * eventfd used to wake up the main loop
+     */
+    int event_fd;
+
+    /**
+     * TRUE while the producer waits for space, the consumer then writes to space_fd after draining the ring.
+     */
+    gint waiting CACHELINE_ALIGNED;
+
+    /**
+     * eventfd used to wake up the producer in kp_event_ring_push_wait
+     */
+    int space_fd;
+
+    KpKeyboardPoll records[KP_EVENT_RING_CAPACITY] CACHELINE_ALIGNED;
+};
+
+/**
+ * Allocate a new, empty ring.
+ *
+ * @return Ptr to the ring or NULL if no eventfd could be created
+ */
+KpEventRing *
+kp_event_ring_new(void);
+
+void
+kp_event_ring_free(KpEventRing *ring);
+
+/**
+ * Append a record to the ring and publish it to the stream of the ring. May only be called from the producer thread.
+ * The consumer is not woken up until kp_event_ring_notify is called.
+ *
+ * @return FALSE if the ring was full and the record has been dropped
+ */
+gboolean
+kp_event_ring_push(KpEventRing *ring, const KpKeyboardPoll *poll);
+
+/**
+ * Append a record like kp_event_ring_push, but wake up the consumer and block until it has made space or the
+ * cancellable is cancelled, instead of dropping the record. Meant for producers whose source keeps queuing input in
+ * the meantime, like the socket of an X display. May only be called from the producer thread.
+ *
+ * @return FALSE if the wait was cancelled and the record has been dropped
+ */
+gboolean
+kp_event_ring_push_wait(KpEventRing *ring, const KpKeyboardPoll *poll, GCancellable *cancellable);
+
+/**
+ * Check whether a record can be pushed without being dropped. May only be called from the producer thread.
+ */
+gboolean
+kp_event_ring_has_space(KpEventRing *ring);
+
+/**
+ * Wake up the consumer if there are unread records and it has not been woken up already, and the stream readers.
+ * May only be called from the producer thread, preferably once after pushing a batch of records.
+ */
+void
+kp_event_ring_notify(KpEventRing *ring);
+
+/**
+ * Take the oldest record out of the ring. May only be called from the consumer thread.
+ *
+ * @return FALSE if the ring is empty
+ */
+gboolean
+kp_event_ring_pop(KpEventRing *ring, KpKeyboardPoll *poll);
+
+/**
+ * Amount of records which are waiting in the ring. May only be called from the consumer thread.
+ */
+guint
+kp_event_ring_depth(KpEventRing *ring);
+
+/**
+ * Create a GSource which is dispatched whenever the producer has notified the ring.
+ * Each dispatch empties the whole ring and calls the KpEventRingFunc set with g_source_set_callback for every record.
+ */
+GSource *
+kp_event_ring_source_new(KpEventRing *ring);
+
+#endif //KEYPRESENTER_EVENTRING_H
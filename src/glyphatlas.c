@@ -0,0 +1,190 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file glyphatlas.c
+ * @brief Pre-rendered glyphs in one image surface, so text can be drawn without laying it out
+ */
+
+#include <math.h>
+#include <pango/pangocairo.h>
+
+#include "glyphatlas.h"
+
+/**
+ * Symbols of the control bytes, as code points. The arrows are part of the mouse wheel labels.
+ */
+static const gunichar EXTRA_GLYPHS[0x20] = {
+        [KP_GLYPH_VISIBLE_SPACE] = 0x2423, // ␣
+        [KP_GLYPH_TIMES] = 0x00d7, // ×
+        [KP_GLYPH_ARROW_UP] = 0x2191, // ↑
+        [KP_GLYPH_ARROW_DOWN] = 0x2193, // ↓
+        [KP_GLYPH_ARROW_LEFT] = 0x2190, // ←
+        [KP_GLYPH_ARROW_RIGHT] = 0x2192, // →
+};
+
+/**
+ * @param c Start of a character in UTF-8
+ * @return Index of the glyph of the character, '?' if it has none
+ */
+static inline guint
+glyph_index(const KpGlyphAtlas *atlas, const guchar *c) {
+    if (*c < 0x80) {
+        return *c < KP_GLYPH_ATLAS_SIZE && atlas->advances[*c] > 0 ? *c : '?';
+    }
+
+    gunichar character = g_utf8_get_char_validated((const gchar *) c, -1);
+
+    for (guint symbol = 1; symbol < G_N_ELEMENTS(EXTRA_GLYPHS); ++symbol) {
+        if (EXTRA_GLYPHS[symbol] == character) {
+            return atlas->advances[symbol] > 0 ? symbol : '?';
+        }
+    }
+
+    return '?';
+}
+
+/**
+ * Set the text of the layout to the glyph of a byte.
+ *
+ * @return FALSE if the byte has no glyph
+ */
+static gboolean
+set_glyph_text(PangoLayout *layout, guint c) {
+    gchar text[6] = {(gchar) c, '\0'};
+
+    if (c < 0x20) {
+        if (EXTRA_GLYPHS[c] == 0) return FALSE;
+
+        pango_layout_set_text(layout, text, g_unichar_to_utf8(EXTRA_GLYPHS[c], text));
+    } else if (c < 0x7f) {
+        pango_layout_set_text(layout, text, 1);
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+KpGlyphAtlas *
+kp_glyph_atlas_new(const gchar *font, const gdouble (*colors)[4], guint color_count, gdouble scale) {
+    KpGlyphAtlas *atlas = g_new0(KpGlyphAtlas, 1);
+    PangoFontDescription *font_description = pango_font_description_from_string(font);
+    PangoRectangle logical;
+    gint width = 0;
+
+    atlas->color_count = color_count;
+    atlas->scale = scale;
+
+    // Measure every glyph on a scratch surface first, the atlas is allocated once its size is known
+    cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *cr = cairo_create(scratch);
+    PangoLayout *layout = pango_cairo_create_layout(cr);
+    pango_layout_set_font_description(layout, font_description);
+
+    for (guint c = 0; c < KP_GLYPH_ATLAS_SIZE; ++c) {
+        if (!set_glyph_text(layout, c)) continue;
+
+        pango_layout_get_pixel_extents(layout, NULL, &logical);
+        atlas->offsets[c] = width;
+        atlas->advances[c] = MAX(logical.width, 1);
+        atlas->line_height = MAX(atlas->line_height, logical.height);
+
+        // One pixel between glyphs, so filtering never bleeds a neighbour in
+        width += atlas->advances[c] + 1;
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(scratch);
+
+    atlas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int) ceil(width * scale),
+                                                (int) ceil(atlas->line_height * color_count * scale));
+    cairo_surface_set_device_scale(atlas->surface, scale, scale);
+
+    cr = cairo_create(atlas->surface);
+    pango_cairo_update_layout(cr, layout);
+
+    for (guint color = 0; color < color_count; ++color) {
+        cairo_set_source_rgba(cr, colors[color][0], colors[color][1], colors[color][2], colors[color][3]);
+
+        for (guint c = 0; c < KP_GLYPH_ATLAS_SIZE; ++c) {
+            if (atlas->advances[c] == 0) continue;
+
+            set_glyph_text(layout, c);
+            cairo_move_to(cr, atlas->offsets[c], color * atlas->line_height);
+            pango_cairo_show_layout(cr, layout);
+        }
+    }
+
+    cairo_destroy(cr);
+    g_object_unref(layout);
+    pango_font_description_free(font_description);
+
+    atlas->pattern = cairo_pattern_create_for_surface(atlas->surface);
+
+    return atlas;
+}
+
+void
+kp_glyph_atlas_free(KpGlyphAtlas *atlas) {
+    if (atlas == NULL) {
+        return;
+    }
+
+    cairo_pattern_destroy(atlas->pattern);
+    cairo_surface_destroy(atlas->surface);
+    g_free(atlas);
+}
+
+gint
+kp_glyph_atlas_measure(const KpGlyphAtlas *atlas, const gchar *text) {
+    gint width = 0;
+
+    for (const guchar *c = (const guchar *) text; *c != '\0'; ++c) {
+        // A multibyte character is one glyph, drawn at its first byte
+        if ((*c & 0xc0) == 0x80) continue;
+
+        width += atlas->advances[glyph_index(atlas, c)];
+    }
+
+    return width;
+}
+
+gint
+kp_glyph_atlas_draw(const KpGlyphAtlas *atlas, cairo_t *cr, const gchar *text, guint color, gdouble x, gdouble y) {
+    cairo_matrix_t matrix;
+    gdouble start = x;
+    gdouble row = MIN(color, atlas->color_count - 1) * atlas->line_height;
+
+    cairo_set_source(cr, atlas->pattern);
+
+    for (const guchar *c = (const guchar *) text; *c != '\0'; ++c) {
+        if ((*c & 0xc0) == 0x80) continue;
+
+        guint glyph = glyph_index(atlas, c);
+
+        // Map the glyph in the atlas onto x, y and fill only its cell
+        cairo_matrix_init_translate(&matrix, atlas->offsets[glyph] - x, row - y);
+        cairo_pattern_set_matrix(atlas->pattern, &matrix);
+        cairo_rectangle(cr, x, y, atlas->advances[glyph], atlas->line_height);
+        cairo_fill(cr);
+
+        x += atlas->advances[glyph];
+    }
+
+    return (gint) (x - start);
+}
@@ -0,0 +1,95 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file glyphatlas.h
+ * @brief Pre-rendered glyphs in one image surface, so text can be drawn without laying it out
+ */
+
+#ifndef KEYPRESENTER_GLYPHATLAS_H
+#define KEYPRESENTER_GLYPHATLAS_H
+
+#include <cairo.h>
+#include <glib.h>
+
+/**
+ * Glyphs are indexed by byte: printable ASCII is itself, the control bytes below hold symbols.
+ * Text may contain a symbol as its control byte or as its UTF-8 character. Every other character is drawn as '?'.
+ */
+#define KP_GLYPH_ATLAS_SIZE 128
+
+#define KP_GLYPH_VISIBLE_SPACE '\001'
+#define KP_GLYPH_TIMES '\002'
+#define KP_GLYPH_ARROW_UP '\003'
+#define KP_GLYPH_ARROW_DOWN '\004'
+#define KP_GLYPH_ARROW_LEFT '\005'
+#define KP_GLYPH_ARROW_RIGHT '\006'
+
+typedef struct _GlyphAtlas KpGlyphAtlas;
+
+struct _GlyphAtlas {
+    /**
+     * All glyphs next to each other, with a row per color
+     */
+    cairo_surface_t *surface;
+
+    /**
+     * Pattern of the surface, glyphs are drawn by moving its matrix instead of creating a pattern per glyph
+     */
+    cairo_pattern_t *pattern;
+
+    /**
+     * Left edge of each glyph in the surface, and its advance. An advance of 0 means the byte has no glyph.
+     */
+    gint offsets[KP_GLYPH_ATLAS_SIZE];
+    gint advances[KP_GLYPH_ATLAS_SIZE];
+
+    gint line_height;
+    guint color_count;
+
+    /**
+     * Device scale the surface was rendered at
+     */
+    gdouble scale;
+};
+
+/**
+ * Render every glyph once for each color.
+ *
+ * @param colors RGBA colors the glyphs are rendered in, selected by index when drawing
+ */
+KpGlyphAtlas *
+kp_glyph_atlas_new(const gchar *font, const gdouble (*colors)[4], guint color_count, gdouble scale);
+
+void
+kp_glyph_atlas_free(KpGlyphAtlas *atlas);
+
+/**
+ * @return Width of the text in user units
+ */
+gint
+kp_glyph_atlas_measure(const KpGlyphAtlas *atlas, const gchar *text);
+
+/**
+ * Draw text with its top left corner at x, y.
+ *
+ * @return Width of the text in user units
+ */
+gint
+kp_glyph_atlas_draw(const KpGlyphAtlas *atlas, cairo_t *cr, const gchar *text, guint color, gdouble x, gdouble y);
+
+#endif //KEYPRESENTER_GLYPHATLAS_H
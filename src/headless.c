@@ -0,0 +1,464 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file headless.c
+ * @brief Renders the keyboard into an offscreen image at a fixed frame rate, without any window
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib-unix.h>
+
+#include <keypresenter/keypresenter.h>
+#include "headless.h"
+#include "macro.h"
+
+KpHeadless *
+kp_headless_new(const gchar *target, gint fps, GError **error) {
+    KpHeadless *headless = g_new0(KpHeadless, 1);
+
+    headless->fps = CLAMP(fps, 1, 1000);
+    headless->fd = -1;
+
+    if (g_strcmp0(target, "-") == 0) {
+        // Frames get stdout to themselves, everything else which is printed there goes to stderr
+        headless->fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else if (g_file_test(target, G_FILE_TEST_IS_DIR)) {
+        headless->directory = g_strdup(target);
+    } else {
+        headless->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    if (headless->directory == NULL && headless->fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not open %s for rendering: %s", target, g_strerror(errno));
+        g_free(headless);
+        return NULL;
+    }
+
+    // A reader which goes away, e.g. ffmpeg, ends the rendering instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    return headless;
+}
+
+void
+kp_headless_free(KpHeadless *headless) {
+    if (headless == NULL) {
+        return;
+    }
+
+    if (headless->fd >= 0) {
+        close(headless->fd);
+    }
+
+    g_clear_pointer(&headless->renderer, kp_keyboard_renderer_free);
+    g_clear_pointer(&headless->surface, cairo_surface_destroy);
+    g_clear_pointer(&headless->damage, cairo_region_destroy);
+    g_free(headless->pixels);
+    g_free(headless->last_png);
+    g_free(headless->directory);
+    g_free(headless);
+}
+
+static void
+damage_key(KpHeadless *headless, guint16 code) {
+    cairo_rectangle_int_t rect;
+
+    if (kp_keyboard_renderer_get_key_rect(headless->renderer, code, &rect)) {
+        cairo_region_union_rectangle(headless->damage, &rect);
+    }
+}
+
+/**
+ * Copy a part of the surface to the RGBA frame, undoing the premultiplied alpha of cairo.
+ */
+static void
+convert_rect(KpHeadless *headless, const cairo_rectangle_int_t *rect) {
+    const guint8 *data = cairo_image_surface_get_data(headless->surface);
+    gint stride = cairo_image_surface_get_stride(headless->surface);
+
+    for (gint y = rect->y; y < rect->y + rect->height; ++y) {
+        const guint32 *source = (const guint32 *) (data + (gsize) y * stride) + rect->x;
+        guint8 *target = headless->pixels + ((gsize) y * headless->width + rect->x) * 4;
+
+        for (gint x = 0; x < rect->width; ++x, target += 4) {
+            guint32 pixel = source[x];
+            guint alpha = pixel >> 24;
+
+            if (alpha == 0) {
+                target[0] = target[1] = target[2] = target[3] = 0;
+                continue;
+            }
+
+            target[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+            target[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+            target[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+            target[3] = alpha;
+        }
+    }
+}
+
+/**
+ * Draw the damaged keys, the rest of the surface is left as it is.
+ */
+static void
+render_damage(KpHeadless *headless) {
+    gint64 started = g_get_monotonic_time();
+    cairo_t *cr = cairo_create(headless->surface);
+    gint count = cairo_region_num_rectangles(headless->damage);
+    cairo_rectangle_int_t rect;
+
+    for (gint i = 0; i < count; ++i) {
+        cairo_region_get_rectangle(headless->damage, i, &rect);
+        cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+    }
+    cairo_clip(cr);
+
+    cairo_save(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_restore(cr);
+
+    kp_keyboard_renderer_draw(headless->renderer, cr, 1.0);
+    cairo_destroy(cr);
+    cairo_surface_flush(headless->surface);
+
+    if (headless->directory == NULL) {
+        for (gint i = 0; i < count; ++i) {
+            cairo_region_get_rectangle(headless->damage, i, &rect);
+            convert_rect(headless, &rect);
+        }
+    }
+
+    cairo_region_destroy(headless->damage);
+    headless->damage = cairo_region_create();
+    headless->rendered++;
+    headless->render_time += g_get_monotonic_time() - started;
+}
+
+static gboolean
+write_raw(KpHeadless *headless) {
+    gsize size = (gsize) headless->width * headless->height * 4, written = 0;
+
+    while (written < size) {
+        ssize_t length = write(headless->fd, headless->pixels + written, size - written);
+
+        if (length < 0) {
+            if (errno == EINTR) continue;
+
+            if (errno != EPIPE) {
+                fprintf(stderr, "Could not write frame: %s\n", g_strerror(errno));
+            }
+            return FALSE;
+        }
+
+        written += length;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+write_png(KpHeadless *headless, gboolean changed) {
+    gchar name[32];
+    g_snprintf(name, sizeof(name), "frame-%06" G_GUINT64_FORMAT ".png", headless->frames);
+    gchar *path = g_build_filename(headless->directory, name, NULL);
+
+    // An unchanged frame is the same file under another name, it is not encoded again
+    if (!changed && headless->last_png != NULL) {
+        unlink(path);
+
+        if (link(headless->last_png, path) == 0) {
+            g_free(path);
+            return TRUE;
+        }
+    }
+
+    cairo_status_t status = cairo_surface_write_to_png(headless->surface, path);
+
+    if (status != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not write %s: %s\n", path, cairo_status_to_string(status));
+        g_free(path);
+        return FALSE;
+    }
+
+    g_free(headless->last_png);
+    headless->last_png = path;
+
+    return TRUE;
+}
+
+/**
+ * Write the next frame, it is only drawn again if a key has changed.
+ *
+ * @return FALSE if the frame could not be written
+ */
+static gboolean
+emit_frame(KpHeadless *headless) {
+    gboolean changed = !cairo_region_is_empty(headless->damage);
+
+    if (changed) {
+        render_damage(headless);
+    }
+
+    gboolean written = headless->directory != NULL ? write_png(headless, changed) : write_raw(headless);
+    headless->frames++;
+
+    return written;
+}
+
+static void
+on_key_animation_frame(guint16 keycode, gdouble intensity, gpointer headless_p) {
+    KpHeadless *headless = headless_p;
+
+    if (kp_key_model_set_intensity(headless->result->key_model, keycode, CLAMP(intensity, 0.0, 1.0))) {
+        damage_key(headless, keycode);
+    }
+}
+
+/**
+ * Apply a poll to the key model, like the user interface does for its keyboard view.
+ *
+ * @param time Time of the poll on the clock of the animator
+ */
+static void
+handle_poll(KpHeadless *headless, KpKeyboardPoll *poll, gint64 time) {
+    KpPollTaskResult *result = headless->result;
+    KpKeyModel *model = result->key_model;
+
+    if (result->recorder != NULL) {
+        kp_recorder_add(result->recorder, poll);
+    }
+
+    if (poll->result == POLL_KEYMAP_CHANGED) {
+        if (kp_key_model_set_label(model, poll->key.code, poll->key.label)) {
+            kp_keyboard_renderer_invalidate_key(headless->renderer, poll->key.code);
+            damage_key(headless, poll->key.code);
+        }
+        return;
+    }
+
+    // The frame size is fixed once the first frame has been written, keys which are placed outside of it are cut off
+    if (poll->result == POLL_KEY_ADDED) {
+        if (kp_key_model_add(model, poll->key.code, poll->key.label)) {
+            cairo_rectangle_int_t bounds = {0, 0, headless->width, headless->height};
+
+            kp_layout_set_apply(result->layouts, result->layout, model);
+            cairo_region_union_rectangle(headless->damage, &bounds);
+        }
+        return;
+    }
+
+    if (poll->result != POLL_OK) {
+        return;
+    }
+
+    gboolean shown = kp_key_model_contains(model, poll->key.code);
+    const gchar *label = shown ? model->labels[poll->key.code] : poll->key.label;
+
+    // Autorepeat presses leave the state unchanged, so they do not restart the animation.
+    switch (kp_key_state_update(result->key_state, poll, label)) {
+        case KP_KEY_STATE_CHORD:
+        case KP_KEY_STATE_PRESSED:
+            break;
+        default:
+            return;
+    }
+
+    if (shown) {
+        if (kp_key_model_set_device(model, poll->key.code, poll->device) && model->intensities[poll->key.code] > 0.0) {
+            damage_key(headless, poll->key.code);
+        }
+        kp_animator_press_at(result->animator, poll->key.code, time);
+    }
+}
+
+static void
+on_poll(KpKeyboardPoll *poll, gpointer headless_p) {
+    KpHeadless *headless = headless_p;
+    KpPollTaskResult *result = headless->result;
+
+    kp_stats_record_dispatch(result->stats, poll, kp_event_ring_depth(result->event_ring) + 1);
+    handle_poll(headless, poll, g_get_monotonic_time());
+}
+
+/**
+ * Write every frame which is due. A late timer writes several frames at once, so the video keeps its frame rate.
+ */
+static gboolean
+on_frame_timeout(gpointer headless_p) {
+    KpHeadless *headless = headless_p;
+    guint64 due = (g_get_monotonic_time() - headless->started) * headless->fps / G_USEC_PER_SEC + 1;
+
+    while (headless->frames < due) {
+        kp_animator_advance(headless->result->animator,
+                            headless->started + (gint64) (headless->frames * G_USEC_PER_SEC / headless->fps));
+
+        if (!emit_frame(headless)) {
+            // The poll task returns first, on_poll_task_done then quits the main loop
+            headless->failed = TRUE;
+            g_cancellable_cancel(headless->cancellable);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+on_poll_task_done(GObject *UNUSED(source_obj), GAsyncResult *res, gpointer headless_p) {
+    KpHeadless *headless = headless_p;
+    GError *error = NULL;
+
+    if (!g_task_propagate_boolean(G_TASK(res), &error)) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            fprintf(stderr, "Keyboard poll task failed: %s\n", error->message);
+        }
+
+        g_error_free(error);
+    }
+
+    g_main_loop_quit(headless->loop);
+}
+
+static gboolean
+on_signal(gpointer cancellable) {
+    g_cancellable_cancel(G_CANCELLABLE(cancellable));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Render live events in real time, until the poll task has returned.
+ */
+static void
+run_live(KpHeadless *headless) {
+    KpPollTaskResult *result = headless->result;
+
+    GSource *event_source = kp_event_ring_source_new(result->event_ring);
+    g_source_set_callback(event_source, (GSourceFunc) on_poll, headless, NULL);
+    guint event_source_id = g_source_attach(event_source, NULL);
+    g_source_unref(event_source);
+
+    GTask *task = g_task_new(NULL, headless->cancellable, on_poll_task_done, headless);
+    g_task_set_task_data(task, result, NULL);
+    g_task_run_in_thread(task, kp_keyboard_poll_task);
+    g_object_unref(task);
+
+    headless->started = g_get_monotonic_time();
+    guint frame_source_id = g_timeout_add(MAX(1000 / headless->fps, 1), on_frame_timeout, headless);
+
+    g_main_loop_run(headless->loop);
+
+    if (!headless->failed) {
+        g_source_remove(frame_source_id);
+    }
+    g_source_remove(event_source_id);
+}
+
+/**
+ * Render a recording frame by frame on a clock of its own, as fast as the frames can be written.
+ * The entries bypass the event ring, so they are published to its stream here, with the timing of the frames.
+ */
+static void
+run_replay(KpHeadless *headless) {
+    KpReplay *replay = headless->result->replay;
+    KpStreamWriter *stream = headless->result->event_ring->stream;
+    gsize next = 0;
+
+    while (!g_cancellable_is_cancelled(headless->cancellable)) {
+        gint64 now = (gint64) (headless->frames * G_USEC_PER_SEC / headless->fps);
+        KpKeyboardPoll poll;
+
+        for (; next < replay->count && (gint64) replay->entries[next].offset <= now; ++next) {
+            if (kp_replay_get_poll(replay, next, &poll)) {
+                handle_poll(headless, &poll, (gint64) replay->entries[next].offset);
+
+                if (stream != NULL) {
+                    kp_stream_writer_push(stream, &poll);
+                }
+            }
+        }
+
+        if (stream != NULL) {
+            kp_stream_writer_notify(stream);
+        }
+
+        gboolean animating = kp_animator_advance(headless->result->animator, now);
+
+        if (!emit_frame(headless)) {
+            headless->failed = TRUE;
+            return;
+        }
+
+        if (next == replay->count && !animating) {
+            break;
+        }
+
+        // Let the signal handlers run
+        g_main_context_iteration(NULL, FALSE);
+    }
+}
+
+gboolean
+kp_headless_run(KpHeadless *headless, KpPollTaskResult *result, guint animation_duration, GCancellable *cancellable) {
+    headless->result = result;
+    headless->cancellable = cancellable;
+    headless->renderer = kp_keyboard_renderer_new(result->key_model);
+    kp_keyboard_renderer_get_size(headless->renderer, &headless->width, &headless->height);
+
+    headless->width = MAX(headless->width, 1);
+    headless->height = MAX(headless->height, 1);
+    headless->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, headless->width, headless->height);
+    headless->pixels = g_malloc0((gsize) headless->width * headless->height * 4);
+
+    // The first frame draws every key
+    cairo_rectangle_int_t bounds = {0, 0, headless->width, headless->height};
+    headless->damage = cairo_region_create_rectangle(&bounds);
+
+    result->animator = kp_animator_new(NULL, animation_duration, on_key_animation_frame, headless);
+    headless->loop = g_main_loop_new(NULL, FALSE);
+
+    guint sigint_id = g_unix_signal_add(SIGINT, on_signal, cancellable);
+    guint sigterm_id = g_unix_signal_add(SIGTERM, on_signal, cancellable);
+
+    fprintf(stderr, "Rendering %dx%d frames at %d fps to %s\n", headless->width, headless->height, headless->fps,
+            headless->directory != NULL ? headless->directory : "raw RGBA output");
+
+    if (result->replay != NULL) {
+        run_replay(headless);
+    } else {
+        run_live(headless);
+    }
+
+    fprintf(stderr, "Wrote %" G_GUINT64_FORMAT " frames, drew %" G_GUINT64_FORMAT " of them in %.1f us on average\n",
+            headless->frames, headless->rendered,
+            headless->rendered > 0 ? (gdouble) headless->render_time / headless->rendered : 0.0);
+
+    g_source_remove(sigint_id);
+    g_source_remove(sigterm_id);
+    g_main_loop_unref(headless->loop);
+    g_clear_pointer(&result->animator, kp_animator_free);
+
+    return !headless->failed;
+}
@@ -0,0 +1,119 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file headless.h
+ * @brief Renders the keyboard into an offscreen image at a fixed frame rate, without any window
+ */
+
+#ifndef KEYPRESENTER_HEADLESS_H
+#define KEYPRESENTER_HEADLESS_H
+
+#include <cairo.h>
+#include <gio/gio.h>
+
+#include "keyboardrenderer.h"
+#include "polltaskresult.h"
+
+#ifndef DEFAULT_HEADLESS_FPS
+#define DEFAULT_HEADLESS_FPS 30
+#endif
+
+typedef struct _Headless KpHeadless;
+
+/**
+ * Frames go to a directory as a PNG sequence, or to a file or pipe as raw RGBA with straight alpha.
+ */
+struct _Headless {
+    gint fps;
+
+    /**
+     * Directory of the PNG sequence, or NULL if raw frames are written to fd
+     */
+    gchar *directory;
+    int fd;
+
+    KpPollTaskResult *result;
+    KpKeyboardRenderer *renderer;
+    cairo_surface_t *surface;
+    gint width;
+    gint height;
+
+    /**
+     * Keys which have changed since the last frame, only they are drawn again
+     */
+    cairo_region_t *damage;
+
+    /**
+     * RGBA copy of the surface, written again as it is for frames in which nothing has changed
+     */
+    guint8 *pixels;
+
+    /**
+     * Last PNG which was encoded, frames in which nothing has changed are hard links to it
+     */
+    gchar *last_png;
+
+    /**
+     * Monotonic time in microseconds of frame 0 when rendering live events
+     */
+    gint64 started;
+
+    /**
+     * Amount of frames written, and how many of them had to be drawn
+     */
+    guint64 frames;
+    guint64 rendered;
+
+    /**
+     * Total time in microseconds spent drawing and converting frames
+     */
+    gint64 render_time;
+
+    /**
+     * TRUE once a frame could not be written, e.g. because the reader of the pipe has gone away
+     */
+    gboolean failed;
+
+    GCancellable *cancellable;
+    GMainLoop *loop;
+};
+
+/**
+ * Open the target of the frames. "-" writes raw frames to stdout, messages which would go there go to stderr instead.
+ *
+ * @param target Existing directory for a PNG sequence, or a file or pipe for raw frames
+ * @return Ptr to the renderer, or NULL with error set
+ */
+KpHeadless *
+kp_headless_new(const gchar *target, gint fps, GError **error);
+
+/**
+ * Render until the poll task has returned, or until a recording has been rendered completely.
+ * A recording is rendered as fast as possible with its original timing, instead of being replayed in real time.
+ *
+ * @param result Everything but the user interface and the animator, the key model has to be placed already
+ * @param animation_duration Time in milliseconds it takes for a key to decay
+ * @return FALSE if the frames could not be written
+ */
+gboolean
+kp_headless_run(KpHeadless *headless, KpPollTaskResult *result, guint animation_duration, GCancellable *cancellable);
+
+void
+kp_headless_free(KpHeadless *headless);
+
+#endif //KEYPRESENTER_HEADLESS_H
@@ -0,0 +1,216 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keyboardrenderer.c
+ * @brief Cairo renderer for the keyboard, which caches each keycap in image surfaces
+ */
+
+#include <math.h>
+#include <pango/pangocairo.h>
+
+#include "keyboardrenderer.h"
+
+#define KEYCAP_CORNER_RADIUS 4.0
+#define KEYCAP_FONT "Sans 11"
+
+/**
+ * Device 0 and the first keyboard share the blue, so a single keyboard looks the same with or without device slots.
+ */
+static const gdouble KEYCAP_COLORS[KEYCAP_STATE_COUNT][3][4] = {
+        // Fill, border, label
+        [KEYCAP_RELEASED]    = {{0.96, 0.96, 0.95, 0.85}, {0.70, 0.70, 0.68, 1.0}, {0.18, 0.20, 0.21, 1.0}},
+        [KEYCAP_PRESSED]     = {{0.21, 0.52, 0.89, 0.95}, {0.11, 0.35, 0.65, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 1] = {{0.21, 0.52, 0.89, 0.95}, {0.11, 0.35, 0.65, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 2] = {{0.93, 0.45, 0.13, 0.95}, {0.70, 0.30, 0.05, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 3] = {{0.20, 0.63, 0.33, 0.95}, {0.10, 0.43, 0.20, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 4] = {{0.57, 0.32, 0.78, 0.95}, {0.38, 0.18, 0.56, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 5] = {{0.85, 0.20, 0.25, 0.95}, {0.60, 0.10, 0.14, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 6] = {{0.09, 0.62, 0.65, 0.95}, {0.04, 0.42, 0.45, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+        [KEYCAP_PRESSED + 7] = {{0.85, 0.38, 0.65, 0.95}, {0.62, 0.22, 0.45, 1.0}, {1.00, 1.00, 1.00, 1.0}},
+};
+
+G_STATIC_ASSERT(KP_POLL_DEVICE_COUNT == 8);
+
+static void
+clear_surfaces(KpKeyboardRenderer *renderer, guint16 code) {
+    for (int state = 0; state < KEYCAP_STATE_COUNT; ++state) {
+        g_clear_pointer(&renderer->surfaces[code][state], cairo_surface_destroy);
+    }
+}
+
+static cairo_surface_t *
+render_keycap(const gchar *label, gint width, gint height, KpKeycapState state, cairo_surface_t *target, gdouble scale) {
+    const gdouble (*colors)[4] = KEYCAP_COLORS[state];
+
+    cairo_surface_t *surface = cairo_surface_create_similar_image(target, CAIRO_FORMAT_ARGB32,
+                                                                  (int) ceil(width * scale), (int) ceil(height * scale));
+    cairo_surface_set_device_scale(surface, scale, scale);
+
+    cairo_t *cr = cairo_create(surface);
+
+    cairo_new_sub_path(cr);
+    cairo_arc(cr, width - KEYCAP_CORNER_RADIUS - 0.5, KEYCAP_CORNER_RADIUS + 0.5, KEYCAP_CORNER_RADIUS, -M_PI_2, 0);
+    cairo_arc(cr, width - KEYCAP_CORNER_RADIUS - 0.5, height - KEYCAP_CORNER_RADIUS - 0.5, KEYCAP_CORNER_RADIUS, 0, M_PI_2);
+    cairo_arc(cr, KEYCAP_CORNER_RADIUS + 0.5, height - KEYCAP_CORNER_RADIUS - 0.5, KEYCAP_CORNER_RADIUS, M_PI_2, M_PI);
+    cairo_arc(cr, KEYCAP_CORNER_RADIUS + 0.5, KEYCAP_CORNER_RADIUS + 0.5, KEYCAP_CORNER_RADIUS, M_PI, 3 * M_PI_2);
+    cairo_close_path(cr);
+
+    cairo_set_source_rgba(cr, colors[0][0], colors[0][1], colors[0][2], colors[0][3]);
+    cairo_fill_preserve(cr);
+    cairo_set_source_rgba(cr, colors[1][0], colors[1][1], colors[1][2], colors[1][3]);
+    cairo_set_line_width(cr, 1.0);
+    cairo_stroke(cr);
+
+    if (label != NULL) {
+        PangoLayout *layout = pango_cairo_create_layout(cr);
+        PangoFontDescription *font = pango_font_description_from_string(KEYCAP_FONT);
+        gint label_width, label_height;
+
+        pango_layout_set_font_description(layout, font);
+        pango_layout_set_text(layout, label, -1);
+        pango_layout_get_pixel_size(layout, &label_width, &label_height);
+
+        cairo_set_source_rgba(cr, colors[2][0], colors[2][1], colors[2][2], colors[2][3]);
+        cairo_move_to(cr, (width - label_width) / 2.0, (height - label_height) / 2.0);
+        pango_cairo_show_layout(cr, layout);
+
+        pango_font_description_free(font);
+        g_object_unref(layout);
+    }
+
+    cairo_destroy(cr);
+
+    return surface;
+}
+
+KpKeyboardRenderer *
+kp_keyboard_renderer_new(KpKeyModel *model) {
+    KpKeyboardRenderer *renderer = g_new0(KpKeyboardRenderer, 1);
+
+    renderer->model = model;
+    renderer->scale = 1.0;
+
+    return renderer;
+}
+
+void
+kp_keyboard_renderer_free(KpKeyboardRenderer *renderer) {
+    if (renderer == NULL) {
+        return;
+    }
+
+    for (int code = 0; code < KP_KEY_MODEL_SIZE; ++code) {
+        clear_surfaces(renderer, code);
+    }
+
+    g_free(renderer);
+}
+
+gboolean
+kp_keyboard_renderer_get_key_rect(KpKeyboardRenderer *renderer, guint16 code, cairo_rectangle_int_t *rect) {
+    KpKeyModel *model = renderer->model;
+
+    if (!kp_key_model_contains(model, code) || model->spans[code] == 0) {
+        return FALSE;
+    }
+
+    rect->x = model->columns[code] * (KP_KEYCAP_WIDTH + KP_KEYCAP_SPACING) / KP_KEY_MODEL_UNIT;
+    rect->y = model->rows[code] * (KP_KEYCAP_HEIGHT + KP_KEYCAP_SPACING) / KP_KEY_MODEL_UNIT;
+    rect->width = model->spans[code] * (KP_KEYCAP_WIDTH + KP_KEYCAP_SPACING) / KP_KEY_MODEL_UNIT - KP_KEYCAP_SPACING;
+    rect->height = KP_KEYCAP_HEIGHT;
+
+    return TRUE;
+}
+
+void
+kp_keyboard_renderer_get_size(KpKeyboardRenderer *renderer, gint *width, gint *height) {
+    KpKeyModel *model = renderer->model;
+    cairo_rectangle_int_t rect;
+
+    *width = *height = 0;
+
+    for (guint i = 0; i < model->count; ++i) {
+        if (kp_keyboard_renderer_get_key_rect(renderer, model->codes[i], &rect)) {
+            *width = MAX(*width, rect.x + rect.width);
+            *height = MAX(*height, rect.y + rect.height);
+        }
+    }
+}
+
+void
+kp_keyboard_renderer_invalidate_key(KpKeyboardRenderer *renderer, guint16 code) {
+    if (code < KP_KEY_MODEL_SIZE) {
+        clear_surfaces(renderer, code);
+    }
+}
+
+void
+kp_keyboard_renderer_draw(KpKeyboardRenderer *renderer, cairo_t *cr, gdouble scale) {
+    KpKeyModel *model = renderer->model;
+    cairo_surface_t *target = cairo_get_target(cr);
+    gdouble clip_x1, clip_y1, clip_x2, clip_y2;
+    cairo_rectangle_int_t rect;
+
+    if (scale != renderer->scale) {
+        for (int code = 0; code < KP_KEY_MODEL_SIZE; ++code) {
+            clear_surfaces(renderer, code);
+        }
+        renderer->scale = scale;
+    }
+
+    cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+
+    for (guint i = 0; i < model->count; ++i) {
+        guint16 code = model->codes[i];
+        gdouble intensity = model->intensities[code];
+        cairo_surface_t **surfaces = renderer->surfaces[code];
+
+        if (!kp_keyboard_renderer_get_key_rect(renderer, code, &rect)) {
+            continue;
+        }
+
+        if (rect.x >= clip_x2 || rect.y >= clip_y2
+            || rect.x + rect.width <= clip_x1 || rect.y + rect.height <= clip_y1) {
+            continue;
+        }
+
+        if (intensity < 1.0) {
+            if (surfaces[KEYCAP_RELEASED] == NULL) {
+                surfaces[KEYCAP_RELEASED] = render_keycap(model->labels[code], rect.width, rect.height,
+                                                          KEYCAP_RELEASED, target, scale);
+            }
+
+            cairo_set_source_surface(cr, surfaces[KEYCAP_RELEASED], rect.x, rect.y);
+            cairo_paint(cr);
+        }
+
+        if (intensity > 0.0) {
+            KpKeycapState pressed = KEYCAP_PRESSED + MIN(model->devices[code], KP_POLL_DEVICE_COUNT - 1);
+
+            if (surfaces[pressed] == NULL) {
+                surfaces[pressed] = render_keycap(model->labels[code], rect.width, rect.height, pressed, target, scale);
+            }
+
+            cairo_set_source_surface(cr, surfaces[pressed], rect.x, rect.y);
+            cairo_paint_with_alpha(cr, intensity);
+        }
+    }
+}
+
+#undef KEYCAP_CORNER_RADIUS
+#undef KEYCAP_FONT
@@ -0,0 +1,108 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keyboardrenderer.h
+ * @brief Cairo renderer for the keyboard, which caches each keycap in image surfaces
+ */
+
+#ifndef KEYPRESENTER_KEYBOARDRENDERER_H
+#define KEYPRESENTER_KEYBOARDRENDERER_H
+
+#include <cairo.h>
+#include <glib.h>
+
+#include <keypresenter/keymodel.h>
+#include <keypresenter/poll.h>
+
+#ifndef KP_KEYCAP_WIDTH
+#define KP_KEYCAP_WIDTH 85
+#endif
+
+#ifndef KP_KEYCAP_HEIGHT
+#define KP_KEYCAP_HEIGHT 50
+#endif
+
+#ifndef KP_KEYCAP_SPACING
+#define KP_KEYCAP_SPACING 3
+#endif
+
+typedef enum _KeycapState KpKeycapState;
+typedef struct _KeyboardRenderer KpKeyboardRenderer;
+
+/**
+ * Every keyboard slot has a pressed state of its own, the pressed state of a key is KEYCAP_PRESSED + its device.
+ */
+enum _KeycapState {
+    KEYCAP_RELEASED = 0,
+    KEYCAP_PRESSED  = 1,
+    KEYCAP_STATE_COUNT = KEYCAP_PRESSED + KP_POLL_DEVICE_COUNT,
+};
+
+struct _KeyboardRenderer {
+    /**
+     * Keys to draw, not owned by the renderer
+     */
+    KpKeyModel *model;
+
+    /**
+     * Pre-rendered keycap per keycode and state, NULL until first drawn or after the key has been invalidated.
+     * Only the states which have been drawn are rendered, so unused keyboard colors cost nothing.
+     */
+    cairo_surface_t *surfaces[KP_KEY_MODEL_SIZE][KEYCAP_STATE_COUNT];
+
+    /**
+     * Device scale the cached surfaces were rendered at
+     */
+    gdouble scale;
+};
+
+KpKeyboardRenderer *
+kp_keyboard_renderer_new(KpKeyModel *model);
+
+void
+kp_keyboard_renderer_free(KpKeyboardRenderer *renderer);
+
+/**
+ * Get the bounds of a key in renderer coordinates.
+ *
+ * @return FALSE if the key is not in the model or has not been placed
+ */
+gboolean
+kp_keyboard_renderer_get_key_rect(KpKeyboardRenderer *renderer, guint16 code, cairo_rectangle_int_t *rect);
+
+/**
+ * Get the size needed to draw every placed key.
+ */
+void
+kp_keyboard_renderer_get_size(KpKeyboardRenderer *renderer, gint *width, gint *height);
+
+/**
+ * Drop the cached surfaces of a key, for example after its label has changed.
+ */
+void
+kp_keyboard_renderer_invalidate_key(KpKeyboardRenderer *renderer, guint16 code);
+
+/**
+ * Draw all keycaps which intersect the clip of the cairo context.
+ *
+ * @param scale Device scale of the target, used for the cached surfaces
+ */
+void
+kp_keyboard_renderer_draw(KpKeyboardRenderer *renderer, cairo_t *cr, gdouble scale);
+
+#endif //KEYPRESENTER_KEYBOARDRENDERER_H
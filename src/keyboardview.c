@@ -0,0 +1,169 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keyboardview.c
+ * @brief Widget which draws the whole keyboard in a single draw handler
+ */
+
+#include <math.h>
+
+#include "keyboardview.h"
+#include "macro.h"
+
+/**
+ * Intensity changes smaller than this are not worth a redraw.
+ */
+#define KEYBOARD_VIEW_INTENSITY_STEP (1.0 / 64.0)
+
+struct _KpKeyboardView {
+    GtkDrawingArea parent_instance;
+
+    KpKeyModel *model;
+    KpKeyboardRenderer *renderer;
+};
+
+G_DEFINE_TYPE(KpKeyboardView, kp_keyboard_view, GTK_TYPE_DRAWING_AREA)
+
+static void
+queue_draw_key(KpKeyboardView *view, guint16 code) {
+    cairo_rectangle_int_t rect;
+
+    if (kp_keyboard_renderer_get_key_rect(view->renderer, code, &rect)) {
+        gtk_widget_queue_draw_area(GTK_WIDGET(view), rect.x, rect.y, rect.width, rect.height);
+    }
+}
+
+static gboolean
+kp_keyboard_view_draw(GtkWidget *widget, cairo_t *cr) {
+    KpKeyboardView *view = KP_KEYBOARD_VIEW(widget);
+
+    kp_keyboard_renderer_draw(view->renderer, cr, gtk_widget_get_scale_factor(widget));
+
+    return FALSE;
+}
+
+static void
+kp_keyboard_view_get_preferred_width(GtkWidget *widget, gint *minimum, gint *natural) {
+    gint height;
+
+    kp_keyboard_renderer_get_size(KP_KEYBOARD_VIEW(widget)->renderer, minimum, &height);
+    *natural = *minimum;
+}
+
+static void
+kp_keyboard_view_get_preferred_height(GtkWidget *widget, gint *minimum, gint *natural) {
+    gint width;
+
+    kp_keyboard_renderer_get_size(KP_KEYBOARD_VIEW(widget)->renderer, &width, minimum);
+    *natural = *minimum;
+}
+
+static void
+kp_keyboard_view_finalize(GObject *object) {
+    g_clear_pointer(&KP_KEYBOARD_VIEW(object)->renderer, kp_keyboard_renderer_free);
+
+    G_OBJECT_CLASS(kp_keyboard_view_parent_class)->finalize(object);
+}
+
+static void
+kp_keyboard_view_class_init(KpKeyboardViewClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+
+    object_class->finalize = kp_keyboard_view_finalize;
+
+    widget_class->draw = kp_keyboard_view_draw;
+    widget_class->get_preferred_width = kp_keyboard_view_get_preferred_width;
+    widget_class->get_preferred_height = kp_keyboard_view_get_preferred_height;
+}
+
+static void
+kp_keyboard_view_init(KpKeyboardView *UNUSED(view)) {
+}
+
+GtkWidget *
+kp_keyboard_view_new(KpKeyModel *model) {
+    KpKeyboardView *view = g_object_new(KP_TYPE_KEYBOARD_VIEW, NULL);
+
+    view->model = model;
+    view->renderer = kp_keyboard_renderer_new(model);
+
+    return GTK_WIDGET(view);
+}
+
+gboolean
+kp_keyboard_view_set_key_label(KpKeyboardView *view, guint16 code, gchar *label) {
+    if (!kp_key_model_set_label(view->model, code, label)) {
+        return FALSE;
+    }
+
+    kp_keyboard_view_queue_draw_key(view, code, TRUE);
+
+    return TRUE;
+}
+
+gboolean
+kp_keyboard_view_set_key_intensity(KpKeyboardView *view, guint16 code, gdouble intensity) {
+    if (!kp_key_model_contains(view->model, code)) {
+        return FALSE;
+    }
+
+    intensity = CLAMP(intensity, 0.0, 1.0);
+
+    // Always redraw when reaching either end, so a key never stays slightly highlighted.
+    if (fabs(view->model->intensities[code] - intensity) < KEYBOARD_VIEW_INTENSITY_STEP
+        && intensity > 0.0 && intensity < 1.0) {
+        return FALSE;
+    }
+
+    if (!kp_key_model_set_intensity(view->model, code, intensity)) {
+        return FALSE;
+    }
+
+    queue_draw_key(view, code);
+
+    return TRUE;
+}
+
+gboolean
+kp_keyboard_view_set_key_device(KpKeyboardView *view, guint16 code, guint8 device) {
+    if (!kp_key_model_set_device(view->model, code, device) || view->model->intensities[code] <= 0.0) {
+        return FALSE;
+    }
+
+    queue_draw_key(view, code);
+
+    return TRUE;
+}
+
+void
+kp_keyboard_view_keys_changed(KpKeyboardView *view) {
+    gtk_widget_queue_resize(GTK_WIDGET(view));
+    gtk_widget_queue_draw(GTK_WIDGET(view));
+}
+
+void
+kp_keyboard_view_queue_draw_key(KpKeyboardView *view, guint16 code, gboolean invalidate) {
+    if (invalidate) {
+        kp_keyboard_renderer_invalidate_key(view->renderer, code);
+    }
+
+    queue_draw_key(view, code);
+}
+
+#undef KEYBOARD_VIEW_INTENSITY_STEP
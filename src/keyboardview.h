@@ -0,0 +1,82 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keyboardview.h
+ * @brief Widget which draws the whole keyboard in a single draw handler
+ */
+
+#ifndef KEYPRESENTER_KEYBOARDVIEW_H
+#define KEYPRESENTER_KEYBOARDVIEW_H
+
+#include <gtk/gtk.h>
+
+#include "keyboardrenderer.h"
+
+G_BEGIN_DECLS
+
+#define KP_TYPE_KEYBOARD_VIEW (kp_keyboard_view_get_type())
+G_DECLARE_FINAL_TYPE(KpKeyboardView, kp_keyboard_view, KP, KEYBOARD_VIEW, GtkDrawingArea)
+
+/**
+ * @param model Keys to draw, must outlive the widget
+ */
+GtkWidget *
+kp_keyboard_view_new(KpKeyModel *model);
+
+/**
+ * Change the label of a key, only the key itself is redrawn.
+ *
+ * @return TRUE if the label of the key in the model has changed
+ */
+gboolean
+kp_keyboard_view_set_key_label(KpKeyboardView *view, guint16 code, gchar *label);
+
+/**
+ * Change the highlight intensity of a key, only the key itself is redrawn.
+ *
+ * @return TRUE if the change was big enough to be stored in the model and redrawn
+ */
+gboolean
+kp_keyboard_view_set_key_intensity(KpKeyboardView *view, guint16 code, gdouble intensity);
+
+/**
+ * Change the keyboard slot a key was last pressed on, a highlighted key is redrawn in the color of the new slot.
+ *
+ * @return TRUE if the key has been redrawn
+ */
+gboolean
+kp_keyboard_view_set_key_device(KpKeyboardView *view, guint16 code, guint8 device);
+
+/**
+ * Request a new size and redraw every key, after keys have been added to the model and placed anew.
+ */
+void
+kp_keyboard_view_keys_changed(KpKeyboardView *view);
+
+/**
+ * Redraw a key after another view which shares the model has changed it.
+ * The redraw happens on the next frame of the frame clock of this view.
+ *
+ * @param invalidate TRUE if the label has changed, so the cached drawing of the key can not be used anymore
+ */
+void
+kp_keyboard_view_queue_draw_key(KpKeyboardView *view, guint16 code, gboolean invalidate);
+
+G_END_DECLS
+
+#endif //KEYPRESENTER_KEYBOARDVIEW_H
@@ -0,0 +1,90 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keymodel.c
+ * @brief Flat key model indexed by keycode
+ */
+
+#include <keypresenter/keymodel.h>
+
+KpKeyModel *
+kp_key_model_new(void) {
+    return g_new0(KpKeyModel, 1);
+}
+
+void
+kp_key_model_free(KpKeyModel *model) {
+    g_free(model);
+}
+
+gboolean
+kp_key_model_add(KpKeyModel *model, guint16 code, gchar *label) {
+    if (code >= KP_KEY_MODEL_SIZE || model->present[code]) {
+        return FALSE;
+    }
+
+    model->codes[model->count++] = code;
+    model->present[code] = TRUE;
+    model->labels[code] = label;
+
+    return TRUE;
+}
+
+void
+kp_key_model_place(KpKeyModel *model, guint16 code, guint8 column, guint8 row, guint8 span) {
+    if (!kp_key_model_contains(model, code)) {
+        return;
+    }
+
+    model->columns[code] = column;
+    model->rows[code] = row;
+    model->spans[code] = span;
+}
+
+gboolean
+kp_key_model_set_label(KpKeyModel *model, guint16 code, gchar *label) {
+    if (!kp_key_model_contains(model, code) || g_strcmp0(model->labels[code], label) == 0) {
+        return FALSE;
+    }
+
+    model->labels[code] = label;
+
+    return TRUE;
+}
+
+gboolean
+kp_key_model_set_intensity(KpKeyModel *model, guint16 code, gdouble intensity) {
+    if (!kp_key_model_contains(model, code) || model->intensities[code] == intensity) {
+        return FALSE;
+    }
+
+    model->intensities[code] = intensity;
+
+    return TRUE;
+}
+
+gboolean
+kp_key_model_set_device(KpKeyModel *model, guint16 code, guint8 device) {
+    if (!kp_key_model_contains(model, code) || model->devices[code] == device) {
+        return FALSE;
+    }
+
+    model->devices[code] = device;
+
+    return TRUE;
+}
@@ -0,0 +1,102 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keystate.c
+ * @brief Press/release tracking of every keycode, with modifier chords
+ */
+
+#include "keystate.h"
+
+/**
+ * Chord prefix of every combination of modifiers, indexed by KpKeyModifier mask
+ */
+static const gchar *const MODIFIER_PREFIXES[1 << KP_KEY_MODIFIER_COUNT] = {
+        "",
+        "Ctrl+",
+        "Shift+",
+        "Ctrl+Shift+",
+        "Alt+",
+        "Ctrl+Alt+",
+        "Shift+Alt+",
+        "Ctrl+Shift+Alt+",
+        "Super+",
+        "Ctrl+Super+",
+        "Shift+Super+",
+        "Ctrl+Shift+Super+",
+        "Alt+Super+",
+        "Ctrl+Alt+Super+",
+        "Shift+Alt+Super+",
+        "Ctrl+Shift+Alt+Super+",
+};
+
+KpKeyState *
+kp_key_state_new(void) {
+    return g_new0(KpKeyState, 1);
+}
+
+void
+kp_key_state_free(KpKeyState *state) {
+    g_free(state);
+}
+
+static void
+update_modifier(KpKeyState *state, KpKeyModifier modifier, gboolean pressed) {
+    guint8 *held = &state->modifier_keys[g_bit_nth_lsf(modifier, -1)];
+
+    if (pressed) {
+        (*held)++;
+        state->modifiers |= modifier;
+    } else if (*held > 0 && --(*held) == 0) {
+        state->modifiers &= ~modifier;
+    }
+}
+
+KpKeyStateChange
+kp_key_state_update(KpKeyState *state, const KpKeyboardPoll *poll, const gchar *label) {
+    guint16 code = poll->key.code;
+
+    if (poll->result != POLL_OK || code >= KP_KEY_STATE_SIZE || kp_key_state_is_pressed(state, code) == poll->pressed) {
+        return KP_KEY_STATE_UNCHANGED;
+    }
+
+    state->pressed[code / 64] ^= G_GUINT64_CONSTANT(1) << (code % 64);
+
+    if (poll->key.modifier != KP_KEY_MODIFIER_NONE) {
+        update_modifier(state, poll->key.modifier, poll->pressed);
+        return poll->pressed ? KP_KEY_STATE_PRESSED : KP_KEY_STATE_RELEASED;
+    }
+
+    if (!poll->pressed) {
+        return KP_KEY_STATE_RELEASED;
+    }
+
+    if (state->modifiers == KP_KEY_MODIFIER_NONE) {
+        return KP_KEY_STATE_PRESSED;
+    }
+
+    // Single letters are shown in upper case, like they are printed on the keycap
+    if (label != NULL && label[0] != '\0' && label[1] == '\0') {
+        g_snprintf(state->chord, sizeof(state->chord), "%s%c", MODIFIER_PREFIXES[state->modifiers], g_ascii_toupper(label[0]));
+    } else if (label != NULL) {
+        g_snprintf(state->chord, sizeof(state->chord), "%s%s", MODIFIER_PREFIXES[state->modifiers], label);
+    } else {
+        g_snprintf(state->chord, sizeof(state->chord), "%s#%u", MODIFIER_PREFIXES[state->modifiers], code);
+    }
+
+    return KP_KEY_STATE_CHORD;
+}
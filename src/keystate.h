@@ -0,0 +1,99 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file keystate.h
+ * @brief Press/release tracking of every keycode, with modifier chords
+ */
+
+#ifndef KEYPRESENTER_KEYSTATE_H
+#define KEYPRESENTER_KEYSTATE_H
+
+#include <glib.h>
+
+#include <keypresenter/poll.h>
+
+/**
+ * Amount of keycodes which are tracked, keycodes are 8 bits wide.
+ */
+#define KP_KEY_STATE_SIZE 256
+
+/**
+ * Longest chord label, including the terminator
+ */
+#define KP_KEY_STATE_CHORD_SIZE 64
+
+typedef enum _KeyStateChange KpKeyStateChange;
+typedef struct _KeyState KpKeyState;
+
+enum _KeyStateChange {
+    /**
+     * Nothing changed: a press of a key which is already down (autorepeat), or a release of a key which is up
+     */
+    KP_KEY_STATE_UNCHANGED = 0,
+
+    KP_KEY_STATE_PRESSED = 1,
+    KP_KEY_STATE_RELEASED = 2,
+
+    /**
+     * A key has been pressed while modifiers are held, the chord holds its label
+     */
+    KP_KEY_STATE_CHORD = 3,
+};
+
+struct _KeyState {
+    /**
+     * Bit per keycode, set while the key is down
+     */
+    guint64 pressed[KP_KEY_STATE_SIZE / 64];
+
+    /**
+     * Amount of held keys per modifier, left and right keys are the same modifier
+     */
+    guint8 modifier_keys[KP_KEY_MODIFIER_COUNT];
+
+    /**
+     * KpKeyModifier mask of the held modifiers
+     */
+    guint modifiers;
+
+    /**
+     * Label of the last chord, e.g. "Ctrl+Shift+T"
+     */
+    gchar chord[KP_KEY_STATE_CHORD_SIZE];
+};
+
+KpKeyState *
+kp_key_state_new(void);
+
+void
+kp_key_state_free(KpKeyState *state);
+
+static inline gboolean
+kp_key_state_is_pressed(const KpKeyState *state, guint16 code) {
+    return code < KP_KEY_STATE_SIZE && (state->pressed[code / 64] >> (code % 64)) & 1;
+}
+
+/**
+ * Apply a key event in constant time.
+ *
+ * @param label Label of the key used in the chord, poll->key.label is not used since a replay does not have one
+ */
+KpKeyStateChange
+kp_key_state_update(KpKeyState *state, const KpKeyboardPoll *poll, const gchar *label);
+
+#endif //KEYPRESENTER_KEYSTATE_H
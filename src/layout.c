@@ -0,0 +1,447 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file layout.c
+ * @brief Parser and cache for keyboard layout files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "layout.h"
+
+/**
+ * Name of the directory in the user config directory which holds the layouts and the cache
+ */
+#define LAYOUT_CONFIG_DIR "keypresenter"
+#define LAYOUT_CACHE_NAME "layouts.cache"
+
+/**
+ * FNV-1a prime, used to mix the file metadata into the cache stamp
+ */
+#define STAMP_PRIME 1099511628211u
+
+/**
+ * Layout used when no layout file matches: the ANSI keyboard which the US layout is usually typed on,
+ * with the mouse buttons on the right and the wheel ticks below them
+ */
+static const gchar *const DEFAULT_LAYOUT =
+        "name ansi\n"
+        "match us\n"
+        "row 0 1 10 11 12 13 14 15 16 17 18 19\n"
+        "row 1 1.5 24 25 26 27 28 29 30 31 32 33\n"
+        "row 2 1.75 38 39 40 41 42 43 44 45 46\n"
+        "row 3 2.25 52 53 54 55 56 57 58\n"
+        "row 4 3.75 65:6.25\n"
+        "row 0 12 1 2 3\n"
+        "row 1 13 4\n"
+        "row 2 12 6 5 7\n";
+
+static guint64
+stamp_mix(guint64 stamp, guint64 value) {
+    return (stamp ^ value) * STAMP_PRIME;
+}
+
+static gint
+compare_paths(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+/**
+ * Add the layout files of a directory to paths in a stable order, and mix their metadata into the stamp.
+ */
+static void
+list_layout_files(GPtrArray *paths, const gchar *dir_path, guint64 *stamp) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const gchar *name;
+    guint first = paths->len;
+
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (g_str_has_suffix(name, KP_LAYOUT_FILE_SUFFIX)) {
+            g_ptr_array_add(paths, g_build_filename(dir_path, name, NULL));
+        }
+    }
+
+    g_dir_close(dir);
+
+    // Only sort the files of this directory, layouts of earlier directories take precedence
+    qsort(paths->pdata + first, paths->len - first, sizeof(gpointer), compare_paths);
+
+    for (guint i = first; i < paths->len; ++i) {
+        const gchar *path = g_ptr_array_index(paths, i);
+        struct stat st;
+
+        if (stat(path, &st) != 0) continue;
+
+        *stamp = stamp_mix(*stamp, g_str_hash(path));
+        *stamp = stamp_mix(*stamp, (guint64) st.st_size);
+        *stamp = stamp_mix(*stamp, (guint64) st.st_mtim.tv_sec);
+        *stamp = stamp_mix(*stamp, (guint64) st.st_mtim.tv_nsec);
+    }
+}
+
+/**
+ * Parse a position or width in keys into grid units.
+ */
+static gboolean
+parse_units(const gchar *token, guint *units) {
+    gchar *end;
+    gdouble value = g_ascii_strtod(token, &end) * KP_KEY_MODEL_UNIT;
+
+    if (end == token || *end != '\0' || value < 0 || value > G_MAXUINT8 || value != (guint) value) {
+        return FALSE;
+    }
+
+    *units = (guint) value;
+
+    return TRUE;
+}
+
+/**
+ * Parse a key of a row statement and append it to the keys, gaps only move the column.
+ */
+static gboolean
+parse_key(gchar *token, guint row, guint *column, GArray *keys, const gchar **message) {
+    gchar *width = strchr(token, ':');
+    guint span = KP_KEY_MODEL_UNIT;
+
+    if (width != NULL) {
+        *width++ = '\0';
+
+        if (!parse_units(width, &span) || span == 0) {
+            *message = "invalid key width";
+            return FALSE;
+        }
+    }
+
+    if (*column + span > G_MAXUINT8) {
+        *message = "row is too wide";
+        return FALSE;
+    }
+
+    if (strcmp(token, "-") != 0) {
+        gchar *end;
+        gulong code = strtoul(token, &end, 10);
+
+        if (end == token || *end != '\0' || code == 0 || code > G_MAXUINT8) {
+            *message = "keycodes must be in the range of 1-255";
+            return FALSE;
+        }
+
+        KpLayoutKey key = {(guint8) code, (guint8) *column, (guint8) row, (guint8) span};
+        g_array_append_val(keys, key);
+    }
+
+    *column += span;
+
+    return TRUE;
+}
+
+/**
+ * Parse one statement, tokens are split off the line with strtok_r.
+ */
+static gboolean
+parse_statement(gchar *keyword, gchar **save, GArray *layouts, GArray *keys, const gchar **message) {
+    KpLayout *layout = layouts->len > 0 ? &g_array_index(layouts, KpLayout, layouts->len - 1) : NULL;
+    gchar *token;
+
+    if (strcmp(keyword, "name") == 0) {
+        KpLayout new_layout = {{0}, {0}, (guint16) keys->len, 0};
+
+        if ((token = strtok_r(NULL, " \t\r", save)) == NULL || strlen(token) >= KP_LAYOUT_NAME_SIZE) {
+            *message = "name must be 1-15 characters";
+            return FALSE;
+        }
+
+        strcpy(new_layout.name, token);
+        g_array_append_val(layouts, new_layout);
+
+        return TRUE;
+    }
+
+    if (layout == NULL) {
+        *message = "statement before the first name";
+        return FALSE;
+    }
+
+    if (strcmp(keyword, "match") == 0) {
+        while ((token = strtok_r(NULL, " \t\r", save)) != NULL) {
+            gsize length = strlen(layout->match);
+
+            // The list starts with a space, each entry adds its name and a trailing space
+            if (length + (length == 0) + strlen(token) + 1 >= KP_LAYOUT_MATCH_SIZE) {
+                *message = "too many XKB layouts to match";
+                return FALSE;
+            }
+
+            g_snprintf(layout->match + length, KP_LAYOUT_MATCH_SIZE - length, "%s%s ", length == 0 ? " " : "", token);
+        }
+
+        return TRUE;
+    }
+
+    if (strcmp(keyword, "row") == 0) {
+        gchar *row_token = strtok_r(NULL, " \t\r", save);
+        gchar *column_token = strtok_r(NULL, " \t\r", save);
+        guint row, column;
+
+        if (row_token == NULL || column_token == NULL || !parse_units(row_token, &row) || !parse_units(column_token, &column)
+            || row > G_MAXUINT8 - KP_KEY_MODEL_UNIT) {
+            *message = "row needs a valid y and x position";
+            return FALSE;
+        }
+
+        while ((token = strtok_r(NULL, " \t\r", save)) != NULL) {
+            if (!parse_key(token, row, &column, keys, message)) {
+                return FALSE;
+            }
+        }
+
+        if (keys->len > G_MAXUINT16) {
+            *message = "too many keys";
+            return FALSE;
+        }
+
+        layout->key_count = keys->len - layout->first_key;
+
+        return TRUE;
+    }
+
+    *message = "unknown statement";
+    return FALSE;
+}
+
+/**
+ * Append the layouts of a file. A file with an error is skipped as a whole.
+ */
+static void
+parse_layouts(const gchar *path, gchar *contents, GArray *layouts, GArray *keys) {
+    guint layout_count = layouts->len, key_count = keys->len, line_number = 0;
+    gchar *line_save = NULL, *line;
+
+    for (line = strtok_r(contents, "\n", &line_save); line != NULL; line = strtok_r(NULL, "\n", &line_save)) {
+        gchar *comment = strchr(line, '#'), *save = NULL, *keyword;
+        const gchar *message = NULL;
+
+        line_number++;
+
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        if ((keyword = strtok_r(line, " \t\r", &save)) == NULL) continue;
+
+        if (!parse_statement(keyword, &save, layouts, keys, &message) || layouts->len > G_MAXUINT16) {
+            fprintf(stderr, "%s:%u: %s, skipping the file\n", path, line_number, message != NULL ? message : "too many layouts");
+            g_array_set_size(layouts, layout_count);
+            g_array_set_size(keys, key_count);
+            return;
+        }
+    }
+}
+
+/**
+ * Point the set into its blob, if the blob is a cache built from the current layout files.
+ */
+static gboolean
+map_blob(KpLayoutSet *set, guint64 stamp) {
+    const KpLayoutCacheHeader *header = (const KpLayoutCacheHeader *) set->blob;
+
+    if (set->size < sizeof(KpLayoutCacheHeader) || memcmp(header->magic, KP_LAYOUT_CACHE_MAGIC, 4) != 0
+        || header->version != KP_LAYOUT_CACHE_VERSION || header->stamp != stamp || header->layout_count == 0) {
+        return FALSE;
+    }
+
+    gsize keys_offset = sizeof(KpLayoutCacheHeader) + header->layout_count * sizeof(KpLayout);
+
+    if (set->size < keys_offset || (set->size - keys_offset) % sizeof(KpLayoutKey) != 0) {
+        return FALSE;
+    }
+
+    set->layouts = (const KpLayout *) (set->blob + sizeof(KpLayoutCacheHeader));
+    set->layout_count = header->layout_count;
+    set->keys = (const KpLayoutKey *) (set->blob + keys_offset);
+    set->key_count = (set->size - keys_offset) / sizeof(KpLayoutKey);
+
+    for (guint i = 0; i < set->layout_count; ++i) {
+        if (set->layouts[i].first_key + set->layouts[i].key_count > set->key_count) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Parse the layout files and the built-in layout into a new blob.
+ */
+static void
+build_blob(KpLayoutSet *set, GPtrArray *paths, guint64 stamp) {
+    GArray *layouts = g_array_new(FALSE, TRUE, sizeof(KpLayout));
+    GArray *keys = g_array_new(FALSE, TRUE, sizeof(KpLayoutKey));
+    KpLayoutCacheHeader header = {KP_LAYOUT_CACHE_MAGIC, KP_LAYOUT_CACHE_VERSION, 0, stamp};
+    gchar *contents;
+
+    for (guint i = 0; i < paths->len; ++i) {
+        const gchar *path = g_ptr_array_index(paths, i);
+
+        if (g_file_get_contents(path, &contents, NULL, NULL)) {
+            parse_layouts(path, contents, layouts, keys);
+            g_free(contents);
+        }
+    }
+
+    // The built-in layout comes last, so it is the fallback and every file can replace it
+    contents = g_strdup(DEFAULT_LAYOUT);
+    parse_layouts("built-in layout", contents, layouts, keys);
+    g_free(contents);
+
+    header.layout_count = layouts->len;
+    set->size = sizeof(header) + layouts->len * sizeof(KpLayout) + keys->len * sizeof(KpLayoutKey);
+    set->blob = g_malloc(set->size);
+
+    memcpy(set->blob, &header, sizeof(header));
+    memcpy(set->blob + sizeof(header), layouts->data, layouts->len * sizeof(KpLayout));
+    memcpy(set->blob + sizeof(header) + layouts->len * sizeof(KpLayout), keys->data, keys->len * sizeof(KpLayoutKey));
+
+    g_array_free(layouts, TRUE);
+    g_array_free(keys, TRUE);
+}
+
+KpLayoutSet *
+kp_layout_set_load(void) {
+    KpLayoutSet *set = g_new0(KpLayoutSet, 1);
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    gchar *config_dir = g_build_filename(g_get_user_config_dir(), LAYOUT_CONFIG_DIR, NULL);
+    gchar *user_dir = g_build_filename(config_dir, "layouts", NULL);
+    gchar *cache_path = g_build_filename(config_dir, LAYOUT_CACHE_NAME, NULL);
+    guint64 stamp = stamp_mix(g_str_hash(DEFAULT_LAYOUT), KP_LAYOUT_CACHE_VERSION);
+
+    list_layout_files(paths, user_dir, &stamp);
+    list_layout_files(paths, KEYPRESENTER_LAYOUT_DIR, &stamp);
+
+    if (!g_file_get_contents(cache_path, &set->blob, &set->size, NULL) || !map_blob(set, stamp)) {
+        g_free(set->blob);
+        build_blob(set, paths, stamp);
+        map_blob(set, stamp);
+
+        // Without a writable config directory the layouts are simply parsed again next time
+        if (g_mkdir_with_parents(config_dir, 0700) != 0
+            || !g_file_set_contents(cache_path, set->blob, set->size, NULL)) {
+            fprintf(stderr, "Could not write the layout cache %s\n", cache_path);
+        }
+    }
+
+    g_ptr_array_unref(paths);
+    g_free(cache_path);
+    g_free(user_dir);
+    g_free(config_dir);
+
+    return set;
+}
+
+const KpLayout *
+kp_layout_set_find(const KpLayoutSet *set, const gchar *name, const gchar *xkb_layout) {
+    gchar needle[KP_LAYOUT_MATCH_SIZE];
+
+    if (name == NULL && xkb_layout == NULL) {
+        return NULL;
+    }
+
+    if (name == NULL) {
+        g_snprintf(needle, sizeof(needle), " %s ", xkb_layout);
+    }
+
+    for (guint i = 0; i < set->layout_count; ++i) {
+        const KpLayout *layout = &set->layouts[i];
+
+        if (name != NULL ? strcmp(layout->name, name) == 0 : strstr(layout->match, needle) != NULL) {
+            return layout;
+        }
+    }
+
+    return NULL;
+}
+
+void
+kp_layout_set_apply(const KpLayoutSet *set, const KpLayout *layout, KpKeyModel *model) {
+    guint min_column = G_MAXUINT8, min_row = G_MAXUINT8, bottom = 0;
+
+    if (layout == NULL) {
+        layout = &set->layouts[set->layout_count - 1];
+    }
+
+    const KpLayoutKey *keys = set->keys + layout->first_key;
+
+    // Keys are placed from scratch, so keys which were added to the model later move every key into place
+    for (guint i = 0; i < model->count; ++i) {
+        kp_key_model_place(model, model->codes[i], 0, 0, 0);
+    }
+
+    // Only the keys of the model are drawn, so rows and columns in front of them are left out
+    for (guint i = 0; i < layout->key_count; ++i) {
+        if (!kp_key_model_contains(model, keys[i].code)) continue;
+
+        min_column = MIN(min_column, keys[i].column);
+        min_row = MIN(min_row, keys[i].row);
+    }
+
+    for (guint i = 0; i < layout->key_count; ++i) {
+        if (!kp_key_model_contains(model, keys[i].code)) continue;
+
+        kp_key_model_place(model, keys[i].code, keys[i].column - min_column, keys[i].row - min_row, keys[i].span);
+        bottom = MAX(bottom, keys[i].row - min_row + KP_KEY_MODEL_UNIT);
+    }
+
+    // Keys the layout does not know get a row for each run of consecutive keycodes, e.g. 10-19 for the digits
+    guint column = 0, row = bottom;
+    guint16 previous = 0;
+
+    for (guint i = 0; i < model->count; ++i) {
+        guint16 code = model->codes[i];
+
+        if (model->spans[code] != 0) continue;
+
+        if (column > 0 && (code != previous + 1 || column + KP_KEY_MODEL_UNIT > G_MAXUINT8)) {
+            column = 0;
+            row += KP_KEY_MODEL_UNIT;
+        }
+
+        if (row + KP_KEY_MODEL_UNIT > G_MAXUINT8) break;
+
+        kp_key_model_place(model, code, column, row, KP_KEY_MODEL_UNIT);
+        column += KP_KEY_MODEL_UNIT;
+        previous = code;
+    }
+}
+
+void
+kp_layout_set_free(KpLayoutSet *set) {
+    if (set == NULL) {
+        return;
+    }
+
+    g_free(set->blob);
+    g_free(set);
+}
@@ -0,0 +1,156 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file layout.h
+ * @brief Keyboard layout geometry, read from layout files and cached in a binary blob
+ *
+ * A layout file describes where the keys are, so physical layouts like ISO, ANSI or a split keyboard are drawn the way
+ * they look. The files are only parsed when one of them has changed, otherwise the cache is used as it is.
+ *
+ * File format, one statement per line, '#' starts a comment:
+ *
+ *     name <name>                  Start a new layout, names are at most 15 characters
+ *     match <xkb layout>...        XKB layouts, as in setxkbmap -query, for which the layout is used
+ *     row <y> <x> <key>...         Keys of a row, from left to right, starting at column x
+ *
+ * A key is an X11 keycode, or a mouse button 1-7 (see KP_KEY_BUTTON_COUNT), optionally followed by :<width>.
+ * A key of '-' is a gap.
+ * Positions and widths are in keys and must be multiples of 1/KP_KEY_MODEL_UNIT, e.g. "row 1 1.5 24 25 65:6.25".
+ */
+
+#ifndef KEYPRESENTER_LAYOUT_H
+#define KEYPRESENTER_LAYOUT_H
+
+#include <glib.h>
+
+#include <keypresenter/keymodel.h>
+
+#define KP_LAYOUT_CACHE_MAGIC "KPLY"
+#define KP_LAYOUT_CACHE_VERSION 1
+
+/**
+ * File name extension of layout files
+ */
+#define KP_LAYOUT_FILE_SUFFIX ".layout"
+
+/**
+ * Directory of the layouts shipped with Key Presenter, layouts in the user config directory take precedence
+ */
+#ifndef KEYPRESENTER_LAYOUT_DIR
+#define KEYPRESENTER_LAYOUT_DIR "/usr/local/share/keypresenter/layouts"
+#endif
+
+#define KP_LAYOUT_NAME_SIZE 16
+#define KP_LAYOUT_MATCH_SIZE 108
+
+typedef struct _LayoutCacheHeader KpLayoutCacheHeader;
+typedef struct _Layout KpLayout;
+typedef struct _LayoutKey KpLayoutKey;
+typedef struct _LayoutSet KpLayoutSet;
+
+/**
+ * Start of the cache file. All fields are stored in host byte order, the cache is never shared between machines.
+ */
+struct _LayoutCacheHeader {
+    gchar magic[4];
+    guint16 version;
+    guint16 layout_count;
+
+    /**
+     * Hash over the names, sizes and modification times of the layout files the cache was built from
+     */
+    guint64 stamp;
+};
+
+/**
+ * A layout in the cache, followed by the layout table are the keys of all layouts
+ */
+struct _Layout {
+    gchar name[KP_LAYOUT_NAME_SIZE];
+
+    /**
+     * XKB layouts the layout is used for, each surrounded by spaces, e.g. " gb ie "
+     */
+    gchar match[KP_LAYOUT_MATCH_SIZE];
+
+    /**
+     * Index of the first key of the layout in the key table
+     */
+    guint16 first_key;
+    guint16 key_count;
+};
+
+/**
+ * A placed key, positions are in KP_KEY_MODEL_UNIT per key
+ */
+struct _LayoutKey {
+    guint8 code;
+    guint8 column;
+    guint8 row;
+    guint8 span;
+};
+
+G_STATIC_ASSERT(sizeof(KpLayoutCacheHeader) == 16);
+G_STATIC_ASSERT(sizeof(KpLayout) == 128);
+G_STATIC_ASSERT(sizeof(KpLayoutKey) == 4);
+
+struct _LayoutSet {
+    /**
+     * The cache contents, the other fields point into it
+     */
+    gchar *blob;
+    gsize size;
+
+    const KpLayout *layouts;
+    guint layout_count;
+
+    const KpLayoutKey *keys;
+    guint key_count;
+};
+
+/**
+ * Load the layouts from the cache, or parse the layout files and rebuild the cache if it is outdated.
+ * The built-in layout is always part of the set, so it is never empty.
+ *
+ * @return Ptr to the layouts, to be freed with kp_layout_set_free
+ */
+KpLayoutSet *
+kp_layout_set_load(void);
+
+/**
+ * Find the layout to use.
+ *
+ * @param name (Optional) Name of a layout, takes precedence over xkb_layout
+ * @param xkb_layout (Optional) Active XKB layout
+ * @return The matching layout, or NULL if none matches
+ */
+const KpLayout *
+kp_layout_set_find(const KpLayoutSet *set, const gchar *name, const gchar *xkb_layout);
+
+/**
+ * Place the keys of the model. Without a layout the built-in layout is used.
+ * Keys which the layout does not know are placed below it, a row for each run of consecutive keycodes.
+ * Every key is placed anew, so it may be called again after keys have been added to the model.
+ */
+void
+kp_layout_set_apply(const KpLayoutSet *set, const KpLayout *layout, KpKeyModel *model);
+
+void
+kp_layout_set_free(KpLayoutSet *set);
+
+#endif //KEYPRESENTER_LAYOUT_H
@@ -29,4 +29,14 @@
 #    define UNUSED(x) UNUSED_ ## x
 #endif
 
+#ifndef KEYPRESENTER_CACHELINE_SIZE
+#    define KEYPRESENTER_CACHELINE_SIZE 64
+#endif
+
+#ifdef __GNUC__
+#    define CACHELINE_ALIGNED __attribute__((__aligned__(KEYPRESENTER_CACHELINE_SIZE)))
+#else
+#    define CACHELINE_ALIGNED
+#endif
+
 #endif //KEYPRESENTER_MACRO_H
@@ -24,11 +24,20 @@
 #include <gtk/gtk.h>
 #include <gdk/gdk.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <keypresenter/keypresenter.h>
 #include "appstate.h"
+#include "broadcast.h"
+#include "glyphatlas.h"
+#include "headless.h"
+#include "keyboardview.h"
+#include "layout.h"
 #include "macro.h"
+#include "overlay.h"
 #include "polltaskresult.h"
+#include "streamwriter.h"
+#include "tickerview.h"
 
 #ifdef KEYPRESENTER_BUILD_USE_X11
 #include "x11.h"
@@ -36,10 +45,67 @@
 
 #define WINDOW_LEAVE_EVENT_BOUNDS_MARGIN 5
 
+/**
+ * Time in milliseconds between two stats reports
+ */
+#ifndef DEFAULT_STATS_INTERVAL
+#define DEFAULT_STATS_INTERVAL 1000
+#endif
+
+/**
+ * Height of the strip at the top of the window which holds the stats overlay
+ */
+#define STATS_OVERLAY_HEIGHT 14
+
+static gboolean option_stats = FALSE;
+static gboolean option_stats_overlay = FALSE;
+static gint option_stats_interval = DEFAULT_STATS_INTERVAL;
+static gchar *option_record = NULL;
+static gchar *option_replay = NULL;
+static gboolean option_replay_fast = FALSE;
+static gchar *option_layout = NULL;
+static gboolean option_no_ticker = FALSE;
+static gboolean option_buttons = FALSE;
+static gchar *option_stream = NULL;
+static gint option_broadcast = 0;
+static gchar *option_render_to = NULL;
+static gint option_render_fps = DEFAULT_HEADLESS_FPS;
+
+static GOptionEntry OPTION_ENTRIES[] = {
+        {"stats", 0, 0, G_OPTION_ARG_NONE, &option_stats, "Print latency and throughput stats to stderr", NULL},
+        {"stats-overlay", 0, 0, G_OPTION_ARG_NONE, &option_stats_overlay, "Draw the stats over the window", NULL},
+        {"stats-interval", 0, 0, G_OPTION_ARG_INT, &option_stats_interval, "Milliseconds between stats reports", "MS"},
+        {"record", 0, 0, G_OPTION_ARG_FILENAME, &option_record, "Record every key event to a file", "FILE"},
+        {"replay", 0, 0, G_OPTION_ARG_FILENAME, &option_replay, "Show a recording instead of the keyboard", "FILE"},
+        {"replay-fast", 0, 0, G_OPTION_ARG_NONE, &option_replay_fast, "Replay as fast as possible", NULL},
+        {"layout", 0, 0, G_OPTION_ARG_STRING, &option_layout, "Keyboard layout to draw instead of the one matching XKB", "NAME"},
+        {"no-ticker", 0, 0, G_OPTION_ARG_NONE, &option_no_ticker, "Do not show the last keystrokes below the keyboard", NULL},
+        {"buttons", 0, 0, G_OPTION_ARG_NONE, &option_buttons, "Show mouse buttons and the scroll wheel", NULL},
+        {"stream", 0, 0, G_OPTION_ARG_STRING, &option_stream, "Publish every key event to shared memory object /NAME", "NAME"},
+        {"broadcast", 0, 0, G_OPTION_ARG_INT, &option_broadcast, "Send key events to WebSocket clients on 127.0.0.1:PORT", "PORT"},
+        {"render-to", 0, 0, G_OPTION_ARG_FILENAME, &option_render_to, "Render frames without a window, to a PNG sequence in DIR or raw RGBA to FILE or - for stdout", "DIR|FILE|-"},
+        {"render-fps", 0, 0, G_OPTION_ARG_INT, &option_render_fps, "Frames per second rendered by --render-to", "FPS"},
+        {NULL}
+};
+
+static gint get_display_number(const gchar *display_name);
+static KpOverlay *overlay_new(GdkDisplay *display, gboolean owns_display, GCancellable *cancellable);
+static void overlay_add_views(KpOverlay *overlay, KpKeyModel *key_model, KpTicker *ticker);
+static void add_other_overlays(GPtrArray *overlays, gpointer keyboard_data, GCancellable *cancellable);
+static void overlay_free(gpointer overlay);
+static void run_windowed(KpPollTaskResult *task_result, GCancellable *cancellable);
 static void on_screen_changed(GtkWidget *window, GdkScreen *old_screen, gpointer app_state);
-static gboolean on_draw(GtkWidget *window, GdkEventExpose *event, gpointer app_state);
+static gboolean on_draw(GtkWidget *window, cairo_t *cr, gpointer app_state);
+static gboolean on_draw_stats(GtkWidget *window, cairo_t *cr, gpointer stats);
+static gboolean on_stats_timeout(gpointer poll_task_result);
 static gboolean on_enter(GtkWidget *window, GdkEventCrossing *event, gpointer app_state_p);
 static gboolean on_leave(GtkWidget *window, GdkEventCrossing *event, gpointer app_state_p);
+static void add_key(KpPollTaskResult *result, const KpKeyboardPoll *poll);
+static void add_late_overlay(KpPollTaskResult *result, guint display_index);
+static void on_poll_task_result(KpKeyboardPoll *poll, gpointer poll_task_result);
+static void on_key_animation_frame(guint16 keycode, gdouble intensity, gpointer poll_task_result);
+static gboolean on_delete(GtkWidget *window, GdkEvent *event, gpointer cancellable);
+static void on_poll_task_done(GObject *source_obj, GAsyncResult *res, gpointer user_data);
 
 static const gchar *NOTICE = "\nKeypresenter  Copyright (C) 2020  https://www.hypothermic.nl\n"
                              "This program comes with ABSOLUTELY NO WARRANTY.\n"
@@ -48,144 +114,640 @@ static const gchar *NOTICE = "\nKeypresenter  Copyright (C) 2020  https://www.hy
 
 gint
 main(gint argc, gchar **argv) {
-    GtkWidget *window, *grid;
+    KpOverlay *overlay = NULL;
+    GPtrArray *overlays = NULL;
+    KpHeadless *headless = NULL;
     gpointer keyboard_data;
-    GArray *keyboard_keys;
-    GHashTable *key_button_table;
-    AppState app_state = {FALSE, TRUE};
+    KpKeyModel *key_model;
+    KpTicker *ticker = NULL;
+    GCancellable *cancellable;
+    GError *error = NULL;
+    gint status = EXIT_SUCCESS;
+
+#if defined(KEYPRESENTER_BUILD_USE_X11) && !defined(KEYPRESENTER_BUILD_USE_XCB)
+    // Displays are probed from worker threads, Xlib must know before anything else connects.
+    XInitThreads();
+#endif
+
+    // GTK is not initialised while parsing, so rendering without a window does not need a display.
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, OPTION_ENTRIES, NULL);
+    g_option_context_add_group(context, gtk_get_option_group(FALSE));
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return EXIT_FAILURE;
+    }
+
+    g_option_context_free(context);
+
+    // Opened before anything is printed, raw frames on stdout must not be preceded by the notice
+    if (option_render_to != NULL && (headless = kp_headless_new(option_render_to, option_render_fps, &error)) == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
 
     fprintf(stdout, "%s\n", NOTICE);
-    gtk_init(&argc, &argv);
 
-    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    if (headless == NULL && !gtk_init_check(&argc, &argv)) {
+        fprintf(stderr, "Could not open a display, use --render-to to render without one\n");
+        return EXIT_FAILURE;
+    }
+
+    cancellable = g_cancellable_new();
+
+    // The overlay on the default display is the primary one, its frame clock drives the animations
+    if (headless == NULL) {
+        overlays = g_ptr_array_new_with_free_func(overlay_free);
+        overlay = overlay_new(gdk_display_get_default(), FALSE, cancellable);
+        g_ptr_array_add(overlays, overlay);
+    }
+
+    KpReplay *replay = NULL;
+    if (option_replay != NULL && (replay = kp_replay_new(option_replay, option_replay_fast, &error)) == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+    }
+
+    keyboard_data = kp_keyboard_init(overlay != NULL ? GTK_WINDOW(overlay->window) : NULL,
+                                     option_buttons ? KP_KEYBOARD_FEATURE_BUTTONS : KP_KEYBOARD_FEATURE_NONE);
+
+    // A replay shows the keys it was recorded with, the keyboard here may differ or there may be no X server at all
+    if (replay == NULL || (key_model = kp_replay_get_keys(replay)) == NULL) {
+        key_model = kp_keyboard_get_keys(overlay != NULL ? GTK_WINDOW(overlay->window) : NULL, keyboard_data);
+    }
+
+    if (headless == NULL) {
+        ticker = option_no_ticker ? NULL : kp_ticker_new();
+        add_other_overlays(overlays, keyboard_data, cancellable);
+
+        for (guint i = 0; i < overlays->len; ++i) {
+            overlay_add_views(g_ptr_array_index(overlays, i), key_model, ticker);
+        }
+    }
+
+    KpLayoutSet *layouts = kp_layout_set_load();
+    gchar *xkb_layout = kp_keyboard_get_layout_name(keyboard_data);
+    const KpLayout *layout = kp_layout_set_find(layouts, option_layout, xkb_layout);
+
+    if (layout == NULL && option_layout != NULL) {
+        fprintf(stderr, "Unknown layout %s, using the default layout\n", option_layout);
+    }
+
+    kp_layout_set_apply(layouts, layout, key_model);
+    g_free(xkb_layout);
+
+    KpPollTaskResult *task_result = g_new0(KpPollTaskResult, 1);
+    task_result->keyboard_data = keyboard_data;
+    task_result->key_model = key_model;
+    task_result->layouts = layouts;
+    task_result->layout = layout;
+    task_result->overlays = overlays;
+    task_result->ticker = ticker;
+    task_result->key_state = kp_key_state_new();
+    task_result->event_ring = kp_event_ring_new();
+    task_result->stats = kp_stats_new();
+    task_result->cancellable = cancellable;
+    task_result->replay = replay;
+
+    if (option_record != NULL
+        && (task_result->recorder = kp_recorder_new(option_record, key_model, &error)) == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+    }
+
+    // Published from the poll thread, next to the event ring, so the main loop is not involved
+    KpStreamWriter *stream = NULL;
+    if (option_stream != NULL && (stream = kp_stream_writer_new(option_stream, &error)) == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+    }
+
+    // The broadcast server reads the same stream, without --stream the stream is only kept in this process
+    KpBroadcaster *broadcaster = NULL;
+    if (option_broadcast > G_MAXUINT16) {
+        fprintf(stderr, "Invalid broadcast port %d\n", option_broadcast);
+    } else if (option_broadcast > 0) {
+        if (stream == NULL) {
+            stream = kp_stream_writer_new(NULL, &error);
+        }
+        if (stream != NULL) {
+            broadcaster = kp_broadcaster_new(stream->stream, option_broadcast, &error);
+        }
+        if (broadcaster == NULL) {
+            fprintf(stderr, "%s\n", error->message);
+            g_clear_error(&error);
+        }
+    }
+
+    task_result->event_ring->stream = stream;
+
+    if (headless != NULL) {
+        if (!kp_headless_run(headless, task_result, DEFAULT_KEY_ANIMATION_TIMEOUT, cancellable)) {
+            status = EXIT_FAILURE;
+        }
+        kp_headless_free(headless);
+    } else {
+        run_windowed(task_result, cancellable);
+        g_ptr_array_unref(overlays);
+    }
+
+    // Writes the keys of the model, whose labels may belong to the keyboard data
+    kp_recorder_free(task_result->recorder);
+    kp_event_ring_free(task_result->event_ring);
+    kp_broadcaster_free(broadcaster);
+    kp_stream_writer_free(stream);
+    kp_keyboard_free(keyboard_data);
+    kp_key_model_free(key_model);
+    kp_layout_set_free(layouts);
+    kp_ticker_free(ticker);
+    kp_stats_free(task_result->stats);
+    kp_key_state_free(task_result->key_state);
+    kp_replay_free(task_result->replay);
+    g_object_unref(cancellable);
+    g_free(task_result);
+
+    return status;
+}
+
+/**
+ * Show the overlays and run the GTK main loop until the poll task has returned.
+ */
+static void
+run_windowed(KpPollTaskResult *task_result, GCancellable *cancellable) {
+    KpOverlay *overlay = g_ptr_array_index(task_result->overlays, 0);
+
+    task_result->animator = kp_animator_new(overlay->window, DEFAULT_KEY_ANIMATION_TIMEOUT, on_key_animation_frame,
+                                            task_result);
+
+    GSource *event_source = kp_event_ring_source_new(task_result->event_ring);
+    g_source_set_callback(event_source, (GSourceFunc) on_poll_task_result, task_result, NULL);
+    guint event_source_id = g_source_attach(event_source, NULL);
+    g_source_unref(event_source);
+
+    // The task data is owned by main, it is still used after the task has finished.
+    GTask *task = g_task_new(overlay->window, cancellable, on_poll_task_done, NULL);
+    g_task_set_task_data(task, task_result, NULL);
+    g_task_run_in_thread(task, task_result->replay != NULL ? kp_replay_task : kp_keyboard_poll_task);
+    g_object_unref(task);
+
+    for (guint i = 0; i < task_result->overlays->len; ++i) {
+        KpOverlay *shown = g_ptr_array_index(task_result->overlays, i);
+
+        // Trigger initial screen change
+        on_screen_changed(shown->window, NULL, &shown->app_state);
+
+        gtk_widget_show_all(shown->window);
+    }
+
+    guint stats_source_id = 0;
+    kp_stats_watch_frame_clock(task_result->stats, gtk_widget_get_frame_clock(overlay->window));
+    if (option_stats || option_stats_overlay) {
+        stats_source_id = g_timeout_add(MAX(option_stats_interval, 1), on_stats_timeout, task_result);
+    }
+    if (option_stats_overlay) {
+        g_signal_connect_after(G_OBJECT(overlay->window), "draw", G_CALLBACK(on_draw_stats), task_result->stats);
+    }
+
+    gtk_main();
+
+    if (stats_source_id != 0) {
+        g_source_remove(stats_source_id);
+    }
+    g_source_remove(event_source_id);
+    g_clear_pointer(&task_result->animator, kp_animator_free);
+}
+
+/**
+ * @return Number of an X display name like ":1" or "host:1.0", or -1 if the name has none (e.g. a Wayland display)
+ */
+static gint
+get_display_number(const gchar *display_name) {
+    const gchar *colon = display_name != NULL ? strrchr(display_name, ':') : NULL;
+
+    if (colon == NULL || !g_ascii_isdigit(colon[1])) {
+        return -1;
+    }
+
+    return (gint) g_ascii_strtoll(colon + 1, NULL, 10);
+}
+
+/**
+ * Create the window of an overlay on a display, it stays empty until overlay_add_views.
+ *
+ * @param owns_display TRUE if the display has been opened for this overlay, it is closed when the overlay is freed
+ */
+static KpOverlay *
+overlay_new(GdkDisplay *display, gboolean owns_display, GCancellable *cancellable) {
+    KpOverlay *overlay = g_new0(KpOverlay, 1);
+    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+
+    overlay->display = display;
+    overlay->owns_display = owns_display;
+    overlay->window = window;
+    overlay->app_state.is_transparent = TRUE;
+
+    gtk_window_set_screen(GTK_WINDOW(window), gdk_display_get_default_screen(display));
     gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
     gtk_window_set_default_size(GTK_WINDOW(window), -1, -1);
     gtk_window_set_title(GTK_WINDOW(window), KEYPRESENTER_APP_NAME);
     gtk_window_set_keep_above(GTK_WINDOW(window), TRUE);
-    g_signal_connect(G_OBJECT(window), "delete-event", gtk_main_quit, NULL);
+    g_signal_connect(G_OBJECT(window), "delete-event", G_CALLBACK(on_delete), cancellable);
 
     gtk_widget_set_app_paintable(window, TRUE);
 
-    g_signal_connect(G_OBJECT(window), "draw", G_CALLBACK(on_draw), &app_state);
-    g_signal_connect(G_OBJECT(window), "screen-changed", G_CALLBACK(on_screen_changed), NULL);
+    g_signal_connect(G_OBJECT(window), "draw", G_CALLBACK(on_draw), &overlay->app_state);
+    g_signal_connect(G_OBJECT(window), "screen-changed", G_CALLBACK(on_screen_changed), &overlay->app_state);
 
     gtk_window_set_decorated(GTK_WINDOW(window), FALSE);
     gtk_widget_add_events(window, GDK_BUTTON_PRESS_MASK);
 
-    g_signal_connect(G_OBJECT(window), "enter-notify-event", G_CALLBACK(on_enter), &app_state);
-    g_signal_connect(G_OBJECT(window), "leave-notify-event", G_CALLBACK(on_leave), &app_state);
+    g_signal_connect(G_OBJECT(window), "enter-notify-event", G_CALLBACK(on_enter), &overlay->app_state);
+    g_signal_connect(G_OBJECT(window), "leave-notify-event", G_CALLBACK(on_leave), &overlay->app_state);
 
-    grid = gtk_grid_new();
-    gtk_container_add(GTK_CONTAINER(window), grid);
+    return overlay;
+}
 
-    gtk_grid_set_row_spacing(GTK_GRID(grid), 3);
-    gtk_grid_set_column_spacing(GTK_GRID(grid), 3);
-    gtk_widget_set_margin_top(grid, 8);
-    gtk_widget_set_margin_start(grid, 8);
-    gtk_widget_set_margin_bottom(grid, 8);
-    gtk_widget_set_margin_end(grid, 8);
+/**
+ * Fill the window of an overlay with a view of the shared key model and ticker.
+ *
+ * @param ticker (Optional) NULL if the ticker is disabled
+ */
+static void
+overlay_add_views(KpOverlay *overlay, KpKeyModel *key_model, KpTicker *ticker) {
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_container_add(GTK_CONTAINER(overlay->window), box);
+
+    overlay->keyboard_view = kp_keyboard_view_new(key_model);
+    gtk_box_pack_start(GTK_BOX(box), overlay->keyboard_view, TRUE, TRUE, 0);
+
+    if (ticker != NULL) {
+        overlay->ticker_view = kp_ticker_view_new(ticker);
+        gtk_widget_set_margin_start(overlay->ticker_view, 8);
+        gtk_widget_set_margin_end(overlay->ticker_view, 8);
+        gtk_box_pack_start(GTK_BOX(box), overlay->ticker_view, FALSE, FALSE, 0);
+    }
 
-    keyboard_data = kp_keyboard_init(GTK_WINDOW(window));
-    keyboard_keys = kp_keyboard_get_keys(GTK_WINDOW(window), keyboard_data);
+    // Shows the last key combination, e.g. Ctrl+Shift+T
+    overlay->chord_label = gtk_label_new("");
+    gtk_widget_set_margin_bottom(overlay->chord_label, 8);
+    gtk_box_pack_start(GTK_BOX(box), overlay->chord_label, FALSE, FALSE, 0);
 
-    key_button_table = g_hash_table_new(g_int64_hash, g_int64_equal);
+    gtk_widget_set_margin_top(overlay->keyboard_view, 8);
+    gtk_widget_set_margin_start(overlay->keyboard_view, 8);
+    gtk_widget_set_margin_bottom(overlay->keyboard_view, 8);
+    gtk_widget_set_margin_end(overlay->keyboard_view, 8);
+}
 
-#ifdef AUTO_LOOKUP_AVAILABLE_KEYS
-    uint row_width = keyboard_keys->len / 15;
-#endif
-    uint current_x = 0, current_y = 0, n = 0;
+/**
+ * Every other display the keyboard is polled on gets an overlay as well, so the presses there can be seen there.
+ */
+static void
+add_other_overlays(GPtrArray *overlays, gpointer keyboard_data, GCancellable *cancellable) {
+    KpOverlay *primary = g_ptr_array_index(overlays, 0);
+    gint default_display_number = get_display_number(gdk_display_get_name(primary->display));
 
-    for (int i = 0; i < keyboard_keys->len; ++i) {
-        KpKey* key = g_array_index(keyboard_keys, KpKey*, i);
+    for (guint i = 0; i < kp_keyboard_get_display_count(keyboard_data); ++i) {
+        const gchar *display_name = kp_keyboard_get_display_name(keyboard_data, i);
 
-#ifdef NDEBUG
-        fprintf(stderr, "Found key %s with code %d\n", key->label, key->code);
-#endif
-        // TODO add these to a GHashTable to find them later.
-        GtkWidget *button = gtk_toggle_button_new_with_label(key->label);
-        gtk_button_set_relief(GTK_BUTTON(button), GTK_RELIEF_HALF);
-        gtk_widget_set_size_request(button, 85, 50);
-        if (g_strcmp0(key->label, "space") == 0) {
-            if (n++ > 0) {
-                gtk_grid_attach(GTK_GRID(grid), button, 0, current_y, 10, 1);
-            }
-        } else {
-            gtk_grid_attach(GTK_GRID(grid), button, current_x, current_y, 1, 1);
+        if (get_display_number(display_name) == default_display_number) {
+            continue;
         }
 
-        g_hash_table_insert(key_button_table, &key->code, button);
+        GdkDisplay *display = gdk_display_open(display_name);
 
-#ifdef AUTO_LOOKUP_AVAILABLE_KEYS
-        if (++current_x > row_width) {
-#else
-        current_x++;
-        if (g_strcmp0(key->label, "0") == 0
-            || g_strcmp0(key->label, "p") == 0
-            || g_strcmp0(key->label, "l") == 0
-            || g_strcmp0(key->label, "m") == 0) {
-#endif
-            current_y++;
-            current_x = 0;
+        if (display == NULL) {
+            fprintf(stderr, "Could not open an overlay on display %s\n", display_name);
+            continue;
         }
+
+        g_ptr_array_add(overlays, overlay_new(display, TRUE, cancellable));
     }
+}
 
-    KpPollTaskResult *task_result = g_new0(KpPollTaskResult, 1);
-    task_result->keyboard_data = keyboard_data;
-    task_result->key_button_table = key_button_table;
+static void
+overlay_free(gpointer overlay_p) {
+    KpOverlay *overlay = KP_OVERLAY(overlay_p);
 
-    GCancellable *cancellable = g_cancellable_new();
-    GTask *task = g_task_new(window, cancellable, NULL, task_result);
-    g_task_set_task_data(task, task_result, g_free);
-    g_task_run_in_thread(task, kp_keyboard_poll_task);
-    g_object_unref(task);
+    gtk_widget_destroy(overlay->window);
+    g_clear_pointer(&overlay->app_state.background, cairo_pattern_destroy);
 
-    // Trigger initial screen change
-    on_screen_changed(window, NULL, &app_state);
+    if (overlay->owns_display) {
+        gdk_display_close(overlay->display);
+    }
 
-    gtk_widget_show_all(window);
-    gtk_main();
+    g_free(overlay);
+}
+
+/**
+ * Change the background transparency, the window is only repainted if it actually changes.
+ */
+static void
+set_transparent(GtkWidget *window, AppState *app_state, gboolean is_transparent) {
+    if (app_state->is_transparent == is_transparent) {
+        return;
+    }
 
-    return EXIT_SUCCESS;
+    app_state->is_transparent = is_transparent;
+    g_clear_pointer(&app_state->background, cairo_pattern_destroy);
+    gtk_widget_queue_draw(window);
 }
 
 static void
-on_screen_changed(GtkWidget *window, GdkScreen *old_screen, gpointer app_state) {
+on_screen_changed(GtkWidget *window, GdkScreen *old_screen, gpointer app_state_p) {
+    AppState *app_state = APP_STATE(app_state_p);
     GdkScreen *screen = gtk_widget_get_screen(window);
     GdkVisual *visual = gdk_screen_get_rgba_visual(screen);
 
     if (!visual) {
         visual = gdk_screen_get_system_visual(screen);
-        APP_STATE(app_state)->screen_supports_alpha_channel = FALSE;
+        app_state->screen_supports_alpha_channel = FALSE;
     } else {
-        APP_STATE(app_state)->screen_supports_alpha_channel = TRUE;
+        app_state->screen_supports_alpha_channel = TRUE;
     }
 
-    gtk_widget_set_visual(window, visual);
+    if (visual != gtk_widget_get_visual(window)) {
+        gtk_widget_set_visual(window, visual);
+        g_clear_pointer(&app_state->background, cairo_pattern_destroy);
+        gtk_widget_queue_draw(window);
+    }
 }
 
 static gboolean
-on_draw(GtkWidget *window, GdkEventExpose *event, gpointer app_state_p) {
-    cairo_t *cr = gdk_cairo_create(gtk_widget_get_window(window));
+on_draw(GtkWidget *window, cairo_t *cr, gpointer app_state_p) {
     AppState *app_state = APP_STATE(app_state_p);
 
-    if (app_state->screen_supports_alpha_channel) {
-        cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, app_state->is_transparent ? 0.0 : 0.4);
-    } else {
-        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+    if (app_state->background == NULL) {
+        if (app_state->screen_supports_alpha_channel) {
+            app_state->background = cairo_pattern_create_rgba(1.0, 1.0, 1.0, app_state->is_transparent ? 0.0 : 0.4);
+        } else {
+            app_state->background = cairo_pattern_create_rgb(1.0, 1.0, 1.0);
+        }
     }
 
+    // GTK has clipped the context to the damaged region, so only that part of the window is repainted.
+    cairo_save(cr);
+    cairo_set_source(cr, app_state->background);
     cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
     cairo_paint(cr);
+    cairo_restore(cr);
+
+    return FALSE;
+}
 
-    cairo_destroy(cr);
+/**
+ * Draw the last stats report over the window, after the keyboard has been drawn.
+ */
+static gboolean
+on_draw_stats(GtkWidget *UNUSED(window), cairo_t *cr, gpointer stats) {
+    cairo_save(cr);
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.7);
+    cairo_set_font_size(cr, STATS_OVERLAY_HEIGHT - 4);
+    cairo_move_to(cr, 2, STATS_OVERLAY_HEIGHT - 3);
+    cairo_show_text(cr, ((KpStats *) stats)->ui.report->str);
+    cairo_restore(cr);
 
     return FALSE;
 }
 
+static gboolean
+on_stats_timeout(gpointer poll_task_result) {
+    KpPollTaskResult *result = poll_task_result;
+    KpStats *stats = result->stats;
+
+    g_string_truncate(stats->ui.report, 0);
+    kp_stats_format(stats, result->event_ring, stats->ui.report);
+
+    if (option_stats) {
+        fprintf(stderr, "%s\n", stats->ui.report->str);
+    }
+
+    if (option_stats_overlay) {
+        GtkWidget *window = KP_OVERLAY(g_ptr_array_index(result->overlays, 0))->window;
+        gtk_widget_queue_draw_area(window, 0, 0, gtk_widget_get_allocated_width(window), STATS_OVERLAY_HEIGHT);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @return View of the primary overlay, the only one which writes to the shared key model
+ */
+static inline KpKeyboardView *
+get_primary_keyboard_view(KpPollTaskResult *result) {
+    return KP_KEYBOARD_VIEW(KP_OVERLAY(g_ptr_array_index(result->overlays, 0))->keyboard_view);
+}
+
+/**
+ * Redraw a key on every overlay but the primary one, after the primary view has changed it in the shared key model.
+ * Each redraw waits for the frame clock of its own window.
+ */
+static void
+queue_draw_key_on_other_overlays(KpPollTaskResult *result, guint16 code, gboolean invalidate) {
+    for (guint i = 1; i < result->overlays->len; ++i) {
+        KpOverlay *overlay = g_ptr_array_index(result->overlays, i);
+
+        kp_keyboard_view_queue_draw_key(KP_KEYBOARD_VIEW(overlay->keyboard_view), code, invalidate);
+    }
+}
+
+static void
+set_chord_text(KpPollTaskResult *result, const gchar *text) {
+    for (guint i = 0; i < result->overlays->len; ++i) {
+        gtk_label_set_text(GTK_LABEL(KP_OVERLAY(g_ptr_array_index(result->overlays, i))->chord_label), text);
+    }
+}
+
+/**
+ * Push a keystroke to the shared ticker and let every ticker view show it.
+ *
+ * @param merge TRUE if a keystroke which equals the last one is counted as its repeat
+ */
+static void
+push_to_ticker(KpPollTaskResult *result, const gchar *label, gboolean merge) {
+    if (result->ticker == NULL || label == NULL) {
+        return;
+    }
+
+    gboolean pushed = kp_ticker_push_merged(
+            result->ticker, strcmp(label, "space") == 0 ? (gchar[]) {KP_GLYPH_VISIBLE_SPACE, '\0'} : label, merge);
+
+    for (guint i = 0; i < result->overlays->len; ++i) {
+        KpTickerView *view = KP_TICKER_VIEW(KP_OVERLAY(g_ptr_array_index(result->overlays, i))->ticker_view);
+
+        if (pushed) {
+            kp_ticker_view_entry_pushed(view);
+        } else {
+            kp_ticker_view_entry_changed(view);
+        }
+    }
+}
+
+static void
+repeat_in_ticker(KpPollTaskResult *result) {
+    if (result->ticker == NULL || !kp_ticker_repeat(result->ticker)) {
+        return;
+    }
+
+    for (guint i = 0; i < result->overlays->len; ++i) {
+        kp_ticker_view_entry_changed(KP_TICKER_VIEW(KP_OVERLAY(g_ptr_array_index(result->overlays, i))->ticker_view));
+    }
+}
+
+static void
+on_key_animation_frame(guint16 keycode, gdouble intensity, gpointer poll_task_result) {
+    KpPollTaskResult *result = poll_task_result;
+
+    if (kp_keyboard_view_set_key_intensity(get_primary_keyboard_view(result), keycode, intensity)) {
+        queue_draw_key_on_other_overlays(result, keycode, FALSE);
+    }
+}
+
+/**
+ * Add a key which has appeared after startup to the key model, and place every key again.
+ */
+static void
+add_key(KpPollTaskResult *result, const KpKeyboardPoll *poll) {
+    if (!kp_key_model_add(result->key_model, poll->key.code, poll->key.label)) {
+        return;
+    }
+
+    kp_layout_set_apply(result->layouts, result->layout, result->key_model);
+
+    for (guint i = 0; i < result->overlays->len; ++i) {
+        kp_keyboard_view_keys_changed(KP_KEYBOARD_VIEW(KP_OVERLAY(g_ptr_array_index(result->overlays, i))->keyboard_view));
+    }
+}
+
+/**
+ * Show an overlay on a display which has been attached after startup, unless one of the overlays is on it already.
+ */
+static void
+add_late_overlay(KpPollTaskResult *result, guint display_index) {
+    const gchar *display_name = kp_keyboard_get_display_name(result->keyboard_data, display_index);
+
+    if (display_name == NULL) {
+        return;
+    }
+
+    gint display_number = get_display_number(display_name);
+
+    for (guint i = 0; i < result->overlays->len; ++i) {
+        KpOverlay *overlay = g_ptr_array_index(result->overlays, i);
+
+        if (get_display_number(gdk_display_get_name(overlay->display)) == display_number) {
+            return;
+        }
+    }
+
+    GdkDisplay *display = gdk_display_open(display_name);
+
+    if (display == NULL) {
+        fprintf(stderr, "Could not open an overlay on display %s\n", display_name);
+        return;
+    }
+
+    KpOverlay *overlay = overlay_new(display, TRUE, result->cancellable);
+    g_ptr_array_add(result->overlays, overlay);
+    overlay_add_views(overlay, result->key_model, result->ticker);
+
+    on_screen_changed(overlay->window, NULL, &overlay->app_state);
+    gtk_widget_show_all(overlay->window);
+}
+
+static void
+on_poll_task_result(KpKeyboardPoll *poll, gpointer poll_task_result) {
+    KpPollTaskResult *result = poll_task_result;
+
+    kp_stats_record_dispatch(result->stats, poll, kp_event_ring_depth(result->event_ring) + 1);
+
+    if (result->recorder != NULL) {
+        kp_recorder_add(result->recorder, poll);
+    }
+
+    if (poll->result == POLL_KEYMAP_CHANGED) {
+        if (kp_keyboard_view_set_key_label(get_primary_keyboard_view(result), poll->key.code, poll->key.label)) {
+            queue_draw_key_on_other_overlays(result, poll->key.code, TRUE);
+        }
+        return;
+    }
+
+    if (poll->result == POLL_KEY_ADDED) {
+        add_key(result, poll);
+        return;
+    }
+
+    if (poll->result == POLL_DISPLAY_ADDED) {
+        add_late_overlay(result, poll->display);
+        return;
+    }
+
+    gboolean shown = kp_key_model_contains(result->key_model, poll->key.code);
+    const gchar *label = shown ? result->key_model->labels[poll->key.code] : poll->key.label;
+
+    // Autorepeat presses leave the state unchanged, so they do not restart the animation.
+    switch (kp_key_state_update(result->key_state, poll, label)) {
+        case KP_KEY_STATE_CHORD:
+            set_chord_text(result, result->key_state->chord);
+            // Wheel ticks with a held modifier are counted on one entry, e.g. Ctrl+Wheel ↑×5
+            push_to_ticker(result, result->key_state->chord, kp_key_is_wheel(poll->key.code));
+            break;
+        case KP_KEY_STATE_PRESSED:
+            // Plain clicks and wheel ticks only light up their key, they would drown the keystrokes in the ticker
+            if (poll->key.modifier == KP_KEY_MODIFIER_NONE && !kp_key_is_button(poll->key.code)) {
+                set_chord_text(result, "");
+                push_to_ticker(result, label, FALSE);
+            }
+            break;
+        case KP_KEY_STATE_UNCHANGED:
+            // The repeat belongs to the last keystroke, held modifiers repeat as well but are never shown
+            if (poll->pressed && poll->key.modifier == KP_KEY_MODIFIER_NONE) {
+                repeat_in_ticker(result);
+            }
+            return;
+        default:
+            return;
+    }
+
+    if (shown) {
+        if (kp_keyboard_view_set_key_device(get_primary_keyboard_view(result), poll->key.code, poll->device)) {
+            queue_draw_key_on_other_overlays(result, poll->key.code, FALSE);
+        }
+        kp_animator_press(result->animator, poll->key.code);
+    }
+}
+
+static gboolean
+on_delete(GtkWidget *window, GdkEvent *UNUSED(event), gpointer cancellable) {
+    // Keep the window alive until the poll task has returned, on_poll_task_done then quits the main loop.
+    gtk_widget_hide(window);
+    g_cancellable_cancel(G_CANCELLABLE(cancellable));
+
+    return TRUE;
+}
+
+static void
+on_poll_task_done(GObject *UNUSED(source_obj), GAsyncResult *res, gpointer UNUSED(user_data)) {
+    GError *error = NULL;
+
+    if (!g_task_propagate_boolean(G_TASK(res), &error)) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            fprintf(stderr, "Keyboard poll task failed: %s\n", error->message);
+        }
+
+        g_error_free(error);
+    }
+
+    gtk_main_quit();
+}
+
 static gboolean
 on_enter(GtkWidget *window, GdkEventCrossing *event, gpointer app_state_p) {
     gtk_window_set_decorated(GTK_WINDOW(window), TRUE);
-    APP_STATE(app_state_p)->is_transparent = FALSE;
+    set_transparent(window, APP_STATE(app_state_p), FALSE);
 
     return FALSE;
 }
@@ -210,12 +772,12 @@ on_leave(GtkWidget *window, GdkEventCrossing *event, gpointer app_state_p) {
         return TRUE;
     }
 
-#ifdef NDEBUG
+#ifndef NDEBUG
     fprintf(stderr, "Leaving window at %0.0f, %0.0f - window size is %d, %d\n", event->x, event->y, window_width, window_height);
 #endif
 
     gtk_window_set_decorated(GTK_WINDOW(window), FALSE);
-    APP_STATE(app_state_p)->is_transparent = TRUE;
+    set_transparent(window, APP_STATE(app_state_p), TRUE);
     return FALSE;
 }
 
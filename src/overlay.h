@@ -0,0 +1,62 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file overlay.h
+ * @brief Window which shows the keyboard on one display
+ */
+
+#ifndef KEYPRESENTER_OVERLAY_H
+#define KEYPRESENTER_OVERLAY_H
+
+#include <gtk/gtk.h>
+
+#include "appstate.h"
+
+#define KP_OVERLAY(overlay) (((KpOverlay*) overlay))
+
+typedef struct _Overlay KpOverlay;
+
+/**
+ * Every display the keyboard is polled on gets its own overlay.
+ * The overlays share the key model and the ticker, they only differ in what is drawn where.
+ */
+struct _Overlay {
+    GdkDisplay *display;
+
+    /**
+     * TRUE if the display was opened for this overlay and has to be closed with it
+     */
+    gboolean owns_display;
+
+    GtkWidget *window;
+    GtkWidget *keyboard_view;
+
+    /**
+     * Label which shows the last key combination
+     */
+    GtkWidget *chord_label;
+
+    /**
+     * Strip with the last keystrokes, or NULL if it is disabled
+     */
+    GtkWidget *ticker_view;
+
+    AppState app_state;
+};
+
+#endif //KEYPRESENTER_OVERLAY_H
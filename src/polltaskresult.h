@@ -25,14 +25,65 @@
 
 #include <gtk/gtk.h>
 
+#include <keypresenter/keymodel.h>
 #include <keypresenter/poll.h>
+#include "animator.h"
+#include "eventring.h"
+#include "keystate.h"
+#include "layout.h"
+#include "overlay.h"
+#include "recording.h"
+#include "stats.h"
+#include "ticker.h"
 
 typedef struct _PollTaskResult KpPollTaskResult;
 
 struct _PollTaskResult {
-    GHashTable *key_button_table;
-    KpKeyboardPoll poll;
+    /**
+     * Keys shown by every overlay, updated once per event no matter how many overlays there are
+     */
+    KpKeyModel *key_model;
+
+    /**
+     * Array with KpOverlay element type, one per display. The first overlay is on the default display.
+     */
+    GPtrArray *overlays;
+
+    /**
+     * Last keystrokes shown by the ticker views of the overlays, or NULL if the ticker is disabled
+     */
+    KpTicker *ticker;
+
+    /**
+     * Layouts and the layout the keys are placed with, kept to place the keys which are added later
+     */
+    KpLayoutSet *layouts;
+    const KpLayout *layout;
+
+    KpKeyState *key_state;
+    KpEventRing *event_ring;
+    KpAnimator *animator;
+
+    /**
+     * Hot-path counters, always collected
+     */
+    KpStats *stats;
+
+    /**
+     * Recorder every dispatched poll is appended to, or NULL
+     */
+    KpRecorder *recorder;
+
+    /**
+     * Recording which is replayed by kp_replay_task instead of polling the keyboard, or NULL
+     */
+    KpReplay *replay;
     gpointer keyboard_data;
+
+    /**
+     * Cancellable of the poll task, a producer which waits for space in the event ring gives up when it is cancelled
+     */
+    GCancellable *cancellable;
 };
 
 #endif //KEYPRESENTER_POLLTASKRESULT_H
@@ -0,0 +1,368 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file recording.c
+ * @brief Binary recording of keyboard polls and their replay
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "macro.h"
+#include "polltaskresult.h"
+#include "recording.h"
+
+/**
+ * Write the whole buffer, stop recording if that fails.
+ */
+static void
+recorder_flush(KpRecorder *recorder) {
+    guint written = 0;
+
+    while (recorder->fd >= 0 && written < recorder->length) {
+        ssize_t length = write(recorder->fd, recorder->buffer + written, recorder->length - written);
+
+        if (length < 0) {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Could not write recording, recording stopped: %s\n", g_strerror(errno));
+            close(recorder->fd);
+            recorder->fd = -1;
+            break;
+        }
+
+        written += length;
+    }
+
+    recorder->length = 0;
+}
+
+/**
+ * Append bytes to the buffer, writing it whenever it is full.
+ */
+static void
+recorder_append(KpRecorder *recorder, gconstpointer data, gsize length) {
+    const guint8 *bytes = data;
+
+    while (length > 0) {
+        if (recorder->length == sizeof(recorder->buffer)) {
+            recorder_flush(recorder);
+        }
+
+        gsize chunk = MIN(length, sizeof(recorder->buffer) - recorder->length);
+
+        memcpy(recorder->buffer + recorder->length, bytes, chunk);
+        recorder->length += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Append the keys of the model after the entries and point the header to them.
+ */
+static void
+recorder_write_keys(KpRecorder *recorder) {
+    recorder_flush(recorder);
+
+    off_t keys_offset = recorder->fd >= 0 ? lseek(recorder->fd, 0, SEEK_CUR) : -1;
+    if (keys_offset < 0) {
+        return;
+    }
+
+    guint32 count = recorder->key_model->count;
+    recorder_append(recorder, &count, sizeof(count));
+
+    for (guint i = 0; i < count; ++i) {
+        guint16 code = recorder->key_model->codes[i];
+        const gchar *label = recorder->key_model->labels[code] != NULL ? recorder->key_model->labels[code] : "";
+
+        recorder_append(recorder, &code, sizeof(code));
+        recorder_append(recorder, label, strlen(label) + 1);
+    }
+
+    recorder_flush(recorder);
+
+    guint64 offset = keys_offset;
+    if (recorder->fd >= 0 && pwrite(recorder->fd, &offset, sizeof(offset),
+                                    G_STRUCT_OFFSET(KpRecordingHeader, keys_offset)) != sizeof(offset)) {
+        fprintf(stderr, "Could not write the keys of the recording: %s\n", g_strerror(errno));
+    }
+}
+
+KpRecorder *
+kp_recorder_new(const gchar *path, const KpKeyModel *key_model, GError **error) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not create recording %s: %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    KpRecorder *recorder = g_new0(KpRecorder, 1);
+    recorder->fd = fd;
+    recorder->started = g_get_monotonic_time();
+    recorder->key_model = key_model;
+
+    KpRecordingHeader header = {
+            .magic = KP_RECORDING_MAGIC,
+            .version = KP_RECORDING_VERSION,
+            .entry_size = sizeof(KpRecordingEntry),
+            .started_at = g_get_real_time(),
+    };
+
+    memcpy(recorder->buffer, &header, sizeof(header));
+    recorder->length = sizeof(header);
+
+    return recorder;
+}
+
+void
+kp_recorder_add(KpRecorder *recorder, const KpKeyboardPoll *poll) {
+    // Keys and displays which appear later are no entries, their results do not fit in the flags.
+    // Their keys are written with the others when the recording is closed.
+    if (poll->result > KP_RECORDING_RESULT_MASK) {
+        return;
+    }
+
+    if (recorder->length + sizeof(KpRecordingEntry) > sizeof(recorder->buffer)) {
+        recorder_flush(recorder);
+    }
+
+    KpRecordingEntry entry = {
+            .offset = g_get_monotonic_time() - recorder->started,
+            .time = poll->time,
+            .code = poll->key.code,
+            .display = MIN(poll->display, G_MAXUINT8),
+            .flags = (poll->result & KP_RECORDING_RESULT_MASK)
+                     | ((poll->key.modifier << KP_RECORDING_MODIFIER_SHIFT) & KP_RECORDING_MODIFIER_MASK)
+                     | (poll->pressed ? KP_RECORDING_FLAG_PRESSED : 0),
+    };
+
+    memcpy(recorder->buffer + recorder->length, &entry, sizeof(entry));
+    recorder->length += sizeof(entry);
+}
+
+void
+kp_recorder_free(KpRecorder *recorder) {
+    if (recorder == NULL) {
+        return;
+    }
+
+    recorder_write_keys(recorder);
+
+    if (recorder->fd >= 0) {
+        close(recorder->fd);
+    }
+
+    g_free(recorder);
+}
+
+KpReplay *
+kp_replay_new(const gchar *path, gboolean fast, GError **error) {
+    KpRecordingHeader *header;
+    struct stat file_stat;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &file_stat) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not open recording %s: %s", path, g_strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    if ((gsize) file_stat.st_size < sizeof(KpRecordingHeader)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a recording", path);
+        close(fd);
+        return NULL;
+    }
+
+    guint8 *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not map recording %s: %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    header = (KpRecordingHeader *) data;
+    if (memcmp(header->magic, KP_RECORDING_MAGIC, sizeof(header->magic)) != 0
+        || header->version != KP_RECORDING_VERSION
+        || header->entry_size != sizeof(KpRecordingEntry)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a version %d recording",
+                    path, KP_RECORDING_VERSION);
+        munmap(data, file_stat.st_size);
+        return NULL;
+    }
+
+    // The entries are read once from front to back.
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+
+    KpReplay *replay = g_new0(KpReplay, 1);
+    gsize entries_end = file_stat.st_size;
+
+    // A recording which was not closed has entries up to its end, but no keys
+    if (header->keys_offset >= sizeof(KpRecordingHeader) && header->keys_offset < (guint64) file_stat.st_size) {
+        entries_end = header->keys_offset;
+        replay->keys = data + header->keys_offset;
+        replay->keys_size = file_stat.st_size - header->keys_offset;
+    }
+
+    replay->data = data;
+    replay->size = file_stat.st_size;
+    replay->entries = (const KpRecordingEntry *) (data + sizeof(KpRecordingHeader));
+    replay->count = (entries_end - sizeof(KpRecordingHeader)) / sizeof(KpRecordingEntry);
+    replay->fast = fast;
+
+    return replay;
+}
+
+void
+kp_replay_free(KpReplay *replay) {
+    if (replay == NULL) {
+        return;
+    }
+
+    munmap(replay->data, replay->size);
+    g_free(replay);
+}
+
+KpKeyModel *
+kp_replay_get_keys(const KpReplay *replay) {
+    const guint8 *key = replay->keys, *end = replay->keys + replay->keys_size;
+    guint32 count;
+
+    if (replay->keys == NULL || replay->keys_size < sizeof(count)) {
+        return NULL;
+    }
+
+    memcpy(&count, key, sizeof(count));
+    key += sizeof(count);
+
+    KpKeyModel *model = kp_key_model_new();
+
+    // The table is not aligned, and a damaged one ends the keys instead of reading past the mapping
+    for (guint32 i = 0; i < count && end - key > (gssize) sizeof(guint16); ++i) {
+        guint16 code;
+        gchar *label = (gchar *) key + sizeof(code);
+        const gchar *label_end = memchr(label, '\0', end - (const guint8 *) label);
+
+        if (label_end == NULL) break;
+
+        memcpy(&code, key, sizeof(code));
+        kp_key_model_add(model, code, label);
+        key = (const guint8 *) label_end + 1;
+    }
+
+    if (model->count == 0) {
+        kp_key_model_free(model);
+        return NULL;
+    }
+
+    return model;
+}
+
+gboolean
+kp_replay_get_poll(const KpReplay *replay, gsize index, KpKeyboardPoll *poll) {
+    const KpRecordingEntry *entry = &replay->entries[index];
+
+    // Keymap changes can not be replayed, the recording only holds the labels of the keys at its end.
+    if ((entry->flags & KP_RECORDING_RESULT_MASK) != POLL_OK) {
+        return FALSE;
+    }
+
+    *poll = (KpKeyboardPoll) {
+            .result = POLL_OK,
+            .key = {
+                    .code = entry->code,
+                    .label = NULL,
+                    .modifier = (entry->flags & KP_RECORDING_MODIFIER_MASK) >> KP_RECORDING_MODIFIER_SHIFT,
+            },
+            .pressed = (entry->flags & KP_RECORDING_FLAG_PRESSED) != 0,
+            .time = (guint32) (entry->offset / G_TIME_SPAN_MILLISECOND),
+            .display = entry->display,
+    };
+
+    return TRUE;
+}
+
+/**
+ * Sleep until the deadline or until the task is cancelled.
+ */
+static void
+wait_until(gint64 deadline, int cancel_fd) {
+    gint64 remaining = deadline - g_get_monotonic_time();
+
+    if (remaining <= 0) {
+        return;
+    }
+
+    struct pollfd cancel_poll = {.fd = cancel_fd, .events = POLLIN};
+    int timeout = (int) ((remaining + G_TIME_SPAN_MILLISECOND - 1) / G_TIME_SPAN_MILLISECOND);
+
+    if (cancel_fd < 0) {
+        g_usleep(remaining);
+    } else {
+        poll(&cancel_poll, 1, timeout);
+    }
+}
+
+void
+kp_replay_task(GTask *task, gpointer UNUSED(source_obj), gpointer poll_task_result, GCancellable *cancellable) {
+    KpPollTaskResult *result = poll_task_result;
+    KpReplay *replay = result->replay;
+    GError *error = NULL;
+    int cancel_fd = g_cancellable_get_fd(cancellable);
+    gint64 started = g_get_monotonic_time();
+
+    for (gsize i = 0; i < replay->count && !g_cancellable_set_error_if_cancelled(cancellable, &error); ++i) {
+        KpKeyboardPoll poll;
+
+        if (!kp_replay_get_poll(replay, i, &poll)) continue;
+
+        if (!replay->fast) {
+            kp_event_ring_notify(result->event_ring);
+            wait_until(started + (gint64) replay->entries[i].offset, cancel_fd);
+        }
+
+        poll.time = (guint32) (g_get_monotonic_time() / G_TIME_SPAN_MILLISECOND);
+
+        // The replay waits for the main loop instead of dropping entries.
+        kp_event_ring_push_wait(result->event_ring, &poll, cancellable);
+    }
+
+    kp_event_ring_notify(result->event_ring);
+
+    if (cancel_fd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+
+    if (error != NULL) {
+        g_task_return_error(task, error);
+    } else {
+        g_task_return_boolean(task, TRUE);
+    }
+}
@@ -0,0 +1,194 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file recording.h
+ * @brief Binary recording of keyboard polls and their replay
+ */
+
+#ifndef KEYPRESENTER_RECORDING_H
+#define KEYPRESENTER_RECORDING_H
+
+#include <gio/gio.h>
+
+#include <keypresenter/keymodel.h>
+#include <keypresenter/poll.h>
+
+#define KP_RECORDING_MAGIC "KPRC"
+#define KP_RECORDING_VERSION 2
+
+/**
+ * Size of the buffer the recorder collects entries in before writing them
+ */
+#ifndef KP_RECORDER_BUFFER_SIZE
+#define KP_RECORDER_BUFFER_SIZE (64 * 1024)
+#endif
+
+/**
+ * Layout of KpRecordingEntry.flags: the KpKeyboardPollResult, the KpKeyModifier of the key and a bit for key presses
+ */
+#define KP_RECORDING_RESULT_MASK 0x03
+#define KP_RECORDING_MODIFIER_SHIFT 2
+#define KP_RECORDING_MODIFIER_MASK 0x3c
+#define KP_RECORDING_FLAG_PRESSED 0x80
+
+typedef struct _RecordingHeader KpRecordingHeader;
+typedef struct _RecordingEntry KpRecordingEntry;
+typedef struct _Recorder KpRecorder;
+typedef struct _Replay KpReplay;
+
+/**
+ * Start of a recording file. All fields are stored in host byte order.
+ *
+ * The entries follow the header. When the recording is closed, the keys which were shown are appended after the
+ * entries: a guint32 amount of keys, then for each key its guint16 keycode and its NUL-terminated label.
+ */
+struct _RecordingHeader {
+    gchar magic[4];
+    guint16 version;
+
+    /**
+     * sizeof(KpRecordingEntry), so readers can skip fields they do not know
+     */
+    guint16 entry_size;
+
+    /**
+     * Wall clock time in microseconds at which the recording started
+     */
+    gint64 started_at;
+
+    /**
+     * Position of the keys in the file, or 0 if the recording was not closed
+     */
+    guint64 keys_offset;
+};
+
+struct _RecordingEntry {
+    /**
+     * Microseconds since the recording started at which the poll was dispatched
+     */
+    guint64 offset;
+
+    /**
+     * Timestamp of the event as given by the input source
+     */
+    guint32 time;
+
+    guint16 code;
+    guint8 display;
+    guint8 flags;
+};
+
+G_STATIC_ASSERT(sizeof(KpRecordingHeader) == 24);
+G_STATIC_ASSERT(sizeof(KpRecordingEntry) == 16);
+
+struct _Recorder {
+    int fd;
+
+    /**
+     * Monotonic time in microseconds of the start of the recording
+     */
+    gint64 started;
+
+    /**
+     * Model whose keys are written when the recording is closed, so keys which were added later are included
+     */
+    const KpKeyModel *key_model;
+
+    guint length;
+    guint8 buffer[KP_RECORDER_BUFFER_SIZE];
+};
+
+struct _Replay {
+    /**
+     * The mapped recording file
+     */
+    guint8 *data;
+    gsize size;
+
+    const KpRecordingEntry *entries;
+    gsize count;
+
+    /**
+     * Keys of the recording within data, or NULL if the recording has none
+     */
+    const guint8 *keys;
+    gsize keys_size;
+
+    /**
+     * TRUE to replay as fast as the event ring takes the entries, FALSE to keep the original timing
+     */
+    gboolean fast;
+};
+
+/**
+ * Create a new recording file, an existing file is overwritten.
+ *
+ * @param key_model Model of the shown keys, it has to outlive the recorder
+ * @return Ptr to the recorder, or NULL with error set
+ */
+KpRecorder *
+kp_recorder_new(const gchar *path, const KpKeyModel *key_model, GError **error);
+
+/**
+ * Append a poll to the recording. Only writes to the file when the buffer is full.
+ */
+void
+kp_recorder_add(KpRecorder *recorder, const KpKeyboardPoll *poll);
+
+/**
+ * Write the buffered entries and the keys of the model, and close the recording.
+ */
+void
+kp_recorder_free(KpRecorder *recorder);
+
+/**
+ * Map a recording file.
+ *
+ * @return Ptr to the replay, or NULL with error set if the file is not a recording
+ */
+KpReplay *
+kp_replay_new(const gchar *path, gboolean fast, GError **error);
+
+void
+kp_replay_free(KpReplay *replay);
+
+/**
+ * Create a key model with the keys and labels of the recording, so it can be shown without the keyboard it was
+ * recorded on. The labels point into the replay, which has to outlive the model.
+ *
+ * @return Ptr to the unplaced key model, or NULL if the recording has no keys
+ */
+KpKeyModel *
+kp_replay_get_keys(const KpReplay *replay);
+
+/**
+ * Turn an entry of the replay back into a poll, its time is the offset of the entry in milliseconds.
+ *
+ * @return FALSE if the entry can not be replayed
+ */
+gboolean
+kp_replay_get_poll(const KpReplay *replay, gsize index, KpKeyboardPoll *poll);
+
+/**
+ * GTask which replaces kp_keyboard_poll_task and feeds the replay of the KpPollTaskResult into its event ring.
+ * Returns when the recording has ended or the task is cancelled.
+ */
+void
+kp_replay_task(GTask *task, gpointer source_obj, gpointer poll_task_result, GCancellable *cancellable);
+
+#endif //KEYPRESENTER_RECORDING_H
@@ -0,0 +1,148 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file stats.c
+ * @brief Lock-free counters and histograms of the poll thread and the user interface
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+KpStats *
+kp_stats_new(void) {
+    KpStats *stats;
+
+    if (posix_memalign((void **) &stats, KEYPRESENTER_CACHELINE_SIZE, sizeof(KpStats)) != 0) {
+        return NULL;
+    }
+
+    memset(stats, 0, sizeof(KpStats));
+    stats->ui.report = g_string_new(NULL);
+
+    return stats;
+}
+
+void
+kp_stats_free(KpStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+
+    g_string_free(stats->ui.report, TRUE);
+    free(stats);
+}
+
+static void
+histogram_add(KpStatsHistogram *histogram, guint64 value) {
+    histogram->buckets[MIN(g_bit_storage(value), KP_STATS_HISTOGRAM_BUCKETS - 1)]++;
+    histogram->count++;
+    histogram->max = MAX(histogram->max, value);
+}
+
+/**
+ * @return Upper bound of the bucket which holds the given fraction of all values
+ */
+static guint64
+histogram_percentile(const KpStatsHistogram *histogram, gdouble fraction) {
+    guint64 rank = (guint64) (histogram->count * fraction), seen = 0;
+
+    for (guint bucket = 0; bucket < KP_STATS_HISTOGRAM_BUCKETS; ++bucket) {
+        seen += histogram->buckets[bucket];
+
+        if (seen > rank) {
+            return MIN(G_GUINT64_CONSTANT(1) << bucket, histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
+
+void
+kp_stats_record_dispatch(KpStats *stats, const KpKeyboardPoll *poll, guint queue_depth) {
+    stats->ui.dispatched++;
+    stats->ui.max_queue_depth = MAX(stats->ui.max_queue_depth, queue_depth);
+
+    if (poll->time == 0) {
+        return;
+    }
+
+    // X servers and evdev stamp events with the monotonic clock in milliseconds, truncated to 32 bits.
+    guint32 latency = (guint32) (g_get_monotonic_time() / G_TIME_SPAN_MILLISECOND) - poll->time;
+
+    if (latency > KP_STATS_MAX_SYNCHRONIZED_LATENCY_MS) {
+        stats->ui.unsynchronized++;
+        return;
+    }
+
+    histogram_add(&stats->ui.dispatch_latency, latency);
+}
+
+static void
+on_paint(GdkFrameClock *UNUSED(frame_clock), gpointer stats) {
+    ((KpStats *) stats)->ui.paint_started = g_get_monotonic_time();
+}
+
+static void
+on_after_paint(GdkFrameClock *UNUSED(frame_clock), gpointer stats_p) {
+    KpStats *stats = stats_p;
+
+    if (stats->ui.paint_started != 0) {
+        histogram_add(&stats->ui.draw_time, g_get_monotonic_time() - stats->ui.paint_started);
+        stats->ui.paint_started = 0;
+    }
+}
+
+void
+kp_stats_watch_frame_clock(KpStats *stats, GdkFrameClock *frame_clock) {
+    g_signal_connect(frame_clock, "paint", G_CALLBACK(on_paint), stats);
+    g_signal_connect(frame_clock, "after-paint", G_CALLBACK(on_after_paint), stats);
+}
+
+void
+kp_stats_format(KpStats *stats, const KpEventRing *ring, GString *line) {
+    KpUiStats *ui = &stats->ui;
+
+    g_string_append(line, "events");
+    for (guint display = 0; display < KP_STATS_MAX_DISPLAYS; ++display) {
+        guint64 events = __atomic_load_n(&stats->poll.events[display], __ATOMIC_RELAXED);
+
+        if (events != 0) {
+            g_string_append_printf(line, " %u:%" G_GUINT64_FORMAT, display, events);
+        }
+    }
+
+    g_string_append_printf(line, " stalls %u (%" G_GUINT64_FORMAT "ms) dispatched %" G_GUINT64_FORMAT " depth %u",
+                           g_atomic_int_get(&ring->stalls),
+                           __atomic_load_n(&ring->stalled_time, __ATOMIC_RELAXED) / G_TIME_SPAN_MILLISECOND,
+                           ui->dispatched, ui->max_queue_depth);
+
+    // Timestamps only have millisecond resolution, the percentiles are the bounds of power of two buckets
+    g_string_append_printf(line, " latency p50 <=%" G_GUINT64_FORMAT "ms p99 <=%" G_GUINT64_FORMAT "ms max %" G_GUINT64_FORMAT "ms",
+                           histogram_percentile(&ui->dispatch_latency, 0.5),
+                           histogram_percentile(&ui->dispatch_latency, 0.99), ui->dispatch_latency.max);
+    g_string_append_printf(line, " draw p50 %" G_GUINT64_FORMAT "us max %" G_GUINT64_FORMAT "us",
+                           histogram_percentile(&ui->draw_time, 0.5), ui->draw_time.max);
+
+    if (ui->unsynchronized != 0) {
+        g_string_append_printf(line, " unsynchronized %" G_GUINT64_FORMAT, ui->unsynchronized);
+    }
+
+    ui->max_queue_depth = 0;
+}
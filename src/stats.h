@@ -0,0 +1,150 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file stats.h
+ * @brief Lock-free counters and histograms of the poll thread and the user interface
+ */
+
+#ifndef KEYPRESENTER_STATS_H
+#define KEYPRESENTER_STATS_H
+
+#include <gtk/gtk.h>
+
+#include <keypresenter/poll.h>
+#include "eventring.h"
+#include "macro.h"
+
+/**
+ * Displays beyond this amount share the last counter
+ */
+#ifndef KP_STATS_MAX_DISPLAYS
+#define KP_STATS_MAX_DISPLAYS 16
+#endif
+
+/**
+ * Bucket i of a histogram counts values below 2^i in the unit of the histogram, the last bucket counts everything above
+ */
+#define KP_STATS_HISTOGRAM_BUCKETS 24
+
+/**
+ * Timestamps which lie further in the past are not comparable with the local clock, e.g. from a remote server
+ */
+#define KP_STATS_MAX_SYNCHRONIZED_LATENCY_MS 60000
+
+typedef struct _StatsHistogram KpStatsHistogram;
+typedef struct _PollStats KpPollStats;
+typedef struct _UiStats KpUiStats;
+typedef struct _Stats KpStats;
+
+struct _StatsHistogram {
+    guint64 buckets[KP_STATS_HISTOGRAM_BUCKETS];
+    guint64 count;
+    guint64 max;
+};
+
+/**
+ * Only written by the poll thread
+ */
+struct _PollStats {
+    /**
+     * Events received per display
+     */
+    guint64 events[KP_STATS_MAX_DISPLAYS];
+};
+
+/**
+ * Only used by the main thread
+ */
+struct _UiStats {
+    guint64 dispatched;
+
+    /**
+     * Deepest the event ring has been since the last report
+     */
+    guint max_queue_depth;
+
+    /**
+     * Time from the event's timestamp to its dispatch in the main loop, in milliseconds like the timestamps
+     */
+    KpStatsHistogram dispatch_latency;
+
+    /**
+     * Events whose timestamp could not be compared with the local clock
+     */
+    guint64 unsynchronized;
+
+    /**
+     * Time the frame clock spends in the paint phase, in microseconds
+     */
+    KpStatsHistogram draw_time;
+    gint64 paint_started;
+
+    /**
+     * Last report written by the stats timer
+     */
+    GString *report;
+};
+
+/**
+ * The halves are written by different threads and live on separate cache lines.
+ */
+struct _Stats {
+    KpPollStats poll CACHELINE_ALIGNED;
+    KpUiStats ui CACHELINE_ALIGNED;
+};
+
+KpStats *
+kp_stats_new(void);
+
+void
+kp_stats_free(KpStats *stats);
+
+/**
+ * Count an event received from a display. May only be called from the poll thread.
+ */
+static inline void
+kp_stats_count_event(KpStats *stats, guint display) {
+    guint64 *counter = &stats->poll.events[MIN(display, KP_STATS_MAX_DISPLAYS - 1)];
+
+    // Single writer, the store only has to be atomic for the reader
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record the dispatch of a poll in the main loop.
+ *
+ * @param queue_depth Amount of records which were in the ring, including this one
+ */
+void
+kp_stats_record_dispatch(KpStats *stats, const KpKeyboardPoll *poll, guint queue_depth);
+
+/**
+ * Measure the paint phase of every frame of the clock.
+ */
+void
+kp_stats_watch_frame_clock(KpStats *stats, GdkFrameClock *frame_clock);
+
+/**
+ * Append a one-line summary to a string and reset the per-report maxima.
+ *
+ * @param ring Ring whose stalls on a full ring are reported
+ */
+void
+kp_stats_format(KpStats *stats, const KpEventRing *ring, GString *line);
+
+#endif //KEYPRESENTER_STATS_H
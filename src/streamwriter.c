@@ -0,0 +1,169 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file streamwriter.c
+ * @brief Writer of the shared-memory event stream
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gio/gio.h>
+
+#include "streamwriter.h"
+
+#define STREAM_MASK (DEFAULT_STREAM_CAPACITY - 1)
+
+/**
+ * Map a new shared memory object, or anonymous memory if there is no name.
+ *
+ * @return Zero-filled mapping, or NULL with error set
+ */
+static KpStream *
+map_stream(const gchar *object_name, gsize size, GError **error) {
+    if (object_name == NULL) {
+        KpStream *stream = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (stream == MAP_FAILED) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Could not map event stream: %s", g_strerror(errno));
+            return NULL;
+        }
+
+        return stream;
+    }
+
+    // Readers of an object left behind by an earlier run keep their mapping, new readers get a fresh object
+    shm_unlink(object_name);
+
+    int fd = shm_open(object_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not create event stream %s: %s", object_name, g_strerror(errno));
+
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(object_name);
+        }
+        return NULL;
+    }
+
+    KpStream *stream = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (stream == MAP_FAILED) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Could not map event stream %s: %s", object_name, g_strerror(errno));
+        shm_unlink(object_name);
+        return NULL;
+    }
+
+    return stream;
+}
+
+KpStreamWriter *
+kp_stream_writer_new(const gchar *name, GError **error) {
+    gchar *object_name = name == NULL || name[0] == '/' ? g_strdup(name) : g_strconcat("/", name, NULL);
+    gsize size = sizeof(KpStreamHeader) + DEFAULT_STREAM_CAPACITY * sizeof(KpStreamRecord);
+    KpStream *stream = map_stream(object_name, size, error);
+
+    if (stream == NULL) {
+        g_free(object_name);
+        return NULL;
+    }
+
+    // The object is zero-filled, so every record starts out incomplete
+    memcpy(stream->header.magic, KP_STREAM_MAGIC, sizeof(stream->header.magic));
+    stream->header.record_size = sizeof(KpStreamRecord);
+    stream->header.capacity = DEFAULT_STREAM_CAPACITY;
+    stream->header.records_offset = sizeof(KpStreamHeader);
+    stream->header.started_at = g_get_real_time();
+
+    // Readers check the version last, it makes the header valid
+    __atomic_store_n(&stream->header.version, KP_STREAM_VERSION, __ATOMIC_RELEASE);
+
+    KpStreamWriter *writer = g_new0(KpStreamWriter, 1);
+    writer->name = object_name;
+    writer->stream = stream;
+    writer->size = size;
+
+    return writer;
+}
+
+void
+kp_stream_writer_push(KpStreamWriter *writer, const KpKeyboardPoll *poll) {
+    guint32 number = writer->written;
+    KpStreamRecord *record = &writer->stream->records[number & STREAM_MASK];
+
+    // A reader which copies the record while it changes sees the sequence change and discards its copy
+    g_atomic_int_set(&record->sequence, 0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time = poll->time;
+    record->code = poll->key.code;
+    record->display = poll->display;
+    record->result = poll->result;
+    record->modifier = poll->key.modifier;
+    record->pressed = poll->pressed ? 1 : 0;
+    record->device = poll->device;
+
+    g_strlcpy(record->label, poll->key.label != NULL ? poll->key.label : "", KP_STREAM_LABEL_SIZE);
+
+    g_atomic_int_set(&record->sequence, number + 1);
+
+    writer->written = number + 1;
+    g_atomic_int_set(&writer->stream->header.written, writer->written);
+}
+
+void
+kp_stream_writer_notify(KpStreamWriter *writer) {
+    if (writer->notified == writer->written) {
+        return;
+    }
+
+    writer->notified = writer->written;
+    g_atomic_int_inc(&writer->stream->header.notify);
+
+    if (g_atomic_int_get(&writer->stream->header.waiters) > 0) {
+        syscall(SYS_futex, &writer->stream->header.notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+void
+kp_stream_writer_free(KpStreamWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+
+    g_atomic_int_set(&writer->stream->header.closed, 1);
+    g_atomic_int_inc(&writer->stream->header.notify);
+    syscall(SYS_futex, &writer->stream->header.notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    munmap(writer->stream, writer->size);
+    if (writer->name != NULL) {
+        shm_unlink(writer->name);
+    }
+    g_free(writer->name);
+    g_free(writer);
+}
+
+#undef STREAM_MASK
@@ -0,0 +1,87 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file streamwriter.h
+ * @brief Writer of the shared-memory event stream, the layout is described in keypresenter/stream.h
+ */
+
+#ifndef KEYPRESENTER_STREAMWRITER_H
+#define KEYPRESENTER_STREAMWRITER_H
+
+#include <glib.h>
+
+#include <keypresenter/poll.h>
+#include <keypresenter/stream.h>
+
+/**
+ * Amount of records in the ring, must be a power of two
+ */
+#ifndef DEFAULT_STREAM_CAPACITY
+#define DEFAULT_STREAM_CAPACITY 4096
+#endif
+
+G_STATIC_ASSERT((DEFAULT_STREAM_CAPACITY & (DEFAULT_STREAM_CAPACITY - 1)) == 0);
+
+typedef struct _StreamWriter KpStreamWriter;
+
+struct _StreamWriter {
+    /**
+     * Name of the shared memory object, starting with a slash, or NULL if the stream is only read in-process
+     */
+    gchar *name;
+
+    KpStream *stream;
+    gsize size;
+
+    /**
+     * Writer-local copies of header.written and of its value at the last notify
+     */
+    guint32 written;
+    guint32 notified;
+};
+
+/**
+ * Create the shared memory object /name, an object which was left behind by an earlier run is replaced.
+ *
+ * @param name (Optional) NULL to map anonymous memory instead, which can only be read by threads of this process
+ * @return Ptr to the writer, or NULL with error set
+ */
+KpStreamWriter *
+kp_stream_writer_new(const gchar *name, GError **error);
+
+/**
+ * Publish a poll. May only be called from one thread at a time, never blocks.
+ * Readers are not woken up until kp_stream_writer_notify is called.
+ */
+void
+kp_stream_writer_push(KpStreamWriter *writer, const KpKeyboardPoll *poll);
+
+/**
+ * Wake up waiting readers if anything has been published since the last call.
+ * Costs a system call only when a reader is actually waiting.
+ */
+void
+kp_stream_writer_notify(KpStreamWriter *writer);
+
+/**
+ * Mark the stream closed for the readers and remove the shared memory object.
+ */
+void
+kp_stream_writer_free(KpStreamWriter *writer);
+
+#endif //KEYPRESENTER_STREAMWRITER_H
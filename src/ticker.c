@@ -0,0 +1,65 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file ticker.c
+ * @brief Fixed-capacity history of the last keystrokes and chords
+ */
+
+#include <string.h>
+
+#include "ticker.h"
+
+KpTicker *
+kp_ticker_new(void) {
+    return g_new0(KpTicker, 1);
+}
+
+void
+kp_ticker_free(KpTicker *ticker) {
+    g_free(ticker);
+}
+
+void
+kp_ticker_push(KpTicker *ticker, const gchar *text) {
+    KpTickerEntry *entry = &ticker->entries[ticker->pushed++ & (DEFAULT_TICKER_CAPACITY - 1)];
+
+    g_strlcpy(entry->text, text, KP_TICKER_TEXT_SIZE);
+    entry->repeats = 0;
+}
+
+gboolean
+kp_ticker_push_merged(KpTicker *ticker, const gchar *text, gboolean merge) {
+    if (merge && ticker->pushed > 0 && strcmp(kp_ticker_get(ticker, 0)->text, text) == 0) {
+        return !kp_ticker_repeat(ticker);
+    }
+
+    kp_ticker_push(ticker, text);
+
+    return TRUE;
+}
+
+gboolean
+kp_ticker_repeat(KpTicker *ticker) {
+    if (ticker->pushed == 0) {
+        return FALSE;
+    }
+
+    ticker->entries[(ticker->pushed - 1) & (DEFAULT_TICKER_CAPACITY - 1)].repeats++;
+
+    return TRUE;
+}
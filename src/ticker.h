@@ -0,0 +1,107 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file ticker.h
+ * @brief Fixed-capacity history of the last keystrokes and chords
+ */
+
+#ifndef KEYPRESENTER_TICKER_H
+#define KEYPRESENTER_TICKER_H
+
+#include <glib.h>
+
+/**
+ * Amount of keystrokes which are remembered, must be a power of two
+ */
+#ifndef DEFAULT_TICKER_CAPACITY
+#define DEFAULT_TICKER_CAPACITY 64
+#endif
+
+/**
+ * Longest keystroke text, including the terminator. Longer texts are truncated.
+ */
+#define KP_TICKER_TEXT_SIZE 64
+
+G_STATIC_ASSERT((DEFAULT_TICKER_CAPACITY & (DEFAULT_TICKER_CAPACITY - 1)) == 0);
+
+typedef struct _TickerEntry KpTickerEntry;
+typedef struct _Ticker KpTicker;
+
+struct _TickerEntry {
+    gchar text[KP_TICKER_TEXT_SIZE];
+
+    /**
+     * Amount of times the keystroke has been repeated since it was pushed
+     */
+    guint repeats;
+};
+
+/**
+ * Ring buffer of entries, the oldest entry is overwritten when it is full. Pushing never allocates.
+ */
+struct _Ticker {
+    KpTickerEntry entries[DEFAULT_TICKER_CAPACITY];
+
+    /**
+     * Total amount of pushed entries, the newest entry is at (pushed - 1) % capacity
+     */
+    guint64 pushed;
+};
+
+KpTicker *
+kp_ticker_new(void);
+
+void
+kp_ticker_free(KpTicker *ticker);
+
+/**
+ * @return Amount of entries in the ticker
+ */
+static inline guint
+kp_ticker_length(const KpTicker *ticker) {
+    return (guint) MIN(ticker->pushed, DEFAULT_TICKER_CAPACITY);
+}
+
+/**
+ * @param age 0 for the newest entry, must be less than kp_ticker_length
+ */
+static inline const KpTickerEntry *
+kp_ticker_get(const KpTicker *ticker, guint age) {
+    return &ticker->entries[(ticker->pushed - 1 - age) & (DEFAULT_TICKER_CAPACITY - 1)];
+}
+
+void
+kp_ticker_push(KpTicker *ticker, const gchar *text);
+
+/**
+ * Like kp_ticker_push, but when merge is TRUE a text which equals the newest entry is counted as its repeat.
+ *
+ * @return TRUE if a new entry was pushed, FALSE if the newest entry was repeated
+ */
+gboolean
+kp_ticker_push_merged(KpTicker *ticker, const gchar *text, gboolean merge);
+
+/**
+ * Count a repeat of the newest entry.
+ *
+ * @return FALSE if the ticker is empty
+ */
+gboolean
+kp_ticker_repeat(KpTicker *ticker);
+
+#endif //KEYPRESENTER_TICKER_H
@@ -0,0 +1,270 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file tickerview.c
+ * @brief Widget which shows the last keystrokes and chords as a scrolling strip of text
+ *
+ * Text is drawn from a glyph atlas, so a keystroke costs neither a PangoLayout nor any other allocation.
+ */
+
+#include <math.h>
+
+#include "glyphatlas.h"
+#include "macro.h"
+#include "tickerview.h"
+
+#define TICKER_FONT "Sans 12"
+
+/**
+ * Space around the text of a boxed keystroke, and between two keystrokes
+ */
+#define TICKER_PADDING 4
+#define TICKER_GAP 6
+
+/**
+ * Space between two keystrokes of a single character, so typed words stay readable
+ */
+#define TICKER_CHARACTER_GAP 1
+
+#define TICKER_CORNER_RADIUS 3.0
+
+/**
+ * Time in microseconds it takes a new keystroke to scroll in
+ */
+#define TICKER_SCROLL_DURATION (120 * G_TIME_SPAN_MILLISECOND)
+
+enum {
+    TICKER_COLOR_TEXT = 0,
+    TICKER_COLOR_BOXED_TEXT = 1,
+    TICKER_COLOR_COUNT,
+};
+
+static const gdouble TICKER_COLORS[TICKER_COLOR_COUNT][4] = {
+        [TICKER_COLOR_TEXT] = {0.18, 0.20, 0.21, 1.0},
+        [TICKER_COLOR_BOXED_TEXT] = {1.00, 1.00, 1.00, 1.0},
+};
+
+static const gdouble TICKER_BOX_COLOR[4] = {0.21, 0.52, 0.89, 0.95};
+
+struct _KpTickerView {
+    GtkDrawingArea parent_instance;
+
+    /**
+     * Shared with the other ticker views, not owned
+     */
+    KpTicker *ticker;
+
+    /**
+     * Glyphs at the scale of the widget, NULL until first needed
+     */
+    KpGlyphAtlas *atlas;
+
+    /**
+     * Distance in pixels the strip is still shifted to the right, it shrinks to 0 while new keystrokes scroll in
+     */
+    gdouble scroll;
+    gdouble scroll_from;
+    gint64 scroll_started;
+    guint tick_id;
+};
+
+G_DEFINE_TYPE(KpTickerView, kp_ticker_view, GTK_TYPE_DRAWING_AREA)
+
+static KpGlyphAtlas *
+get_atlas(KpTickerView *view) {
+    gdouble scale = gtk_widget_get_scale_factor(GTK_WIDGET(view));
+
+    if (view->atlas == NULL || view->atlas->scale != scale) {
+        kp_glyph_atlas_free(view->atlas);
+        view->atlas = kp_glyph_atlas_new(TICKER_FONT, TICKER_COLORS, TICKER_COLOR_COUNT, scale);
+    }
+
+    return view->atlas;
+}
+
+static inline gboolean
+is_boxed(const KpTickerEntry *entry) {
+    return entry->text[0] != '\0' && entry->text[1] != '\0';
+}
+
+/**
+ * Write the repeat count of an entry, e.g. "×3", into a buffer of at least 16 bytes.
+ */
+static inline void
+format_repeats(const KpTickerEntry *entry, gchar *buffer) {
+    if (entry->repeats == 0) {
+        buffer[0] = '\0';
+    } else {
+        g_snprintf(buffer, 16, "%c%u", KP_GLYPH_TIMES, entry->repeats + 1);
+    }
+}
+
+static gint
+get_entry_width(const KpGlyphAtlas *atlas, const KpTickerEntry *entry) {
+    gchar repeats[16];
+
+    format_repeats(entry, repeats);
+
+    return kp_glyph_atlas_measure(atlas, entry->text) + kp_glyph_atlas_measure(atlas, repeats)
+           + (is_boxed(entry) ? 2 * TICKER_PADDING : 0);
+}
+
+static void
+draw_box(cairo_t *cr, gdouble x, gdouble y, gdouble width, gdouble height) {
+    cairo_new_sub_path(cr);
+    cairo_arc(cr, x + width - TICKER_CORNER_RADIUS, y + TICKER_CORNER_RADIUS, TICKER_CORNER_RADIUS, -M_PI_2, 0);
+    cairo_arc(cr, x + width - TICKER_CORNER_RADIUS, y + height - TICKER_CORNER_RADIUS, TICKER_CORNER_RADIUS, 0, M_PI_2);
+    cairo_arc(cr, x + TICKER_CORNER_RADIUS, y + height - TICKER_CORNER_RADIUS, TICKER_CORNER_RADIUS, M_PI_2, M_PI);
+    cairo_arc(cr, x + TICKER_CORNER_RADIUS, y + TICKER_CORNER_RADIUS, TICKER_CORNER_RADIUS, M_PI, 3 * M_PI_2);
+    cairo_close_path(cr);
+
+    cairo_set_source_rgba(cr, TICKER_BOX_COLOR[0], TICKER_BOX_COLOR[1], TICKER_BOX_COLOR[2], TICKER_BOX_COLOR[3]);
+    cairo_fill(cr);
+}
+
+static gboolean
+kp_ticker_view_draw(GtkWidget *widget, cairo_t *cr) {
+    KpTickerView *view = KP_TICKER_VIEW(widget);
+    KpGlyphAtlas *atlas = get_atlas(view);
+    guint length = kp_ticker_length(view->ticker);
+    gdouble x = gtk_widget_get_allocated_width(widget) + view->scroll;
+    gdouble height = atlas->line_height + 2 * TICKER_PADDING;
+    gchar repeats[16];
+
+    // Newest keystroke on the right, older ones to the left until the strip is full
+    for (guint age = 0; age < length && x > 0; ++age) {
+        const KpTickerEntry *entry = kp_ticker_get(view->ticker, age);
+        gboolean boxed = is_boxed(entry);
+        gint width = get_entry_width(atlas, entry);
+
+        x -= width;
+        format_repeats(entry, repeats);
+
+        if (boxed) {
+            draw_box(cr, x, 0, width, height);
+        }
+
+        gdouble text_x = x + (boxed ? TICKER_PADDING : 0);
+        guint color = boxed ? TICKER_COLOR_BOXED_TEXT : TICKER_COLOR_TEXT;
+
+        text_x += kp_glyph_atlas_draw(atlas, cr, entry->text, color, text_x, TICKER_PADDING);
+        kp_glyph_atlas_draw(atlas, cr, repeats, color, text_x, TICKER_PADDING);
+
+        if (age + 1 < length) {
+            gboolean joined = !boxed && !is_boxed(kp_ticker_get(view->ticker, age + 1));
+            x -= joined ? TICKER_CHARACTER_GAP : TICKER_GAP;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+on_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer UNUSED(user_data)) {
+    KpTickerView *view = KP_TICKER_VIEW(widget);
+    gdouble progress = (gdouble) (gdk_frame_clock_get_frame_time(frame_clock) - view->scroll_started)
+                       / TICKER_SCROLL_DURATION;
+
+    gtk_widget_queue_draw(widget);
+
+    if (progress >= 1.0) {
+        view->scroll = 0;
+        view->tick_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    // Ease out, the keystroke moves fast at first and settles softly
+    view->scroll = view->scroll_from * pow(1.0 - progress, 3);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+kp_ticker_view_get_preferred_width(GtkWidget *UNUSED(widget), gint *minimum, gint *natural) {
+    // The strip takes the width of the keyboard, it is never a reason to make the window wider
+    *minimum = *natural = 0;
+}
+
+static void
+kp_ticker_view_get_preferred_height(GtkWidget *widget, gint *minimum, gint *natural) {
+    *minimum = *natural = get_atlas(KP_TICKER_VIEW(widget))->line_height + 2 * TICKER_PADDING;
+}
+
+static void
+kp_ticker_view_finalize(GObject *object) {
+    KpTickerView *view = KP_TICKER_VIEW(object);
+
+    g_clear_pointer(&view->atlas, kp_glyph_atlas_free);
+
+    G_OBJECT_CLASS(kp_ticker_view_parent_class)->finalize(object);
+}
+
+static void
+kp_ticker_view_class_init(KpTickerViewClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+
+    object_class->finalize = kp_ticker_view_finalize;
+
+    widget_class->draw = kp_ticker_view_draw;
+    widget_class->get_preferred_width = kp_ticker_view_get_preferred_width;
+    widget_class->get_preferred_height = kp_ticker_view_get_preferred_height;
+}
+
+static void
+kp_ticker_view_init(KpTickerView *UNUSED(view)) {
+}
+
+GtkWidget *
+kp_ticker_view_new(KpTicker *ticker) {
+    KpTickerView *view = g_object_new(KP_TYPE_TICKER_VIEW, NULL);
+
+    view->ticker = ticker;
+
+    return GTK_WIDGET(view);
+}
+
+void
+kp_ticker_view_entry_pushed(KpTickerView *view) {
+    if (!gtk_widget_get_realized(GTK_WIDGET(view)) || kp_ticker_length(view->ticker) == 0) {
+        return;
+    }
+
+    // Keystrokes which arrive while one is still scrolling in add to the distance, so nothing jumps
+    view->scroll_from = view->scroll + get_entry_width(get_atlas(view), kp_ticker_get(view->ticker, 0)) + TICKER_GAP;
+    view->scroll = view->scroll_from;
+    view->scroll_started = g_get_monotonic_time();
+
+    if (view->tick_id == 0) {
+        view->tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(view), on_tick, NULL, NULL);
+    }
+
+    gtk_widget_queue_draw(GTK_WIDGET(view));
+}
+
+void
+kp_ticker_view_entry_changed(KpTickerView *view) {
+    gtk_widget_queue_draw(GTK_WIDGET(view));
+}
+
+#undef TICKER_FONT
+#undef TICKER_PADDING
+#undef TICKER_GAP
+#undef TICKER_CHARACTER_GAP
+#undef TICKER_CORNER_RADIUS
+#undef TICKER_SCROLL_DURATION
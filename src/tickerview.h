@@ -0,0 +1,55 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file tickerview.h
+ * @brief Widget which shows the last keystrokes and chords as a scrolling strip of text
+ */
+
+#ifndef KEYPRESENTER_TICKERVIEW_H
+#define KEYPRESENTER_TICKERVIEW_H
+
+#include <gtk/gtk.h>
+
+#include "ticker.h"
+
+G_BEGIN_DECLS
+
+#define KP_TYPE_TICKER_VIEW (kp_ticker_view_get_type())
+G_DECLARE_FINAL_TYPE(KpTickerView, kp_ticker_view, KP, TICKER_VIEW, GtkDrawingArea)
+
+/**
+ * @param ticker Keystrokes to show, must outlive the widget. Several views can share one ticker.
+ */
+GtkWidget *
+kp_ticker_view_new(KpTicker *ticker);
+
+/**
+ * Scroll in the newest entry of the ticker from the right, after it has been pushed.
+ */
+void
+kp_ticker_view_entry_pushed(KpTickerView *view);
+
+/**
+ * Redraw the strip after the newest entry of the ticker has been repeated.
+ */
+void
+kp_ticker_view_entry_changed(KpTickerView *view);
+
+G_END_DECLS
+
+#endif //KEYPRESENTER_TICKERVIEW_H
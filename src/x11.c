@@ -20,29 +20,279 @@
  * @brief Xinput (libXi) implementation for keyboard-related methods
  */
 
+#include <dirent.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <gtk/gtk.h>
 #include <X11/XKBlib.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/XInput2.h>
 
 #include "keypresenter/key.h"
+#include "keypresenter/keyboard.h"
 #include "macro.h"
 #include "polltaskresult.h"
 #include "x11.h"
 
-#ifndef DEFAULT_KEY_ANIMATION_TIMEOUT
-#define DEFAULT_KEY_ANIMATION_TIMEOUT 300
+#ifndef DEFAULT_POLL_MAX_EVENTS
+#define DEFAULT_POLL_MAX_EVENTS 16
 #endif
 
-static const gchar DEFAULT_LATIN_ALLOWED_CHARACTERS[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9', '0',
-                                                         'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
-                                                         'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't',
-                                                         'u', 'v', 'w', 'x', 'y', 'z'};
+#ifndef DEFAULT_DISPLAY_PROBE_THREADS
+#define DEFAULT_DISPLAY_PROBE_THREADS 8
+#endif
+
+/**
+ * Time in milliseconds kp_keyboard_init waits for displays to answer
+ */
+#ifndef DEFAULT_DISPLAY_PROBE_TIMEOUT
+#define DEFAULT_DISPLAY_PROBE_TIMEOUT 250
+#endif
+
+/**
+ * epoll data of the cancellation and probe fds, display fds carry a pointer to their KpX11Connection
+ */
+static gchar POLL_CANCEL_TAG;
+static gchar POLL_PROBE_TAG;
+
+/**
+ * (Re)build the keycode lookup table of the display with one XGetKeyboardMapping request.
+ * Every keycode gets the first allowed keysym of all its groups and levels, or the first keysym if none is allowed.
+ * The displayed flags are kept, since they describe which keys the user interface shows.
+ */
+static void
+build_keymap(Display *display, KpX11Keymap *keymap) {
+    int min_keycode, max_keycode, keysyms_per_keycode = 0;
+    XDisplayKeycodes(display, &min_keycode, &max_keycode);
+
+    KeySym *keysyms = XGetKeyboardMapping(display, min_keycode, max_keycode - min_keycode + 1, &keysyms_per_keycode);
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        KeySym keysym = NoSymbol;
+
+        if (keysyms != NULL && keycode >= min_keycode && keycode <= max_keycode) {
+            KeySym *row = &keysyms[(keycode - min_keycode) * keysyms_per_keycode];
+
+            keysym = row[0];
+            for (int level = 0; level < keysyms_per_keycode; ++level) {
+                if (kp_x11_keysym_is_allowed(row[level])) {
+                    keysym = row[level];
+                    break;
+                }
+            }
+        }
+
+        kp_x11_keymap_entry_set_keysym(&keymap->entries[keycode], keysym);
+    }
+
+    if (keysyms != NULL) {
+        XFree(keysyms);
+    }
+}
+
+static void
+connection_free(KpX11Connection *connection) {
+    if (connection == NULL) {
+        return;
+    }
+
+    XCloseDisplay(connection->display);
+    g_free(connection);
+}
+
+static KpX11ProbeQueue *
+probe_queue_new(void) {
+    KpX11ProbeQueue *queue = g_new0(KpX11ProbeQueue, 1);
+
+    queue->ref_count = 1;
+    queue->results = g_async_queue_new();
+    queue->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    return queue;
+}
+
+static KpX11ProbeQueue *
+probe_queue_ref(KpX11ProbeQueue *queue) {
+    g_atomic_int_inc(&queue->ref_count);
+
+    return queue;
+}
+
+static void
+probe_free(KpX11Probe *probe) {
+    connection_free(probe->connection);
+    g_free(probe->display_name);
+    g_free(probe);
+}
+
+static void
+probe_queue_unref(KpX11ProbeQueue *queue) {
+    if (!g_atomic_int_dec_and_test(&queue->ref_count)) {
+        return;
+    }
+
+    KpX11Probe *probe;
+    while ((probe = g_async_queue_try_pop(queue->results)) != NULL) {
+        probe_free(probe);
+    }
+
+    g_async_queue_unref(queue->results);
+    if (queue->event_fd >= 0) {
+        close(queue->event_fd);
+    }
+    g_free(queue);
+}
+
+/**
+ * Connect to a display and select the events the poll task listens for.
+ *
+ * @param features KpKeyboardFeatures mask which decides which events are selected
+ * @return The connection, or NULL if the display is not usable
+ */
+static KpX11Connection *
+open_connection(const gchar *display_name, KpKeyboardFeatures features) {
+    Display *display = XOpenDisplay(display_name);
+
+    if (display == NULL) {
+        fprintf(stderr, "Display %s not available.\n", display_name);
+        return NULL;
+    }
+
+    KpX11Connection *connection = g_new0(KpX11Connection, 1);
+    connection->display = display;
+
+    int queryEvent, queryError;
+    if (!XQueryExtension(display, "XInputExtension", &connection->xi_extension_opcode, &queryEvent, &queryError)) {
+        fprintf(stderr, "X Input extension not available for display %s.\n", display_name);
+        connection_free(connection);
+        return NULL;
+    }
+
+#ifndef NDEBUG
+    fprintf(stderr, "Found valid display %s\n", display_name);
+#endif
+
+    Window root = DefaultRootWindow(display);
+    unsigned char hierarchy_mask[XIMaskLen(XI_HierarchyChanged)] = {0};
+    XIEventMask m, masks[2];
+    m.deviceid = XIAllMasterDevices;
+    m.mask_len = XIMaskLen(XI_LASTEVENT);
+    m.mask = calloc(m.mask_len, sizeof(char));
+    XISetMask(m.mask, XI_RawKeyPress);
+    XISetMask(m.mask, XI_RawKeyRelease);
+
+    // Raw motion is an event type of its own, so selecting the buttons never floods the poll task with pointer motion
+    if (features & KP_KEYBOARD_FEATURE_BUTTONS) {
+        XISetMask(m.mask, XI_RawButtonPress);
+        XISetMask(m.mask, XI_RawButtonRelease);
+    }
+
+    // Hierarchy changes are only delivered to selections for all devices
+    XISetMask(hierarchy_mask, XI_HierarchyChanged);
+    masks[0] = m;
+    masks[1] = (XIEventMask) {.deviceid = XIAllDevices, .mask_len = sizeof(hierarchy_mask), .mask = hierarchy_mask};
+    XISelectEvents(display, root, masks, 2);
+
+    // Slaves which are plugged in later are added by XI_HierarchyChanged, selected before this query so none is missed
+    int device_count;
+    XIDeviceInfo *devices = XIQueryDevice(display, XIAllDevices, &device_count);
+    for (int i = 0; i < device_count; ++i) {
+        if (devices[i].use == XISlaveKeyboard && devices[i].enabled) {
+            kp_x11_device_table_add(&connection->devices, devices[i].deviceid);
+        }
+    }
+    XIFreeDeviceInfo(devices);
+
+    int xkb_opcode, xkb_error_base, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (XkbQueryExtension(display, &xkb_opcode, &connection->xkb_event_base, &xkb_error_base, &xkb_major, &xkb_minor)) {
+        XkbSelectEvents(display, XkbUseCoreKbd,
+                        XkbNewKeyboardNotifyMask | XkbMapNotifyMask,
+                        XkbNewKeyboardNotifyMask | XkbMapNotifyMask);
+    } else {
+        connection->xkb_event_base = -1;
+    }
+
+    build_keymap(display, &connection->keymap);
+
+    XSync(display, FALSE);
+    free(m.mask);
+
+#ifndef NDEBUG
+    fprintf(stdout, "Using configured display %s\n", display_name);
+#endif
+
+    return connection;
+}
+
+/**
+ * GThreadPool worker which probes one display and hands the result to the probe queue.
+ */
+static void
+probe_display(gpointer probe_p, gpointer UNUSED(user_data)) {
+    KpX11Probe *probe = probe_p;
+    KpX11ProbeQueue *queue = probe->queue;
+    uint64_t value = 1;
+
+    if (!g_atomic_int_get(&queue->cancelled)) {
+        probe->connection = open_connection(probe->display_name, probe->features);
+    }
+
+    // The probe belongs to the queue from now on, it may be freed by the consumer at any time.
+    g_async_queue_push(queue->results, probe);
+    if (write(queue->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Could not announce probe result: %s\n", g_strerror(errno));
+    }
+
+    probe_queue_unref(queue);
+}
+
+/**
+ * Add the connection of a finished probe to the keyboard data and free the probe.
+ *
+ * @param mark_displayed Mark allowed keys as displayed, for displays which are attached after kp_keyboard_get_keys
+ * @return The attached connection, or NULL if the display was not usable
+ */
+static KpX11Connection *
+attach_probe(KpX11KeyboardData *data, KpX11Probe *probe, gboolean mark_displayed) {
+    KpX11Connection *connection = probe->connection;
+
+    data->probes_pending--;
+
+    if (connection != NULL) {
+        if (mark_displayed) {
+            for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+                KpX11KeymapEntry *entry = &connection->keymap.entries[keycode];
+                entry->displayed = entry->label != NULL && kp_x11_keysym_is_allowed(entry->keysym);
+            }
+        }
+
+        connection->index = data->connections->len;
+        g_ptr_array_add(data->connections, connection);
+        probe->connection = NULL;
+
+        g_mutex_lock(&data->display_lock);
+        g_ptr_array_add(data->display_names, g_strdup(DisplayString(connection->display)));
+        g_mutex_unlock(&data->display_lock);
+    }
+
+    probe_free(probe);
+
+    return connection;
+}
 
 gpointer
-kp_keyboard_init(GtkWindow *UNUSED(window)) {
+kp_keyboard_init(GtkWindow *UNUSED(window), KpKeyboardFeatures features) {
     KpX11KeyboardData *data = g_new0(KpX11KeyboardData, 1);
-    data->displays = g_array_new(TRUE, TRUE, sizeof(Display*));
+    data->connections = g_ptr_array_new();
+    data->display_names = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_init(&data->display_lock);
+    data->features = features;
+    data->probe_queue = probe_queue_new();
+    data->probe_pool = g_thread_pool_new(probe_display, NULL, DEFAULT_DISPLAY_PROBE_THREADS, FALSE, NULL);
 
     DIR* d = opendir("/tmp/.X11-unix");
 
@@ -52,166 +302,449 @@ kp_keyboard_init(GtkWindow *UNUSED(window)) {
             if (dr->d_name[0] != 'X')
                 continue;
 
-            char display_name[64] = ":";
-            strcat(display_name, dr->d_name + 1);
-
-            Display *display = XOpenDisplay(display_name);
+            KpX11Probe *probe = g_new0(KpX11Probe, 1);
+            probe->display_name = g_strconcat(":", dr->d_name + 1, NULL);
+            probe->queue = probe_queue_ref(data->probe_queue);
+            probe->features = features;
 
-            if (display == NULL) {
-                fprintf(stderr, "Display %s not available.\n", display_name);
-                continue;
-            }
+            data->probes_pending++;
+            g_thread_pool_push(data->probe_pool, probe, NULL);
+        }
 
-            int xiOpcode, queryEvent, queryError;
-            if (!XQueryExtension(display, "XInputExtension", &xiOpcode, &queryEvent, &queryError)) {
-                fprintf(stderr, "X Input extension not available for display %s.\n", display_name);
-                continue;
-            }
-            data->xi_extension_opcode = xiOpcode;
+        closedir(d);
+    }
 
-#ifdef NDEBUG
-            fprintf(stderr, "Found valid display %s", display_name);
-#endif
+    // Displays which do not answer before the deadline are attached by the poll task later on.
+    gint64 deadline = g_get_monotonic_time() + DEFAULT_DISPLAY_PROBE_TIMEOUT * G_TIME_SPAN_MILLISECOND;
 
-            Window root = DefaultRootWindow(display);
-            XIEventMask m;
-            m.deviceid = XIAllMasterDevices;
-            m.mask_len = XIMaskLen(XI_LASTEVENT);
-            m.mask = calloc(m.mask_len, sizeof(char));
-            XISetMask(m.mask, XI_RawKeyPress);
-            XISetMask(m.mask, XI_RawKeyRelease);
-            XISelectEvents(display, root, &m, 1);
-            XSync(display, FALSE);
-            free(m.mask);
-
-#ifdef NDEBUG
-            fprintf(stdout, "Using configured display %s", display_name);
-#endif
+    while (data->probes_pending > 0) {
+        gint64 remaining = deadline - g_get_monotonic_time();
+        if (remaining <= 0) break;
 
-            g_array_append_val(data->displays, display);
-        }
+        KpX11Probe *probe = g_async_queue_timeout_pop(data->probe_queue->results, remaining);
+        if (probe == NULL) break;
 
-        closedir(d);
+        attach_probe(data, probe, FALSE);
     }
 
     return data;
 }
 
-GArray *
-kp_keyboard_get_keys(GtkWindow *UNUSED(window), gpointer internal_keyboard_data) {
-    GArray *result = g_array_new(TRUE, TRUE, sizeof(KpKey*));
-    GHashTable *hash_table = g_hash_table_new(g_int64_hash, g_int64_equal);
+gchar *
+kp_keyboard_get_layout_name(gpointer internal_keyboard_data) {
     KpX11KeyboardData *data = X11_KEYBOARD_DATA(internal_keyboard_data);
+    Atom type;
+    int format;
+    unsigned long length, remaining;
+    unsigned char *value = NULL;
+    gchar *layout = NULL;
+
+    if (data->connections->len == 0) {
+        return NULL;
+    }
 
-    for (int i = 0; i < data->displays->len; ++i) {
-        Display *display = g_array_index(data->displays, Display*, i);
+    Display *display = ((KpX11Connection *) g_ptr_array_index(data->connections, 0))->display;
+    Atom rules_names = XInternAtom(display, X11_XKB_RULES_NAMES, True);
 
-        int min_keycodes_return, max_keycodes_return;
-        XDisplayKeycodes(display, &min_keycodes_return, &max_keycodes_return);
+    if (rules_names != None
+        && XGetWindowProperty(display, DefaultRootWindow(display), rules_names, 0, 1024, False, XA_STRING,
+                              &type, &format, &length, &remaining, &value) == Success
+        && type == XA_STRING && format == 8) {
+        layout = kp_x11_rules_names_get_layout((const gchar *) value, length);
+    }
 
-        int keycode_count = max_keycodes_return - min_keycodes_return - 1,
-            keysyms_per_keycode_return;
-        KeySym *keysyms = XGetKeyboardMapping(display, min_keycodes_return, keycode_count, &keysyms_per_keycode_return);
+    if (value != NULL) {
+        XFree(value);
+    }
+
+    return layout;
+}
 
-        for (int j = 0; j < (keycode_count * keysyms_per_keycode_return); ++j) {
-            KeySym keysym = keysyms[j];
-            KeyCode keycode = XKeysymToKeycode(display, keysym);
-            gchar *key_str = XKeysymToString(keysym);
+guint
+kp_keyboard_get_display_count(gpointer internal_keyboard_data) {
+    KpX11KeyboardData *data = X11_KEYBOARD_DATA(internal_keyboard_data);
 
-            if (NULL == key_str) continue;
-            if (!XkbIsLegalKeycode(keycode)) continue;
+    g_mutex_lock(&data->display_lock);
+    guint count = data->display_names->len;
+    g_mutex_unlock(&data->display_lock);
 
-            if (g_hash_table_contains(hash_table, &keycode)) continue;
-            g_hash_table_add(hash_table, &keycode);
+    return count;
+}
 
-            for (int k = 0; k < strlen(DEFAULT_LATIN_ALLOWED_CHARACTERS); k++) {
-                gchar key_label = DEFAULT_LATIN_ALLOWED_CHARACTERS[k];
+const gchar *
+kp_keyboard_get_display_name(gpointer internal_keyboard_data, guint index) {
+    KpX11KeyboardData *data = X11_KEYBOARD_DATA(internal_keyboard_data);
+    const gchar *display_name = NULL;
 
-                if (key_label == key_str[0] && key_str[1] == '\0'
-                    || g_strcmp0("space", key_str) == 0 ) {
-                    KpKey *key = g_new0(KpKey, 1);
-                    key->label = key_str;
-                    key->code = keycode;
+    // The array may be reallocated by the poll task, the names themselves stay where they are
+    g_mutex_lock(&data->display_lock);
+    if (index < data->display_names->len) {
+        display_name = g_ptr_array_index(data->display_names, index);
+    }
+    g_mutex_unlock(&data->display_lock);
 
-                    g_array_append_val(result, key);
-                    break;
-                }
-            }
+    return display_name;
+}
+
+KpKeyModel *
+kp_keyboard_get_keys(GtkWindow *UNUSED(window), gpointer internal_keyboard_data) {
+    KpKeyModel *result = kp_key_model_new();
+    KpX11KeyboardData *data = X11_KEYBOARD_DATA(internal_keyboard_data);
+
+    // The keymaps already hold the XGetKeyboardMapping result, and the model rejects keycodes it already contains.
+    for (guint i = 0; i < data->connections->len; ++i) {
+        KpX11Connection *connection = g_ptr_array_index(data->connections, i);
+
+        for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+            KpX11KeymapEntry *entry = &connection->keymap.entries[keycode];
+
+            if (!XkbIsLegalKeycode(keycode) || entry->label == NULL || !kp_x11_keysym_is_allowed(entry->keysym)) continue;
+
+            entry->displayed = TRUE;
+            kp_key_model_add(result, keycode, entry->label);
         }
     }
 
-    g_hash_table_destroy(hash_table);
+    if (data->features & KP_KEYBOARD_FEATURE_BUTTONS) {
+        for (int button = 1; button < KP_KEY_BUTTON_COUNT; ++button) {
+            kp_key_model_add(result, button, X11_BUTTON_LABELS[button]);
+        }
+    }
 
     return result;
 }
 
-static gboolean
-on_toggle_button_idle_reset(gpointer button) {
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), FALSE);
+/**
+ * Refresh the keymap after the server has announced a mapping change,
+ * and send the new labels of displayed keys to the user interface.
+ */
+static void
+on_keymap_changed(KpPollTaskResult *result, KpX11Connection *connection) {
+    KpX11Keymap *keymap = &connection->keymap;
+    gchar *old_labels[X11_KEYMAP_SIZE];
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        old_labels[keycode] = keymap->entries[keycode].label;
+    }
+
+    build_keymap(connection->display, keymap);
+    connection->keymap_refreshes++;
 
-    return G_SOURCE_REMOVE;
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        KpX11KeymapEntry *entry = &keymap->entries[keycode];
+
+        if (!entry->displayed || entry->label == NULL || g_strcmp0(entry->label, old_labels[keycode]) == 0) continue;
+
+        KpKeyboardPoll poll = {
+                .result = POLL_KEYMAP_CHANGED,
+                .key = {.code = keycode, .label = entry->label, .modifier = entry->modifier},
+                .pressed = FALSE,
+                .display = connection->index,
+        };
+
+        kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+    }
 }
 
-static gboolean
-on_poll_task_result(gpointer poll_task_result) {
-    KpPollTaskResult *result = poll_task_result;
+/**
+ * Update the device table for slaves which have been added, removed, enabled or disabled.
+ */
+static void
+on_hierarchy_changed(KpX11Connection *connection, XIHierarchyEvent *event) {
+    for (int i = 0; i < event->num_info; ++i) {
+        XIHierarchyInfo *info = &event->info[i];
+
+        if (info->flags & (XISlaveRemoved | XIDeviceDisabled)) {
+            kp_x11_device_table_remove(&connection->devices, info->deviceid);
+        } else if (info->flags & (XISlaveAdded | XIDeviceEnabled) && info->use == XISlaveKeyboard && info->enabled) {
+            kp_x11_device_table_add(&connection->devices, info->deviceid);
+        }
+    }
+}
 
-#ifdef NDEBUG
-    fprintf(stderr, "%s key %s (%d).\n", result->poll.pressed ? "Pressed" : "Released", result->poll.key.label, result->poll.key.code);
-#endif
+static void
+dispatch_event(KpPollTaskResult *result, KpX11Connection *connection, XEvent *event) {
+    Display *display = connection->display;
+    XGenericEventCookie *cookie = (XGenericEventCookie *) &event->xcookie;
 
-    if (result->poll.pressed) {
-        GtkWidget *button = g_hash_table_lookup(result->key_button_table, &result->poll.key.code);
+    connection->events_received++;
+    kp_stats_count_event(result->stats, connection->index);
 
-        if (GTK_IS_TOGGLE_BUTTON(button)) {
-            gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), TRUE);
-            g_timeout_add(DEFAULT_KEY_ANIMATION_TIMEOUT, on_toggle_button_idle_reset, button);
+    if (event->type == MappingNotify) {
+        XRefreshKeyboardMapping(&event->xmapping);
+
+        if (event->xmapping.request == MappingKeyboard) {
+            on_keymap_changed(result, connection);
         }
+        return;
     }
 
-    return G_SOURCE_REMOVE;
+    if (event->type == connection->xkb_event_base) {
+        XkbEvent *xkb_event = (XkbEvent *) event;
+
+        switch (xkb_event->any.xkb_type) {
+            case XkbMapNotify:
+                XkbRefreshKeyboardMapping(&xkb_event->map);
+                // fall through
+            case XkbNewKeyboardNotify:
+                on_keymap_changed(result, connection);
+        }
+        return;
+    }
+
+    if (event->type != GenericEvent || event->xcookie.extension != connection->xi_extension_opcode) {
+        return;
+    }
+
+    if (!XGetEventData(display, cookie)) {
+        return;
+    }
+
+    switch (cookie->evtype) {
+        case XI_RawKeyRelease:
+        case XI_RawKeyPress: {
+            XIRawEvent *ev = cookie->data;
+
+            // Keycodes are 8 bits wide on the wire, but guard the table anyway
+            if (ev->detail < 0 || ev->detail >= X11_KEYMAP_SIZE) break;
+
+            KpX11KeymapEntry *entry = &connection->keymap.entries[ev->detail];
+            if (NULL == entry->label) break;
+
+            KpKeyboardPoll poll = {
+                    .result = POLL_OK,
+                    .key = {.code = ev->detail, .label = entry->label, .modifier = entry->modifier},
+                    .pressed = cookie->evtype == XI_RawKeyPress ? TRUE : FALSE,
+                    .time = ev->time,
+                    .display = connection->index,
+                    .device = kp_x11_device_table_get_slot(&connection->devices, ev->sourceid),
+            };
+
+            connection->key_events++;
+            kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+            break;
+        }
+        case XI_RawButtonRelease:
+        case XI_RawButtonPress: {
+            XIRawEvent *ev = cookie->data;
+
+            if (!kp_key_is_button(ev->detail)) break;
+
+            KpKeyboardPoll poll = {
+                    .result = POLL_OK,
+                    .key = {.code = ev->detail, .label = X11_BUTTON_LABELS[ev->detail]},
+                    .pressed = cookie->evtype == XI_RawButtonPress ? TRUE : FALSE,
+                    .time = ev->time,
+                    .display = connection->index,
+            };
+
+            connection->button_events++;
+            kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+            break;
+        }
+        case XI_HierarchyChanged:
+            on_hierarchy_changed(connection, cookie->data);
+    }
+
+    XFreeEventData(display, cookie);
+}
+
+/**
+ * Dispatch every event which is queued on the display, including the ones Xlib has already read into its own buffer.
+ * When this returns, the connection's fd will only become readable again when the server sends something new.
+ *
+ * While the event ring is full, dispatching waits for the main loop. The server keeps queuing events on the
+ * socket meanwhile, so a slow main loop delays events instead of losing them.
+ */
+static void
+dispatch_pending_events(KpPollTaskResult *result, KpX11Connection *connection) {
+    while (XPending(connection->display) > 0) {
+        XEvent event;
+        XNextEvent(connection->display, &event);
+        dispatch_event(result, connection, &event);
+    }
+
+    kp_event_ring_notify(result->event_ring);
+}
+
+/**
+ * Start listening for events of a display and dispatch the events which were queued before.
+ */
+static void
+watch_connection(KpPollTaskResult *result, int epoll_fd, KpX11Connection *connection) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ConnectionNumber(connection->display), &event) < 0) {
+        fprintf(stderr, "Could not watch display %s: %s\n", DisplayString(connection->display), g_strerror(errno));
+    }
+
+    // Events may have been queued while the display was being configured.
+    dispatch_pending_events(result, connection);
+}
+
+/**
+ * Tell the user interface about a display which has been attached after kp_keyboard_get_keys, and about its keys.
+ */
+static void
+announce_connection(KpPollTaskResult *result, KpX11Connection *connection) {
+    KpKeyboardPoll poll = {.result = POLL_DISPLAY_ADDED, .display = connection->index};
+
+    kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        KpX11KeymapEntry *entry = &connection->keymap.entries[keycode];
+
+        if (!entry->displayed) continue;
+
+        poll = (KpKeyboardPoll) {
+                .result = POLL_KEY_ADDED,
+                .key = {.code = keycode, .label = entry->label, .modifier = entry->modifier},
+                .display = connection->index,
+        };
+
+        kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+    }
+}
+
+/**
+ * Attach the displays whose probes have finished after kp_keyboard_init stopped waiting for them.
+ */
+static void
+attach_late_connections(KpPollTaskResult *result, int epoll_fd) {
+    KpX11KeyboardData *keyboard_data = X11_KEYBOARD_DATA(result->keyboard_data);
+    KpX11Probe *probe;
+    uint64_t value;
+
+    while (read(keyboard_data->probe_queue->event_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+
+    while ((probe = g_async_queue_try_pop(keyboard_data->probe_queue->results)) != NULL) {
+        KpX11Connection *connection = attach_probe(keyboard_data, probe, TRUE);
+
+        if (connection != NULL) {
+            // Announced first, so the key model has the keys before their first events arrive
+            announce_connection(result, connection);
+            watch_connection(result, epoll_fd, connection);
+        }
+    }
+}
+
+/**
+ * Stop waiting for probes, displays which are still being probed are closed when their probe finishes.
+ */
+static void
+stop_probes(KpX11KeyboardData *keyboard_data) {
+    if (keyboard_data->probe_queue == NULL) {
+        return;
+    }
+
+    g_atomic_int_set(&keyboard_data->probe_queue->cancelled, TRUE);
+
+    // Do not wait: a probe may be stuck connecting to an unresponsive server.
+    g_thread_pool_free(keyboard_data->probe_pool, FALSE, FALSE);
+    probe_queue_unref(keyboard_data->probe_queue);
+
+    keyboard_data->probe_pool = NULL;
+    keyboard_data->probe_queue = NULL;
+}
+
+/**
+ * Close every display, the poll task is the last user of the connections.
+ */
+static void
+close_connections(KpX11KeyboardData *keyboard_data) {
+    stop_probes(keyboard_data);
+
+    for (guint i = 0; i < keyboard_data->connections->len; ++i) {
+        connection_free(g_ptr_array_index(keyboard_data->connections, i));
+    }
+
+    g_ptr_array_set_size(keyboard_data->connections, 0);
 }
 
 void
 kp_keyboard_poll_task(GTask *task, gpointer UNUSED(source_obj), gpointer poll_task_result, GCancellable *cancellable) {
     KpPollTaskResult *result = poll_task_result;
     KpX11KeyboardData *keyboard_data = X11_KEYBOARD_DATA(result->keyboard_data);
+    struct epoll_event ready_events[DEFAULT_POLL_MAX_EVENTS];
+    GError *error = NULL;
+    int cancel_fd = -1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        close_connections(keyboard_data);
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(errno),
+                                "Could not create epoll instance: %s", g_strerror(errno));
+        return;
+    }
+
+    // Wake up as soon as the task is cancelled, instead of after the next X event.
+    cancel_fd = g_cancellable_get_fd(cancellable);
+    if (cancel_fd >= 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &POLL_CANCEL_TAG};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cancel_fd, &event) < 0) {
+            fprintf(stderr, "Could not watch cancellation fd: %s\n", g_strerror(errno));
+        }
+    }
+
+    if (keyboard_data->probes_pending > 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &POLL_PROBE_TAG};
 
-    while ("forever") {
-        if (g_cancellable_is_cancelled (cancellable)) {
-            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Task cancelled");
-            return;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, keyboard_data->probe_queue->event_fd, &event) < 0) {
+            fprintf(stderr, "Could not watch display probes: %s\n", g_strerror(errno));
         }
+    }
 
-        for (int i = 0; i < keyboard_data->displays->len; ++i) {
-            Display *display = g_array_index(keyboard_data->displays, Display*, i);
+    for (guint i = 0; i < keyboard_data->connections->len; ++i) {
+        watch_connection(result, epoll_fd, g_ptr_array_index(keyboard_data->connections, i));
+    }
 
-            XEvent event;
-            XGenericEventCookie *cookie = (XGenericEventCookie *) &event.xcookie;
-            XNextEvent(display, &event);
+    while (!g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        int ready_count = epoll_wait(epoll_fd, ready_events, DEFAULT_POLL_MAX_EVENTS, -1);
 
-            if (XGetEventData(display, cookie) &&
-                cookie->type == GenericEvent &&
-                cookie->extension == keyboard_data->xi_extension_opcode) {
-                switch (cookie->evtype) {
-                    case XI_RawKeyRelease:
-                    case XI_RawKeyPress: {
-                        XIRawEvent *ev = cookie->data;
+        if (ready_count < 0) {
+            if (errno == EINTR) continue;
 
-                        // Ask X what it calls that key
-                        KeySym keysym = XkbKeycodeToKeysym(display, ev->detail, 0, 0);
-                        if (NoSymbol == keysym) continue;
-                        gchar *key_str = XKeysymToString(keysym);
-                        if (NULL == key_str) continue;
+            g_set_error(&error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Could not wait for display events: %s", g_strerror(errno));
+            break;
+        }
 
-                        result->poll.key.code = ev->detail;
-                        result->poll.key.label = key_str;
-                        result->poll.pressed = cookie->evtype == XI_RawKeyPress ? TRUE : FALSE;
+        for (int i = 0; i < ready_count; ++i) {
+            gpointer tag = ready_events[i].data.ptr;
 
-                        g_main_context_invoke(NULL, on_poll_task_result, result);
-                    }
-                }
+            if (tag == &POLL_CANCEL_TAG) continue;
+
+            if (tag == &POLL_PROBE_TAG) {
+                attach_late_connections(result, epoll_fd);
+                continue;
             }
+
+            dispatch_pending_events(result, tag);
         }
     }
-}
\ No newline at end of file
+
+    if (cancel_fd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+
+    close(epoll_fd);
+    close_connections(keyboard_data);
+
+    g_task_return_error(task, error);
+}
+
+void
+kp_keyboard_free(gpointer internal_keyboard_data) {
+    KpX11KeyboardData *data = X11_KEYBOARD_DATA(internal_keyboard_data);
+
+    if (data == NULL) {
+        return;
+    }
+
+    close_connections(data);
+    g_ptr_array_unref(data->connections);
+    g_ptr_array_unref(data->display_names);
+    g_mutex_clear(&data->display_lock);
+    g_free(data);
+}
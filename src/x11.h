@@ -23,20 +23,120 @@
 #ifndef KEYPRESENTER_X11_H
 #define KEYPRESENTER_X11_H
 
+#include <glib.h>
+#include <X11/Xlib.h>
+
+#include <keypresenter/keyboard.h>
+#include "x11devices.h"
+#include "x11keymap.h"
+
 #define X11_KEYBOARD_DATA(keyboard_data) (((KpX11KeyboardData*) keyboard_data))
 
+typedef struct _X11Connection KpX11Connection;
+typedef struct _X11ProbeQueue KpX11ProbeQueue;
+typedef struct _X11Probe KpX11Probe;
 typedef struct _X11KeyboardData KpX11KeyboardData;
 
-struct _X11KeyboardData {
+/**
+ * Everything the poll task needs to know about one display, so dispatching an event never has to look anything up.
+ */
+struct _X11Connection {
+    Display *display;
+
     /**
-     * LibXi extension opcode
+     * Position of the connection in the connections array
+     */
+    guint index;
+
+    /**
+     * LibXi extension opcode of this display
      */
     int xi_extension_opcode;
 
     /**
-     * An array with Display element type
+     * Base event code of the XKB extension, or -1 if XKB is not available on the display
+     */
+    int xkb_event_base;
+
+    KpX11Keymap keymap;
+
+    /**
+     * Slots of the slave keyboards, kept up to date by XI_HierarchyChanged
+     */
+    KpX11DeviceTable devices;
+
+    /**
+     * Event counters, only written by the thread which owns the connection
+     */
+    guint64 events_received;
+    guint64 key_events;
+    guint64 button_events;
+    guint64 keymap_refreshes;
+};
+
+/**
+ * Results of display probes, shared between the probe workers and the keyboard data.
+ * Reference counted, so a probe which finishes after the keyboard has been freed can still deliver its result.
+ */
+struct _X11ProbeQueue {
+    gint ref_count;
+
+    /**
+     * TRUE once nobody is interested in new results, queued probes then skip connecting
+     */
+    gint cancelled;
+
+    /**
+     * Queue with KpX11Probe pointer element type
+     */
+    GAsyncQueue *results;
+
+    /**
+     * eventfd which is written after every pushed result, so the poll task can wait for it
+     */
+    int event_fd;
+};
+
+struct _X11Probe {
+    gchar *display_name;
+    KpX11ProbeQueue *queue;
+    KpKeyboardFeatures features;
+
+    /**
+     * Configured connection, or NULL if the display is not usable
+     */
+    KpX11Connection *connection;
+};
+
+struct _X11KeyboardData {
+    /**
+     * An array with KpX11Connection pointer element type
+     */
+    GPtrArray *connections;
+
+    /**
+     * KpKeyboardFeatures mask given to kp_keyboard_init
+     */
+    KpKeyboardFeatures features;
+
+    /**
+     * Worker pool which connects to the displays
+     */
+    GThreadPool *probe_pool;
+    KpX11ProbeQueue *probe_queue;
+
+    /**
+     * Amount of probes whose result has not been taken out of the probe queue yet
+     */
+    guint probes_pending;
+
+    /**
+     * Names of the attached displays in the order of the connections, with gchar pointer element type.
+     * The poll task appends displays which answer late, so the user interface reads the names under display_lock.
+     * Names are never removed before kp_keyboard_free.
      */
-    GArray *displays;
+    GPtrArray *display_names;
+    GMutex display_lock;
 };
 
 #endif //KEYPRESENTER_X11_H
@@ -0,0 +1,85 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file x11devices.h
+ * @brief Slots of the physical keyboards of a display, shared by the X11 keyboard backends
+ *
+ * Raw events are selected on the master keyboard, their sourceid tells which slave keyboard produced them.
+ * The table maps that id to a slot in constant time, XI_HierarchyChanged events add and remove slaves.
+ */
+
+#ifndef KEYPRESENTER_X11DEVICES_H
+#define KEYPRESENTER_X11DEVICES_H
+
+#include <glib.h>
+
+#include <keypresenter/poll.h>
+
+/**
+ * XInput device ids are 16 bits wide, but servers hand them out from the bottom up
+ */
+#define X11_DEVICE_ID_COUNT 256
+
+typedef struct _X11DeviceTable KpX11DeviceTable;
+
+struct _X11DeviceTable {
+    /**
+     * Slot per XInput device id, 0 for devices which do not have a slot
+     */
+    guint8 slots[X11_DEVICE_ID_COUNT];
+
+    /**
+     * XInput device id per slot, 0 for free slots. Slot 0 is never handed out.
+     */
+    guint16 devices[KP_POLL_DEVICE_COUNT];
+};
+
+static inline guint8
+kp_x11_device_table_get_slot(const KpX11DeviceTable *table, guint deviceid) {
+    return deviceid < X11_DEVICE_ID_COUNT ? table->slots[deviceid] : 0;
+}
+
+/**
+ * Give a slave keyboard the first free slot. Keyboards which do not fit share slot 0.
+ */
+static inline void
+kp_x11_device_table_add(KpX11DeviceTable *table, guint deviceid) {
+    if (deviceid == 0 || deviceid >= X11_DEVICE_ID_COUNT || table->slots[deviceid] != 0) {
+        return;
+    }
+
+    for (guint slot = 1; slot < KP_POLL_DEVICE_COUNT; ++slot) {
+        if (table->devices[slot] == 0) {
+            table->devices[slot] = deviceid;
+            table->slots[deviceid] = slot;
+            return;
+        }
+    }
+}
+
+static inline void
+kp_x11_device_table_remove(KpX11DeviceTable *table, guint deviceid) {
+    guint8 slot = kp_x11_device_table_get_slot(table, deviceid);
+
+    if (slot != 0) {
+        table->devices[slot] = 0;
+        table->slots[deviceid] = 0;
+    }
+}
+
+#endif //KEYPRESENTER_X11DEVICES_H
@@ -0,0 +1,78 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file x11keymap.c
+ * @brief Keysym lookups shared by the X11 keyboard backends
+ */
+
+#include "x11keymap.h"
+
+/**
+ * XKeysymToString sets up the keysym database of Xlib on first use without any locking, one lock for every caller
+ */
+static GMutex keysym_lock;
+
+gchar *
+kp_x11_keysym_get_label(KeySym keysym) {
+    const gchar *label = NULL;
+
+    if (keysym == NoSymbol) {
+        return NULL;
+    }
+
+    g_mutex_lock(&keysym_lock);
+    char *name = XKeysymToString(keysym);
+
+    if (name != NULL) {
+        gchar *end;
+        label = g_intern_string(name);
+
+        // Names from the keysym tables are static, only the generated Unicode names belong to the caller
+        if (keysym >= 0x1000100 && keysym <= 0x110ffff && name[0] == 'U'
+            && g_ascii_strtoull(name + 1, &end, 16) == keysym - 0x1000000 && *end == '\0') {
+            XFree(name);
+        }
+    }
+    g_mutex_unlock(&keysym_lock);
+
+    return (gchar *) label;
+}
+
+void
+kp_x11_keymap_entry_set_keysym(KpX11KeymapEntry *entry, KeySym keysym) {
+    entry->keysym = keysym;
+    entry->label = kp_x11_keysym_get_label(keysym);
+    entry->modifier = kp_x11_keysym_get_modifier(keysym);
+}
+
+gchar *
+kp_x11_rules_names_get_layout(const gchar *value, gsize length) {
+    const gchar *end = value + length;
+
+    // Skip the rules and the model
+    for (int skip = 0; skip < 2 && value < end; ++value) {
+        if (*value == '\0') skip++;
+    }
+
+    gsize layout_length = 0;
+    while (value + layout_length < end && value[layout_length] != '\0' && value[layout_length] != ',') {
+        layout_length++;
+    }
+
+    return layout_length == 0 ? NULL : g_strndup(value, layout_length);
+}
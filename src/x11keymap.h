@@ -0,0 +1,151 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file x11keymap.h
+ * @brief Keycode lookup tables shared by the X11 keyboard backends
+ */
+
+#ifndef KEYPRESENTER_X11KEYMAP_H
+#define KEYPRESENTER_X11KEYMAP_H
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+#include <keypresenter/key.h>
+
+/**
+ * Amount of entries in a keymap, X11 keycodes are always in the range of 8-255
+ */
+#define X11_KEYMAP_SIZE 256
+
+/**
+ * Root window property in which the server publishes its XKB rules, model, layout, variant and options
+ */
+#define X11_XKB_RULES_NAMES "_XKB_RULES_NAMES"
+
+/**
+ * Bits for an inclusive range of keysyms, which must lie in the same 64-bit word of a keysym bitmap.
+ */
+#define KEYSYM_RANGE_BITS(first, last) ((G_MAXUINT64 >> (63 - ((last) - (first)))) << ((first) & 63))
+
+G_STATIC_ASSERT(XK_0 >> 6 == XK_9 >> 6 && XK_space >> 6 == XK_0 >> 6);
+G_STATIC_ASSERT(XK_a >> 6 == XK_z >> 6);
+
+/**
+ * Bitmap of the Latin-1 keysyms which are shown: digits, lowercase letters and space.
+ */
+static const guint64 DEFAULT_LATIN_ALLOWED_KEYSYMS[256 / 64] = {
+        [XK_0 >> 6] = KEYSYM_RANGE_BITS(XK_0, XK_9) | KEYSYM_RANGE_BITS(XK_space, XK_space),
+        [XK_a >> 6] = KEYSYM_RANGE_BITS(XK_a, XK_z),
+};
+
+/**
+ * Labels of the mouse buttons, indexed by button number
+ */
+static gchar *const X11_BUTTON_LABELS[KP_KEY_BUTTON_COUNT] = {
+        NULL, "Left", "Middle", "Right", "Wheel ↑", "Wheel ↓", "Wheel ←", "Wheel →",
+};
+
+typedef struct _X11KeymapEntry KpX11KeymapEntry;
+typedef struct _X11Keymap KpX11Keymap;
+
+struct _X11KeymapEntry {
+    /**
+     * Keysym of the first group and shift level, or NoSymbol
+     */
+    KeySym keysym;
+
+    /**
+     * Interned name of the keysym, see kp_x11_keysym_get_label. NULL if the keycode has no name.
+     */
+    gchar *label;
+
+    /**
+     * Modifier the keysym belongs to
+     */
+    KpKeyModifier modifier;
+
+    /**
+     * TRUE if kp_keyboard_get_keys has returned this key
+     */
+    gboolean displayed;
+};
+
+struct _X11Keymap {
+    /**
+     * Entries indexed by keycode
+     */
+    KpX11KeymapEntry entries[X11_KEYMAP_SIZE];
+};
+
+static inline gboolean
+kp_x11_keysym_is_allowed(KeySym keysym) {
+    return keysym < 256 && (DEFAULT_LATIN_ALLOWED_KEYSYMS[keysym >> 6] >> (keysym & 63)) & 1;
+}
+
+static inline KpKeyModifier
+kp_x11_keysym_get_modifier(KeySym keysym) {
+    switch (keysym) {
+        case XK_Control_L:
+        case XK_Control_R:
+            return KP_KEY_MODIFIER_CTRL;
+        case XK_Shift_L:
+        case XK_Shift_R:
+            return KP_KEY_MODIFIER_SHIFT;
+        case XK_Alt_L:
+        case XK_Alt_R:
+        case XK_Meta_L:
+        case XK_Meta_R:
+            return KP_KEY_MODIFIER_ALT;
+        case XK_Super_L:
+        case XK_Super_R:
+        case XK_Hyper_L:
+        case XK_Hyper_R:
+            return KP_KEY_MODIFIER_SUPER;
+        default:
+            return KP_KEY_MODIFIER_NONE;
+    }
+}
+
+/**
+ * Look up the name of a keysym, from any thread.
+ * For Unicode keysyms without a name XKeysymToString returns a new string like "U0416", so every name is interned:
+ * each name is allocated once, a label never changes its address and it outlives every keymap refresh,
+ * which lets the key model and the polls in the event ring keep pointing to it.
+ *
+ * @return Interned name, or NULL if the keysym has none
+ */
+gchar *
+kp_x11_keysym_get_label(KeySym keysym);
+
+/**
+ * Store the keysym of a keycode together with its label and modifier.
+ */
+void
+kp_x11_keymap_entry_set_keysym(KpX11KeymapEntry *entry, KeySym keysym);
+
+/**
+ * Take the first layout out of an _XKB_RULES_NAMES value, which holds NUL-separated strings.
+ *
+ * @return New string to be freed with g_free, or NULL if the value holds no layout
+ */
+gchar *
+kp_x11_rules_names_get_layout(const gchar *value, gsize length);
+
+#endif //KEYPRESENTER_X11KEYMAP_H
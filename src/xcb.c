@@ -0,0 +1,716 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file xcb.c
+ * @brief XCB implementation for keyboard-related methods
+ *
+ * Unlike the Xlib backend, no request waits for its reply before the next one is sent.
+ * Every display is set up on a worker thread of its own, so startup costs the connection setup plus two round trips
+ * of the slowest display, but never more than DEFAULT_DISPLAY_PROBE_TIMEOUT. A keymap refresh costs one round trip
+ * which the poll task does not wait for.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <gtk/gtk.h>
+
+#include "keypresenter/key.h"
+#include "keypresenter/keyboard.h"
+#include "macro.h"
+#include "polltaskresult.h"
+#include "xcb.h"
+
+#ifndef DEFAULT_POLL_MAX_EVENTS
+#define DEFAULT_POLL_MAX_EVENTS 16
+#endif
+
+#ifndef DEFAULT_DISPLAY_PROBE_THREADS
+#define DEFAULT_DISPLAY_PROBE_THREADS 8
+#endif
+
+/**
+ * Time in milliseconds kp_keyboard_init waits for displays to answer, displays which are slower are not used
+ */
+#ifndef DEFAULT_DISPLAY_PROBE_TIMEOUT
+#define DEFAULT_DISPLAY_PROBE_TIMEOUT 250
+#endif
+
+/**
+ * epoll data of the cancellation fd, display fds carry a pointer to their KpXcbConnection
+ */
+static gchar POLL_CANCEL_TAG;
+
+static void
+connection_free(KpXcbConnection *connection) {
+    if (connection == NULL) {
+        return;
+    }
+
+    xcb_disconnect(connection->connection);
+    g_free(connection->display_name);
+    g_free(connection);
+}
+
+/**
+ * (Re)build the keycode lookup table of the display from a GetKeyboardMapping reply.
+ * Every keycode gets the first allowed keysym of all its groups and levels, or the first keysym if none is allowed.
+ * The displayed flags are kept, since they describe which keys the user interface shows.
+ */
+static void
+build_keymap(KpXcbConnection *connection, xcb_get_keyboard_mapping_reply_t *reply) {
+    int min_keycode = xcb_get_setup(connection->connection)->min_keycode;
+    int keysyms_per_keycode = reply != NULL ? reply->keysyms_per_keycode : 0;
+    xcb_keysym_t *keysyms = NULL;
+    int keycode_count = 0;
+
+    if (keysyms_per_keycode > 0) {
+        keysyms = xcb_get_keyboard_mapping_keysyms(reply);
+        keycode_count = xcb_get_keyboard_mapping_keysyms_length(reply) / keysyms_per_keycode;
+    }
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        KeySym keysym = NoSymbol;
+
+        if (keysyms != NULL && keycode >= min_keycode && keycode < min_keycode + keycode_count) {
+            xcb_keysym_t *row = &keysyms[(keycode - min_keycode) * keysyms_per_keycode];
+
+            keysym = row[0];
+            for (int level = 0; level < keysyms_per_keycode; ++level) {
+                if (kp_x11_keysym_is_allowed(row[level])) {
+                    keysym = row[level];
+                    break;
+                }
+            }
+        }
+
+        kp_x11_keymap_entry_set_keysym(&connection->keymap.entries[keycode], keysym);
+    }
+}
+
+/**
+ * Send a GetKeyboardMapping request for every keycode of the display, without flushing it.
+ */
+static void
+send_keymap_request(KpXcbConnection *connection) {
+    const xcb_setup_t *setup = xcb_get_setup(connection->connection);
+
+    connection->mapping_cookie = xcb_get_keyboard_mapping(connection->connection, setup->min_keycode,
+                                                          setup->max_keycode - setup->min_keycode + 1);
+    connection->mapping_pending = TRUE;
+    connection->mapping_stale = FALSE;
+}
+
+/**
+ * Connect to a display and ask the server which extensions it has, without waiting for the answer.
+ *
+ * @return The connection, or NULL if the display is not available
+ */
+static KpXcbConnection *
+open_connection(const gchar *display_name) {
+    xcb_connection_t *xcb_connection = xcb_connect(display_name, NULL);
+
+    if (xcb_connection_has_error(xcb_connection)) {
+        fprintf(stderr, "Display %s not available.\n", display_name);
+        xcb_disconnect(xcb_connection);
+        return NULL;
+    }
+
+    KpXcbConnection *connection = g_new0(KpXcbConnection, 1);
+    connection->connection = xcb_connection;
+    connection->display_name = g_strdup(display_name);
+
+    xcb_prefetch_extension_data(xcb_connection, &xcb_input_id);
+    xcb_prefetch_extension_data(xcb_connection, &xcb_xkb_id);
+    xcb_flush(xcb_connection);
+
+    return connection;
+}
+
+/**
+ * Send every request which configures the display. The extension replies have been prefetched,
+ * so this only waits for the first of them.
+ *
+ * @param features KpKeyboardFeatures mask which decides which events are selected
+ * @return FALSE if the display does not have the X Input extension
+ */
+static gboolean
+send_setup_requests(KpXcbConnection *connection, KpKeyboardFeatures features) {
+    xcb_connection_t *xcb_connection = connection->connection;
+    const xcb_query_extension_reply_t *xi_extension = xcb_get_extension_data(xcb_connection, &xcb_input_id);
+    const xcb_query_extension_reply_t *xkb_extension = xcb_get_extension_data(xcb_connection, &xcb_xkb_id);
+
+    if (xi_extension == NULL || !xi_extension->present) {
+        fprintf(stderr, "X Input extension not available for display %s.\n", connection->display_name);
+        return FALSE;
+    }
+
+    connection->xi_extension_opcode = xi_extension->major_opcode;
+    connection->xi_version_cookie = xcb_input_xi_query_version(xcb_connection, 2, 0);
+
+    xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(xcb_connection)).data->root;
+    struct {
+        xcb_input_event_mask_t header;
+        guint32 mask;
+        xcb_input_event_mask_t hierarchy_header;
+        guint32 hierarchy_mask;
+    } event_masks = {
+            .header = {.deviceid = XCB_INPUT_DEVICE_ALL_MASTER, .mask_len = 1},
+            .mask = XCB_INPUT_XI_EVENT_MASK_RAW_KEY_PRESS | XCB_INPUT_XI_EVENT_MASK_RAW_KEY_RELEASE,
+
+            // Hierarchy changes are only delivered to selections for all devices
+            .hierarchy_header = {.deviceid = XCB_INPUT_DEVICE_ALL, .mask_len = 1},
+            .hierarchy_mask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY,
+    };
+
+    // Raw motion is an event type of its own, so selecting the buttons never floods the poll task with pointer motion
+    if (features & KP_KEYBOARD_FEATURE_BUTTONS) {
+        event_masks.mask |= XCB_INPUT_XI_EVENT_MASK_RAW_BUTTON_PRESS | XCB_INPUT_XI_EVENT_MASK_RAW_BUTTON_RELEASE;
+    }
+
+    xcb_input_xi_select_events(xcb_connection, root, 2, &event_masks.header);
+
+    // Slaves which are plugged in later are added by XI_HierarchyChanged, selected before this query so none is missed
+    connection->xi_devices_cookie = xcb_input_xi_query_device(xcb_connection, XCB_INPUT_DEVICE_ALL);
+
+    if (xkb_extension != NULL && xkb_extension->present) {
+        guint16 xkb_events = XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY | XCB_XKB_EVENT_TYPE_MAP_NOTIFY;
+
+        connection->xkb_available = TRUE;
+        connection->xkb_event_base = xkb_extension->first_event;
+        connection->xkb_version_cookie = xcb_xkb_use_extension(xcb_connection, XCB_XKB_MAJOR_VERSION,
+                                                               XCB_XKB_MINOR_VERSION);
+        xcb_xkb_select_events(xcb_connection, XCB_XKB_ID_USE_CORE_KBD, xkb_events, 0, xkb_events, 0, 0, NULL);
+    }
+
+    send_keymap_request(connection);
+    xcb_flush(xcb_connection);
+
+    return TRUE;
+}
+
+/**
+ * Collect the replies of the setup requests.
+ *
+ * @return FALSE if the display can not deliver raw key events
+ */
+static gboolean
+receive_setup_replies(KpXcbConnection *connection) {
+    xcb_connection_t *xcb_connection = connection->connection;
+
+    xcb_input_xi_query_version_reply_t *xi_version =
+            xcb_input_xi_query_version_reply(xcb_connection, connection->xi_version_cookie, NULL);
+    gboolean usable = xi_version != NULL && xi_version->major_version >= 2;
+    free(xi_version);
+
+    xcb_input_xi_query_device_reply_t *xi_devices =
+            xcb_input_xi_query_device_reply(xcb_connection, connection->xi_devices_cookie, NULL);
+    if (xi_devices != NULL) {
+        xcb_input_xi_device_info_iterator_t iterator = xcb_input_xi_query_device_infos_iterator(xi_devices);
+
+        for (; iterator.rem > 0; xcb_input_xi_device_info_next(&iterator)) {
+            if (iterator.data->type == XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD && iterator.data->enabled) {
+                kp_x11_device_table_add(&connection->devices, iterator.data->deviceid);
+            }
+        }
+
+        free(xi_devices);
+    }
+
+    if (connection->xkb_available) {
+        xcb_xkb_use_extension_reply_t *xkb_version =
+                xcb_xkb_use_extension_reply(xcb_connection, connection->xkb_version_cookie, NULL);
+        connection->xkb_available = xkb_version != NULL && xkb_version->supported;
+        free(xkb_version);
+    }
+
+    xcb_get_keyboard_mapping_reply_t *mapping =
+            xcb_get_keyboard_mapping_reply(xcb_connection, connection->mapping_cookie, NULL);
+    connection->mapping_pending = FALSE;
+    build_keymap(connection, mapping);
+    free(mapping);
+
+    if (!usable) {
+        fprintf(stderr, "X Input 2 not available for display %s.\n", connection->display_name);
+    }
+
+    return usable;
+}
+
+static KpXcbProbeQueue *
+probe_queue_ref(KpXcbProbeQueue *queue) {
+    g_atomic_int_inc(&queue->ref_count);
+
+    return queue;
+}
+
+static void
+probe_free(KpXcbProbe *probe) {
+    connection_free(probe->connection);
+    g_free(probe->display_name);
+    g_free(probe);
+}
+
+static void
+probe_queue_unref(KpXcbProbeQueue *queue) {
+    if (!g_atomic_int_dec_and_test(&queue->ref_count)) {
+        return;
+    }
+
+    KpXcbProbe *probe;
+    while ((probe = g_async_queue_try_pop(queue->results)) != NULL) {
+        probe_free(probe);
+    }
+
+    g_async_queue_unref(queue->results);
+    g_free(queue);
+}
+
+/**
+ * GThreadPool worker which connects to one display and configures it, every blocking call happens here.
+ */
+static void
+probe_display(gpointer probe_p, gpointer UNUSED(user_data)) {
+    KpXcbProbe *probe = probe_p;
+    KpXcbProbeQueue *queue = probe->queue;
+
+    if (!g_atomic_int_get(&queue->cancelled)) {
+        probe->connection = open_connection(probe->display_name);
+    }
+
+    if (probe->connection != NULL
+        && (!send_setup_requests(probe->connection, probe->features) || !receive_setup_replies(probe->connection))) {
+        g_clear_pointer(&probe->connection, connection_free);
+    }
+
+    // The probe belongs to the queue from now on, it is freed with the queue if nobody waits for it anymore.
+    g_async_queue_push(queue->results, probe);
+    probe_queue_unref(queue);
+}
+
+gpointer
+kp_keyboard_init(GtkWindow *UNUSED(window), KpKeyboardFeatures features) {
+    KpXcbKeyboardData *data = g_new0(KpXcbKeyboardData, 1);
+    KpXcbProbeQueue *queue = g_new0(KpXcbProbeQueue, 1);
+    GThreadPool *pool = g_thread_pool_new(probe_display, NULL, DEFAULT_DISPLAY_PROBE_THREADS, FALSE, NULL);
+    guint probes_pending = 0;
+
+    data->connections = g_ptr_array_new();
+    data->features = features;
+    queue->ref_count = 1;
+    queue->results = g_async_queue_new();
+
+    DIR* d = opendir("/tmp/.X11-unix");
+
+    if (d != NULL) {
+        struct dirent *dr;
+        while ((dr = readdir(d)) != NULL) {
+            if (dr->d_name[0] != 'X')
+                continue;
+
+            KpXcbProbe *probe = g_new0(KpXcbProbe, 1);
+            probe->display_name = g_strconcat(":", dr->d_name + 1, NULL);
+            probe->queue = probe_queue_ref(queue);
+            probe->features = features;
+
+            probes_pending++;
+            g_thread_pool_push(pool, probe, NULL);
+        }
+
+        closedir(d);
+    }
+
+    // A display which does not answer before the deadline is given up, its probe is freed when it finishes.
+    gint64 deadline = g_get_monotonic_time() + DEFAULT_DISPLAY_PROBE_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+
+    for (; probes_pending > 0; --probes_pending) {
+        gint64 remaining = deadline - g_get_monotonic_time();
+        if (remaining <= 0) break;
+
+        KpXcbProbe *probe = g_async_queue_timeout_pop(queue->results, remaining);
+        if (probe == NULL) break;
+
+        if (probe->connection != NULL) {
+            probe->connection->index = data->connections->len;
+            g_ptr_array_add(data->connections, probe->connection);
+            probe->connection = NULL;
+        }
+
+        probe_free(probe);
+    }
+
+    if (probes_pending > 0) {
+        fprintf(stderr, "Gave up on %u displays which did not answer in time.\n", probes_pending);
+    }
+
+    // Do not wait: a probe may be stuck connecting to an unresponsive server.
+    g_atomic_int_set(&queue->cancelled, TRUE);
+    g_thread_pool_free(pool, FALSE, FALSE);
+    probe_queue_unref(queue);
+
+    return data;
+}
+
+gchar *
+kp_keyboard_get_layout_name(gpointer internal_keyboard_data) {
+    KpXcbKeyboardData *data = XCB_KEYBOARD_DATA(internal_keyboard_data);
+    gchar *layout = NULL;
+
+    if (data->connections->len == 0) {
+        return NULL;
+    }
+
+    KpXcbConnection *connection = g_ptr_array_index(data->connections, 0);
+    xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(connection->connection)).data->root;
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
+            connection->connection,
+            xcb_intern_atom(connection->connection, TRUE, strlen(X11_XKB_RULES_NAMES), X11_XKB_RULES_NAMES),
+            NULL);
+
+    if (atom_reply == NULL || atom_reply->atom == XCB_ATOM_NONE) {
+        free(atom_reply);
+        return NULL;
+    }
+
+    xcb_get_property_reply_t *property_reply = xcb_get_property_reply(
+            connection->connection,
+            xcb_get_property(connection->connection, FALSE, root, atom_reply->atom, XCB_ATOM_STRING, 0, 1024),
+            NULL);
+
+    if (property_reply != NULL && property_reply->type == XCB_ATOM_STRING && property_reply->format == 8) {
+        layout = kp_x11_rules_names_get_layout(xcb_get_property_value(property_reply),
+                                               xcb_get_property_value_length(property_reply));
+    }
+
+    free(property_reply);
+    free(atom_reply);
+
+    return layout;
+}
+
+guint
+kp_keyboard_get_display_count(gpointer internal_keyboard_data) {
+    return XCB_KEYBOARD_DATA(internal_keyboard_data)->connections->len;
+}
+
+const gchar *
+kp_keyboard_get_display_name(gpointer internal_keyboard_data, guint index) {
+    KpXcbConnection *connection = g_ptr_array_index(XCB_KEYBOARD_DATA(internal_keyboard_data)->connections, index);
+
+    return connection->display_name;
+}
+
+KpKeyModel *
+kp_keyboard_get_keys(GtkWindow *UNUSED(window), gpointer internal_keyboard_data) {
+    KpKeyModel *result = kp_key_model_new();
+    KpXcbKeyboardData *data = XCB_KEYBOARD_DATA(internal_keyboard_data);
+
+    // The model rejects keycodes it already contains, so keys which exist on several displays are added once.
+    for (guint i = 0; i < data->connections->len; ++i) {
+        KpXcbConnection *connection = g_ptr_array_index(data->connections, i);
+
+        for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+            KpX11KeymapEntry *entry = &connection->keymap.entries[keycode];
+
+            if (entry->label == NULL || !kp_x11_keysym_is_allowed(entry->keysym)) continue;
+
+            entry->displayed = TRUE;
+            kp_key_model_add(result, keycode, entry->label);
+        }
+    }
+
+    if (data->features & KP_KEYBOARD_FEATURE_BUTTONS) {
+        for (int button = 1; button < KP_KEY_BUTTON_COUNT; ++button) {
+            kp_key_model_add(result, button, X11_BUTTON_LABELS[button]);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Ask for the new keymap after the server has announced a mapping change.
+ * Changes which arrive while a request is in flight are coalesced into one more request.
+ */
+static void
+on_keymap_changed(KpXcbConnection *connection) {
+    if (connection->mapping_pending) {
+        connection->mapping_stale = TRUE;
+        return;
+    }
+
+    send_keymap_request(connection);
+    xcb_flush(connection->connection);
+}
+
+/**
+ * Apply the reply of a keymap refresh if it has arrived, and send the new labels of displayed keys to the user interface.
+ */
+static void
+receive_keymap(KpPollTaskResult *result, KpXcbConnection *connection) {
+    xcb_get_keyboard_mapping_reply_t *reply = NULL;
+    xcb_generic_error_t *error = NULL;
+    gchar *old_labels[X11_KEYMAP_SIZE];
+
+    if (!connection->mapping_pending
+        || !xcb_poll_for_reply(connection->connection, connection->mapping_cookie.sequence, (void **) &reply, &error)) {
+        return;
+    }
+
+    connection->mapping_pending = FALSE;
+    free(error);
+
+    if (connection->mapping_stale || reply == NULL) {
+        free(reply);
+        on_keymap_changed(connection);
+        return;
+    }
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        old_labels[keycode] = connection->keymap.entries[keycode].label;
+    }
+
+    build_keymap(connection, reply);
+    connection->keymap_refreshes++;
+    free(reply);
+
+    for (int keycode = 0; keycode < X11_KEYMAP_SIZE; ++keycode) {
+        KpX11KeymapEntry *entry = &connection->keymap.entries[keycode];
+
+        if (!entry->displayed || entry->label == NULL || g_strcmp0(entry->label, old_labels[keycode]) == 0) continue;
+
+        KpKeyboardPoll poll = {
+                .result = POLL_KEYMAP_CHANGED,
+                .key = {.code = keycode, .label = entry->label, .modifier = entry->modifier},
+                .pressed = FALSE,
+                .display = connection->index,
+        };
+
+        kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+    }
+}
+
+/**
+ * Update the device table for slaves which have been added, removed, enabled or disabled.
+ */
+static void
+on_hierarchy_changed(KpXcbConnection *connection, xcb_input_hierarchy_event_t *event) {
+    xcb_input_hierarchy_info_t *infos = xcb_input_hierarchy_infos(event);
+    int count = xcb_input_hierarchy_infos_length(event);
+
+    for (int i = 0; i < count; ++i) {
+        if (infos[i].flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED | XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED)) {
+            kp_x11_device_table_remove(&connection->devices, infos[i].deviceid);
+        } else if (infos[i].flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED | XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED)
+                   && infos[i].type == XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD && infos[i].enabled) {
+            kp_x11_device_table_add(&connection->devices, infos[i].deviceid);
+        }
+    }
+}
+
+static void
+dispatch_event(KpPollTaskResult *result, KpXcbConnection *connection, xcb_generic_event_t *event) {
+    guint8 response_type = event->response_type & ~0x80;
+
+    connection->events_received++;
+    kp_stats_count_event(result->stats, connection->index);
+
+    if (response_type == XCB_MAPPING_NOTIFY) {
+        if (((xcb_mapping_notify_event_t *) event)->request == XCB_MAPPING_KEYBOARD) {
+            on_keymap_changed(connection);
+        }
+        return;
+    }
+
+    if (connection->xkb_available && response_type == connection->xkb_event_base) {
+        // Every XKB event carries its XKB type in the second byte
+        switch (((xcb_xkb_map_notify_event_t *) event)->xkbType) {
+            case XCB_XKB_MAP_NOTIFY:
+            case XCB_XKB_NEW_KEYBOARD_NOTIFY:
+                on_keymap_changed(connection);
+        }
+        return;
+    }
+
+    if (response_type != XCB_GE_GENERIC
+        || ((xcb_ge_generic_event_t *) event)->extension != connection->xi_extension_opcode) {
+        return;
+    }
+
+    switch (((xcb_ge_generic_event_t *) event)->event_type) {
+        case XCB_INPUT_RAW_KEY_RELEASE:
+        case XCB_INPUT_RAW_KEY_PRESS: {
+            xcb_input_raw_key_press_event_t *ev = (xcb_input_raw_key_press_event_t *) event;
+
+            if (ev->detail >= X11_KEYMAP_SIZE) break;
+
+            KpX11KeymapEntry *entry = &connection->keymap.entries[ev->detail];
+            if (NULL == entry->label) break;
+
+            KpKeyboardPoll poll = {
+                    .result = POLL_OK,
+                    .key = {.code = ev->detail, .label = entry->label, .modifier = entry->modifier},
+                    .pressed = ev->event_type == XCB_INPUT_RAW_KEY_PRESS ? TRUE : FALSE,
+                    .time = ev->time,
+                    .display = connection->index,
+                    .device = kp_x11_device_table_get_slot(&connection->devices, ev->sourceid),
+            };
+
+            connection->key_events++;
+            kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+            break;
+        }
+        case XCB_INPUT_RAW_BUTTON_RELEASE:
+        case XCB_INPUT_RAW_BUTTON_PRESS: {
+            xcb_input_raw_button_press_event_t *ev = (xcb_input_raw_button_press_event_t *) event;
+
+            if (!kp_key_is_button(ev->detail)) break;
+
+            KpKeyboardPoll poll = {
+                    .result = POLL_OK,
+                    .key = {.code = ev->detail, .label = X11_BUTTON_LABELS[ev->detail]},
+                    .pressed = ev->event_type == XCB_INPUT_RAW_BUTTON_PRESS ? TRUE : FALSE,
+                    .time = ev->time,
+                    .display = connection->index,
+            };
+
+            connection->button_events++;
+            kp_event_ring_push_wait(result->event_ring, &poll, result->cancellable);
+            break;
+        }
+        case XCB_INPUT_HIERARCHY:
+            on_hierarchy_changed(connection, (xcb_input_hierarchy_event_t *) event);
+    }
+}
+
+/**
+ * Dispatch every event which is queued on the connection, including the ones XCB has already read into its own buffer.
+ * While the event ring is full, dispatching waits for the main loop and the server keeps queuing events on the socket.
+ *
+ * @return FALSE if the connection has been closed by the server
+ */
+static gboolean
+dispatch_pending_events(KpPollTaskResult *result, KpXcbConnection *connection) {
+    xcb_generic_event_t *event;
+
+    while ((event = xcb_poll_for_event(connection->connection)) != NULL) {
+        dispatch_event(result, connection, event);
+        free(event);
+    }
+
+    // Reading the events has also read any reply which arrived with them.
+    receive_keymap(result, connection);
+    kp_event_ring_notify(result->event_ring);
+
+    return !xcb_connection_has_error(connection->connection);
+}
+
+static void
+close_connections(KpXcbKeyboardData *keyboard_data) {
+    for (guint i = 0; i < keyboard_data->connections->len; ++i) {
+        connection_free(g_ptr_array_index(keyboard_data->connections, i));
+    }
+
+    g_ptr_array_set_size(keyboard_data->connections, 0);
+}
+
+void
+kp_keyboard_poll_task(GTask *task, gpointer UNUSED(source_obj), gpointer poll_task_result, GCancellable *cancellable) {
+    KpPollTaskResult *result = poll_task_result;
+    KpXcbKeyboardData *keyboard_data = XCB_KEYBOARD_DATA(result->keyboard_data);
+    struct epoll_event ready_events[DEFAULT_POLL_MAX_EVENTS];
+    GError *error = NULL;
+    int cancel_fd = -1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        close_connections(keyboard_data);
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(errno),
+                                "Could not create epoll instance: %s", g_strerror(errno));
+        return;
+    }
+
+    cancel_fd = g_cancellable_get_fd(cancellable);
+    if (cancel_fd >= 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &POLL_CANCEL_TAG};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cancel_fd, &event) < 0) {
+            fprintf(stderr, "Could not watch cancellation fd: %s\n", g_strerror(errno));
+        }
+    }
+
+    for (guint i = 0; i < keyboard_data->connections->len; ++i) {
+        KpXcbConnection *connection = g_ptr_array_index(keyboard_data->connections, i);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, xcb_get_file_descriptor(connection->connection), &event) < 0) {
+            fprintf(stderr, "Could not watch display %s: %s\n", connection->display_name, g_strerror(errno));
+        }
+
+        // Events may have been queued while the display was being configured.
+        dispatch_pending_events(result, connection);
+    }
+
+    while (!g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        int ready_count = epoll_wait(epoll_fd, ready_events, DEFAULT_POLL_MAX_EVENTS, -1);
+
+        if (ready_count < 0) {
+            if (errno == EINTR) continue;
+
+            g_set_error(&error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Could not wait for display events: %s", g_strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready_count; ++i) {
+            KpXcbConnection *connection = ready_events[i].data.ptr;
+
+            if (ready_events[i].data.ptr == &POLL_CANCEL_TAG) continue;
+
+            if (!dispatch_pending_events(result, connection)) {
+                fprintf(stderr, "Lost connection to display %s.\n", connection->display_name);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, xcb_get_file_descriptor(connection->connection), NULL);
+            }
+        }
+    }
+
+    if (cancel_fd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+
+    close(epoll_fd);
+    close_connections(keyboard_data);
+
+    g_task_return_error(task, error);
+}
+
+void
+kp_keyboard_free(gpointer internal_keyboard_data) {
+    KpXcbKeyboardData *data = XCB_KEYBOARD_DATA(internal_keyboard_data);
+
+    if (data == NULL) {
+        return;
+    }
+
+    close_connections(data);
+    g_ptr_array_unref(data->connections);
+    g_free(data);
+}
@@ -0,0 +1,140 @@
+/*
+ * KeyPresenter - A graphical visualisation tool for computer input
+ * Copyright (C) 2020  hypothermic <admin@hypothermic.nl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file xcb.h
+ * @brief Internal data structures for the XCB keyboard backend
+ */
+
+#ifndef KEYPRESENTER_XCB_H
+#define KEYPRESENTER_XCB_H
+
+#include <glib.h>
+#include <xcb/xcb.h>
+#include <xcb/xinput.h>
+#include <xcb/xkb.h>
+
+#include <keypresenter/keyboard.h>
+#include "x11devices.h"
+#include "x11keymap.h"
+
+#define XCB_KEYBOARD_DATA(keyboard_data) (((KpXcbKeyboardData*) keyboard_data))
+
+typedef struct _XcbConnection KpXcbConnection;
+typedef struct _XcbProbeQueue KpXcbProbeQueue;
+typedef struct _XcbProbe KpXcbProbe;
+typedef struct _XcbKeyboardData KpXcbKeyboardData;
+
+/**
+ * One display and the requests which are in flight on it.
+ */
+struct _XcbConnection {
+    xcb_connection_t *connection;
+    gchar *display_name;
+
+    /**
+     * Position of the connection in the connections array
+     */
+    guint index;
+
+    /**
+     * Major opcode of the XInput extension on this display
+     */
+    guint8 xi_extension_opcode;
+
+    /**
+     * Event code of the XKB extension, only valid if xkb_available is TRUE
+     */
+    guint8 xkb_event_base;
+    gboolean xkb_available;
+
+    KpX11Keymap keymap;
+
+    /**
+     * Slots of the slave keyboards, kept up to date by XI_HierarchyChanged
+     */
+    KpX11DeviceTable devices;
+
+    /**
+     * Setup requests, their replies are collected after every display has been sent its requests
+     */
+    xcb_input_xi_query_version_cookie_t xi_version_cookie;
+    xcb_input_xi_query_device_cookie_t xi_devices_cookie;
+    xcb_xkb_use_extension_cookie_t xkb_version_cookie;
+
+    /**
+     * Outstanding GetKeyboardMapping request, the poll task picks up its reply without blocking
+     */
+    xcb_get_keyboard_mapping_cookie_t mapping_cookie;
+    gboolean mapping_pending;
+
+    /**
+     * TRUE if the mapping changed again while a request was pending, its reply is then outdated
+     */
+    gboolean mapping_stale;
+
+    /**
+     * Event counters, only written by the poll task
+     */
+    guint64 events_received;
+    guint64 key_events;
+    guint64 button_events;
+    guint64 keymap_refreshes;
+};
+
+/**
+ * Results of display probes. Reference counted, so a probe which finishes after kp_keyboard_init has stopped waiting
+ * can still deliver its result, which is then freed together with the queue.
+ */
+struct _XcbProbeQueue {
+    gint ref_count;
+
+    /**
+     * TRUE once nobody is interested in new results, queued probes then skip connecting
+     */
+    gint cancelled;
+
+    /**
+     * Queue with KpXcbProbe pointer element type
+     */
+    GAsyncQueue *results;
+};
+
+struct _XcbProbe {
+    gchar *display_name;
+    KpXcbProbeQueue *queue;
+    KpKeyboardFeatures features;
+
+    /**
+     * Configured connection, or NULL if the display is not usable
+     */
+    KpXcbConnection *connection;
+};
+
+struct _XcbKeyboardData {
+    /**
+     * An array with KpXcbConnection pointer element type
+     */
+    GPtrArray *connections;
+
+    /**
+     * KpKeyboardFeatures mask given to kp_keyboard_init
+     */
+    KpKeyboardFeatures features;
+};
+
+#endif //KEYPRESENTER_XCB_H